@@ -28,6 +28,8 @@
 
 #include <openssl/evp.h>
 
+#include "srec.h"
+
 ssize_t
 read_line(char *out, size_t outmax) {
 	ssize_t ret;
@@ -124,14 +126,15 @@ untwist(unsigned char *buf, int len) {
 
 int
 main(int argc, char *argv[]) {
-	int declen, infd, outfd, ret;
+	int declen, idxfd, infd, outfd, ret;
 	ssize_t sret;
+	struct srec_index *idx = NULL;
 	uint8_t keybuffer[24], ivbuffer[8];
 	unsigned char buf[4096], decbuf[4096];
 	EVP_CIPHER_CTX *ectx;
 
 	if (argc < 3) {
-		errx(EXIT_FAILURE, "<xb24_15_4_ABCD.ehx> <out.hex>");
+		errx(EXIT_FAILURE, "<xb24_15_4_ABCD.ehx> <out.hex> [out.idx]");
 	}
 	if ( (infd = open(argv[1], O_RDONLY)) < 0) {
 		err(EXIT_FAILURE, "open");
@@ -139,6 +142,9 @@ main(int argc, char *argv[]) {
 	if ( (outfd = creat(argv[2], S_IRUSR|S_IWUSR)) < 0) {
 		err(EXIT_FAILURE, "creat");
 	}
+	if (argc > 3 && (idx = srec_index_new(SREC_BLOCK_SIZE)) == NULL) {
+		err(EXIT_FAILURE, "srec_index_new");
+	}
 
 	/* generate key/iv from password */
 	if ( (ret = kdf_simple(keybuffer, ivbuffer)) < 0) {
@@ -179,10 +185,34 @@ main(int argc, char *argv[]) {
 		if ( (sret = write(outfd, decbuf, declen)) < 0) {
 			err(EXIT_FAILURE, "write");
 		}
+
+		/* index the S-records as they stream past */
+		if (idx && srec_index_feed(idx, (const char *)decbuf, declen) < 0) {
+			err(EXIT_FAILURE, "srec_index_feed");
+		}
 	}
 
 	EVP_CIPHER_CTX_free(ectx);
 
+	if (idx) {
+		if (srec_index_finish(idx) < 0) {
+			err(EXIT_FAILURE, "srec_index_finish");
+		}
+		srec_index_sort(idx);
+		if ( (idxfd = creat(argv[3], S_IRUSR|S_IWUSR)) < 0) {
+			err(EXIT_FAILURE, "creat");
+		}
+		if (srec_index_write(idx, idxfd) < 0) {
+			err(EXIT_FAILURE, "srec_index_write");
+		}
+		close(idxfd);
+		if (idx->bad_records) {
+			warnx("%u of %u data records failed to parse",
+					idx->bad_records, idx->records);
+		}
+		srec_index_free(idx);
+	}
+
 	return EXIT_SUCCESS;
 }
 
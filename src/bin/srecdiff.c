@@ -0,0 +1,157 @@
+/*
+ * srecdiff: report changed address ranges between two firmware images
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "srec.h"
+
+enum region_kind {
+	REGION_SAME = 0,
+	REGION_CHANGED,
+	REGION_ADDED,
+	REGION_REMOVED,
+};
+
+static const char *region_names[] = { "same", "changed", "added", "removed" };
+
+struct region {
+	enum region_kind kind;
+	uint32_t block, start, end;
+};
+
+static int nregions;
+
+/*
+ * find the run of segments starting at pos that fall into block
+ */
+static uint32_t
+block_span(struct srec_index *idx, uint32_t pos, uint32_t block, uint32_t *lo, uint32_t *hi) {
+	uint32_t end = pos;
+
+	/* segments are sorted, so the first one holds the lowest address */
+	while (end < idx->nsegs && idx->segs[end].start / idx->block_size == block) {
+		if (end == pos) {
+			*lo = idx->segs[end].start;
+		}
+		if (idx->segs[end].end > *hi) {
+			*hi = idx->segs[end].end;
+		}
+		end++;
+	}
+
+	return end;
+}
+
+static void
+region_emit(struct region *r) {
+	if (r->kind == REGION_SAME) {
+		return;
+	}
+
+	printf("%-8s 0x%08x-0x%08x (%u bytes)\n", region_names[r->kind],
+			r->start, r->end - 1, r->end - r->start);
+	nregions++;
+}
+
+static void
+region_add(struct region *cur, enum region_kind kind, uint32_t block, uint32_t start, uint32_t end) {
+	if (cur->kind == kind && kind != REGION_SAME && block == cur->block + 1) {
+		cur->block = block;
+		if (end > cur->end) {
+			cur->end = end;
+		}
+		return;
+	}
+
+	region_emit(cur);
+	cur->kind = kind;
+	cur->block = block;
+	cur->start = start;
+	cur->end = end;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct srec_index *a, *b;
+	struct region cur = { REGION_SAME, 0, 0, 0 };
+	uint32_t i, j, ie, je, k, block, alo, ahi, blo, bhi;
+	enum region_kind kind;
+
+	if (argc != 3) {
+		errx(EXIT_FAILURE, "<old.hex|old.idx> <new.hex|new.idx>");
+	}
+
+	if ( (a = srec_index_load(argv[1])) == NULL) {
+		err(EXIT_FAILURE, "failed to load %s", argv[1]);
+	}
+	if ( (b = srec_index_load(argv[2])) == NULL) {
+		err(EXIT_FAILURE, "failed to load %s", argv[2]);
+	}
+	if (a->block_size != b->block_size) {
+		errx(EXIT_FAILURE, "index block sizes differ: %u vs %u",
+				a->block_size, b->block_size);
+	}
+
+	/* walk both sorted indexes one block at a time */
+	for(i = j = 0; i < a->nsegs || j < b->nsegs; i = ie, j = je) {
+		if (j >= b->nsegs || (i < a->nsegs && a->segs[i].start < b->segs[j].start)) {
+			block = a->segs[i].start / a->block_size;
+		}
+		else {
+			block = b->segs[j].start / b->block_size;
+		}
+
+		alo = ahi = blo = bhi = 0;
+		ie = block_span(a, i, block, &alo, &ahi);
+		je = block_span(b, j, block, &blo, &bhi);
+
+		if (ie == i) {
+			region_add(&cur, REGION_ADDED, block, blo, bhi);
+			continue;
+		}
+		if (je == j) {
+			region_add(&cur, REGION_REMOVED, block, alo, ahi);
+			continue;
+		}
+
+		kind = REGION_SAME;
+		if (ie - i != je - j) {
+			kind = REGION_CHANGED;
+		}
+		for(k = 0; kind == REGION_SAME && k < ie - i; k++) {
+			if (a->segs[i + k].start != b->segs[j + k].start ||
+					a->segs[i + k].end != b->segs[j + k].end ||
+					a->segs[i + k].crc != b->segs[j + k].crc) {
+				kind = REGION_CHANGED;
+			}
+		}
+
+		region_add(&cur, kind, block, alo < blo ? alo : blo, ahi > bhi ? ahi : bhi);
+	}
+	region_emit(&cur);
+
+	srec_index_free(a);
+	srec_index_free(b);
+
+	return nregions ? 1 : EXIT_SUCCESS;
+}
+
+// vim: cindent
@@ -39,23 +39,11 @@
 #include <unistd.h>
 
 #include "xb_ctx.h"
+#include "xb_serial.h"
 
 extern char *optarg;
 extern int optind;
 
-void
-wait_for_ok(int fd) {
-	char buf[1];
-
-	do {
-		if (read(fd, buf, 1) > 0 && *buf == 'O')
-			break;
-		usleep(100000);
-	} while (1);
-	read(fd, buf, 1);
-	read(fd, buf, 1);
-}
-
 #ifdef __APPLE__
 #   define xb_read(...) read(__VA_ARGS__)
 #else
@@ -252,27 +240,23 @@ serial_setup(struct xb_ctx *xctx, struct termios *serial) {
 	 * 9600 is the default baudrate for the XBee in API/AT mode.
 	 * The serial paramters should be 8-N-1.
 	 */
-
-#ifndef __APPLE__
-	bzero(serial, sizeof(*serial));
-#endif
-	serial->c_cflag = B9600 | CS8 | CLOCAL | CREAD;
-	/* blocking reads */
-	serial->c_cc[VMIN] = 1;
-	serial->c_cc[VTIME] = 0;
+	if (xb_serial_setup(xctx) || tcgetattr(xctx->xbfd, serial)) {
+		err(EXIT_FAILURE, "error setting baudrate %u & 8%c%u",
+				xctx->baud, xctx->parity, xctx->stop_bits);
+	}
 	if (xctx->api_mode == XB_AT) {
 		/* this makes reading much easier on AT mode */
 		serial->c_lflag = ICANON;
 		serial->c_iflag = ICRNL;
-	}
-	if (tcsetattr(xctx->xbfd, TCSANOW, serial)) {
-		err(EXIT_FAILURE, "error setting baudrate 9600 & 8N1");
+		if (tcsetattr(xctx->xbfd, TCSANOW, serial)) {
+			err(EXIT_FAILURE, "error setting canonical mode");
+		}
 	}
 }
 
 void
 usage(const char *argv0, int status) {
-	fprintf(stderr, "Usage: %s [-A api_mode] [-d /dev/ttyX] firmware.ebl\n", argv0);
+	fprintf(stderr, "Usage: %s [-A api_mode|auto] [-b baud] [-d /dev/ttyX] firmware.ebl\n", argv0);
 	exit(status);
 }
 
@@ -296,10 +280,9 @@ program_local(int fwfd, struct xb_ctx *xctx) {
 	/* enter command mode */
 	if (!xctx->api_mode) {
 		printf("Entering AT command mode...\n");
-		sleep(1);
-		write(xctx->xbfd, "+++", 3);
-		sleep(1);
-		wait_for_ok(xctx->xbfd);
+		if (xb_enter_command_mode(xctx) < 0) {
+			errx(EXIT_FAILURE, "failed to enter AT command mode");
+		}
 	}
 
 	printf("Entering bootloader...\n");
@@ -383,9 +366,9 @@ program_local(int fwfd, struct xb_ctx *xctx) {
 	xb_write(xctx->xbfd, "2", 1);
 
 	/* cleanup */
-	cfsetspeed(&serial, B9600);
+	cfsetspeed(&serial, xb_baud_to_speed(xctx->baud));
 	if (tcsetattr(xctx->xbfd, TCSANOW, &serial)) {
-		err(EXIT_FAILURE, "failed to set 9600bps");
+		err(EXIT_FAILURE, "failed to set %ubps", xctx->baud);
 	}
 
 	return EXIT_SUCCESS;
@@ -397,15 +380,30 @@ main(int argc, char *argv[]) {
 	enum xb_api_mode api_mode = XB_AT;
 	int fwfd, i;
 	struct xb_ctx *xctx;
+	uint32_t baud = 0;
 
 	ttydev = "/dev/ttyUSB0";
 
-	while ( (i = getopt(argc, argv, "A:d:")) != -1) {
+	while ( (i = getopt(argc, argv, "A:b:d:")) != -1) {
 		switch (i) {
 		case 'A':
+			if (!strcmp(optarg, "auto")) {
+				api_mode = XB_AUTO;
+				break;
+			}
+
 			api_mode = atoi(optarg);
 
-			if (api_mode > 2) {
+			if (api_mode < 0 || api_mode > 2) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'b':
+			baud = (uint32_t)strtoul(optarg, NULL, 10);
+
+			if (xb_baud_to_speed(baud) == B0) {
 				usage(argv[0], EXIT_FAILURE);
 			}
 
@@ -430,7 +428,8 @@ main(int argc, char *argv[]) {
 		err(EXIT_FAILURE, "failed to open firmware file: %s", fwfile);
 	}
 
-	xctx = xb_open(ttydev, api_mode);
+	/* with -b the radio is probed at that rate only */
+	xctx = xb_open_baud(ttydev, api_mode, baud);
 	if (!xctx) {
 		err(EXIT_FAILURE, "failed to open serial console");
 	}
@@ -438,7 +437,7 @@ main(int argc, char *argv[]) {
 	program_local(fwfd, xctx);
 
 	close(fwfd);
-	//xb_close(xctx);
+	xb_close(xctx);
 
 	return EXIT_SUCCESS;
 }
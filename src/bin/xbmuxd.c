@@ -0,0 +1,653 @@
+/*
+ * xbmuxd: share one radio between many local programs
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Clients connect to a Unix stream socket, open to the owner and group
+ * only (mode 0660), and speak unescaped API frames (API mode 1 framing)
+ * whatever mode the radio is in.  Frame IDs are remapped so clients
+ * cannot collide, and responses go back only to the client that asked.  Everything else the radio sends goes to clients
+ * that subscribed with a control frame:
+ *
+ *   0xfe [type...]	subscribe to these frame types, or all without any
+ *   0xfd		unsubscribe
+ *
+ * A client that stops reading loses frames once its queue fills; it is
+ * told how many with a 0xfc frame carrying a 32-bit count.  A client
+ * with too many requests outstanding is not read from until they are
+ * answered.
+ *
+ * With -r, every frame from the radio is also published in a shared
+ * memory ring (see xb_ring.h) for readers that only listen.  With -S,
+ * traffic counters and response times go to stderr every so many
+ * seconds.  Built with --enable-trace, SIGUSR1 dumps the trace ring to
+ * stderr, as does a serial port error.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "xb_capture.h"
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_ring.h"
+#include "xb_serial.h"
+#include "xb_stats.h"
+#include "xb_trace.h"
+
+#define XBMUXD_SOCKET				"/tmp/xbmuxd.sock"
+#define XBMUXD_CLIENTS_MAX			32
+#define XBMUXD_OUTBUF				65536
+#define XBMUXD_INBUF				4096
+/* requests a client may have outstanding */
+#define XBMUXD_INFLIGHT_MAX			16
+/* a request nobody answers stops counting after this long */
+#define XBMUXD_ID_TIMEOUT_MS			30000
+/* hold radio writes this long to batch them */
+#define XBMUXD_COALESCE_US			500
+
+#define XBMUXD_CTRL_SUBSCRIBE			0xfe
+#define XBMUXD_CTRL_UNSUBSCRIBE			0xfd
+#define XBMUXD_CTRL_DROPPED			0xfc
+
+struct client {
+	int fd;
+	struct xb_decoder dec;
+	struct buffer *in, *out;
+
+	/* a request waiting for a free frame ID */
+	int blocked;
+	struct xb_frame pending;
+
+	int subscribed, all_types;
+	uint8_t types[256];
+
+	unsigned int inflight;
+	uint32_t dropped;
+};
+
+/* who a radio frame ID was handed out for */
+struct idmap {
+	int client;
+	uint8_t client_id;
+	int answered;
+	uint64_t used;
+};
+
+static struct client clients[XBMUXD_CLIENTS_MAX];
+static struct idmap ids[256];
+static volatile sig_atomic_t quit, dump_trace;
+
+static void
+usage(const char *argv0, int status) {
+	fprintf(stderr, "Usage: %s [-A api_mode|auto] [-b baud] [-d /dev/ttyX] [-r /shm-ring] [-s socket] [-S seconds] [-w capture]\n", argv0);
+	exit(status);
+}
+
+static void
+on_signal(int sig) {
+	if (sig == SIGUSR1) {
+		dump_trace = 1;
+		return;
+	}
+	quit = 1;
+}
+
+/*
+ * queue a frame for a client, API mode 1 framing; 0 if it had no room
+ */
+static int
+client_queue(struct client *c, const uint8_t *data, uint16_t len) {
+	struct buffer *out = c->out;
+	uint8_t csum = 0;
+	uint16_t i;
+
+	if (out->readpos == out->writepos) {
+		out->readpos = out->writepos = 0;
+	}
+	if (out->size - out->writepos < (uint64_t)len + 4 && out->readpos) {
+		memmove(out->data, out->data + out->readpos, out->writepos - out->readpos);
+		out->writepos -= out->readpos;
+		out->readpos = 0;
+	}
+	if (out->size - out->writepos < (uint64_t)len + 4) {
+		return 0;
+	}
+
+	out->data[out->writepos++] = (char)XB_FRAME_DELIM;
+	out->data[out->writepos++] = (char)(len >> 8);
+	out->data[out->writepos++] = (char)len;
+	for(i = 0; i < len; i++) {
+		out->data[out->writepos++] = (char)data[i];
+		csum += data[i];
+	}
+	out->data[out->writepos++] = (char)(0xff - csum);
+
+	return 1;
+}
+
+static void
+client_send(struct client *c, const uint8_t *data, uint16_t len) {
+	uint8_t note[5];
+
+	/* first own up to what was lost, if there is room now */
+	if (c->dropped) {
+		note[0] = XBMUXD_CTRL_DROPPED;
+		note[1] = (uint8_t)(c->dropped >> 24);
+		note[2] = (uint8_t)(c->dropped >> 16);
+		note[3] = (uint8_t)(c->dropped >> 8);
+		note[4] = (uint8_t)c->dropped;
+		if (!client_queue(c, note, sizeof(note))) {
+			c->dropped++;
+			return;
+		}
+		c->dropped = 0;
+	}
+
+	if (!client_queue(c, data, len)) {
+		c->dropped++;
+	}
+}
+
+static void
+client_close(int n) {
+	struct client *c = &clients[n];
+	int i;
+
+	close(c->fd);
+	buffer_free(c->in);
+	buffer_free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+
+	/* answers to its requests have nowhere to go */
+	for(i = 0; i < 256; i++) {
+		if (ids[i].client == n) {
+			ids[i].client = -1;
+		}
+	}
+}
+
+static void
+client_accept(int lfd) {
+	struct client *c;
+	int fd, n;
+
+	if ( (fd = accept(lfd, NULL, NULL)) < 0) {
+		return;
+	}
+
+	for(n = 0; n < XBMUXD_CLIENTS_MAX && clients[n].fd >= 0; n++)
+		;
+	if (n == XBMUXD_CLIENTS_MAX) {
+		close(fd);
+		return;
+	}
+
+	c = &clients[n];
+	c->in = buffer_new(XBMUXD_INBUF);
+	c->out = buffer_new(XBMUXD_OUTBUF);
+	if (!c->in || !c->out) {
+		if (c->in) {
+			buffer_free(c->in);
+		}
+		if (c->out) {
+			buffer_free(c->out);
+		}
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	xb_decoder_init(&c->dec, 0);
+}
+
+/*
+ * least recently used frame ID that is not waiting on an answer; one
+ * whose client has gone stays reserved too, or the radio's late reply
+ * would reach whoever got the ID next
+ */
+static int
+id_alloc(uint64_t now) {
+	int i, best = -1;
+
+	for(i = 1; i < 256; i++) {
+		if (!ids[i].answered &&
+				now - ids[i].used < (uint64_t)XBMUXD_ID_TIMEOUT_MS * 1000) {
+			continue;
+		}
+		if (best < 0 || ids[i].used < ids[best].used) {
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void
+id_answered(int id) {
+	if (ids[id].client >= 0 && !ids[id].answered) {
+		clients[ids[id].client].inflight--;
+	}
+	ids[id].answered = 1;
+}
+
+static void
+id_expire(uint64_t now) {
+	int i;
+
+	for(i = 1; i < 256; i++) {
+		if (!ids[i].answered && ids[i].used &&
+				now - ids[i].used >= (uint64_t)XBMUXD_ID_TIMEOUT_MS * 1000) {
+			id_answered(i);
+		}
+	}
+}
+
+/*
+ * pass a client's frame on to the radio; 0 if it has to wait for a
+ * frame ID
+ */
+static int
+client_frame(struct xb_ctx *xctx, int n, struct xb_frame *frame) {
+	struct client *c = &clients[n];
+	uint64_t now;
+	int id, rid;
+	uint16_t i;
+
+	switch (frame->data[0]) {
+	case XBMUXD_CTRL_SUBSCRIBE:
+		c->subscribed = 1;
+		c->all_types = frame->len == 1;
+		memset(c->types, 0, sizeof(c->types));
+		for(i = 1; i < frame->len; i++) {
+			c->types[frame->data[i]] = 1;
+		}
+		return 1;
+	case XBMUXD_CTRL_UNSUBSCRIBE:
+		c->subscribed = 0;
+		return 1;
+	}
+
+	/* requests carry their ID second; 0 asks for no answer */
+	id = xb_frame_id(frame);
+	if (id > 0 && !(frame->data[0] & 0x80)) {
+		now = xb_time_us();
+		if ( (rid = id_alloc(now)) < 0) {
+			return 0;
+		}
+		if (ids[rid].client >= 0 && !ids[rid].answered) {
+			id_answered(rid);
+		}
+		ids[rid].client = n;
+		ids[rid].client_id = (uint8_t)id;
+		ids[rid].answered = 0;
+		ids[rid].used = now;
+		c->inflight++;
+		frame->data[1] = (uint8_t)rid;
+	}
+
+	if (xb_send_frame(xctx, frame) < 0) {
+		err(EXIT_FAILURE, "failed to write to the radio");
+	}
+
+	return 1;
+}
+
+/*
+ * decode and forward whatever the client has sent, until it blocks
+ */
+static void
+client_input(struct xb_ctx *xctx, int n) {
+	struct client *c = &clients[n];
+	struct buffer *in = c->in;
+	size_t used;
+	int done;
+
+	if (c->blocked) {
+		if (!client_frame(xctx, n, &c->pending)) {
+			return;
+		}
+		c->blocked = 0;
+	}
+
+	while (in->readpos < in->writepos && c->inflight < XBMUXD_INFLIGHT_MAX) {
+		used = xb_decoder_feed(&c->dec, (const uint8_t *)in->data + in->readpos,
+				in->writepos - in->readpos, &done);
+		in->readpos += used;
+		if (done && !client_frame(xctx, n, &c->dec.frame)) {
+			c->pending = c->dec.frame;
+			c->blocked = 1;
+			break;
+		}
+	}
+
+	if (in->readpos == in->writepos) {
+		in->readpos = in->writepos = 0;
+	}
+}
+
+static void
+client_read(struct xb_ctx *xctx, int n) {
+	struct client *c = &clients[n];
+	struct buffer *in = c->in;
+	ssize_t ret;
+
+	if (in->readpos) {
+		memmove(in->data, in->data + in->readpos, in->writepos - in->readpos);
+		in->writepos -= in->readpos;
+		in->readpos = 0;
+	}
+
+	ret = read(c->fd, in->data + in->writepos, in->size - in->writepos);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		client_close(n);
+		return;
+	}
+	in->writepos += (uint64_t)ret;
+
+	client_input(xctx, n);
+}
+
+static void
+client_write(int n) {
+	struct client *c = &clients[n];
+	struct buffer *out = c->out;
+	ssize_t ret;
+
+	ret = write(c->fd, out->data + out->readpos, out->writepos - out->readpos);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			client_close(n);
+		}
+		return;
+	}
+	out->readpos += (uint64_t)ret;
+}
+
+/*
+ * a response goes to whoever asked; the rest to every subscriber
+ */
+static void
+radio_frame(struct xb_frame *frame) {
+	struct client *c;
+	int id, n;
+
+	id = xb_frame_id(frame);
+	if (id > 0 && (frame->data[0] & 0x80) && ids[id].used) {
+		id_answered(id);
+		/* ND and friends answer more than once */
+		ids[id].used = xb_time_us();
+		if ( (n = ids[id].client) >= 0) {
+			frame->data[1] = ids[id].client_id;
+			client_send(&clients[n], frame->data, frame->len);
+		}
+		return;
+	}
+
+	for(n = 0; n < XBMUXD_CLIENTS_MAX; n++) {
+		c = &clients[n];
+		if (c->fd >= 0 && c->subscribed && (c->all_types || c->types[frame->data[0]])) {
+			client_send(c, frame->data, frame->len);
+		}
+	}
+}
+
+static int
+listen_socket(const char *path) {
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errx(EXIT_FAILURE, "socket path too long: %s", path);
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		err(EXIT_FAILURE, "socket");
+	}
+	unlink(path);
+	/* whoever may connect can drive the radio: owner and group only */
+	mask = umask(S_IXUSR | S_IXGRP | S_IRWXO);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		err(EXIT_FAILURE, "failed to bind %s", path);
+	}
+	umask(mask);
+	if (listen(fd, 8) < 0) {
+		err(EXIT_FAILURE, "listen");
+	}
+
+	return fd;
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *sockpath = XBMUXD_SOCKET, *ttydev = "/dev/ttyUSB0", *ringname = NULL, *capture = NULL;
+	enum xb_api_mode api_mode = XB_AUTO;
+	struct pollfd pfds[XBMUXD_CLIENTS_MAX + 2];
+	int map[XBMUXD_CLIENTS_MAX + 2];
+	struct xb_frame frame;
+	struct xb_ctx *xctx;
+	struct client *c;
+	uint32_t baud = 0, stats_s = 0;
+	int i, lfd, n, ret;
+
+	while ( (i = getopt(argc, argv, "A:b:d:r:s:S:w:")) != -1) {
+		switch (i) {
+		case 'A':
+			if (!strcmp(optarg, "auto")) {
+				api_mode = XB_AUTO;
+				break;
+			}
+
+			api_mode = atoi(optarg);
+
+			if (api_mode < 1 || api_mode > 2) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'b':
+			baud = (uint32_t)strtoul(optarg, NULL, 10);
+
+			if (xb_baud_to_speed(baud) == B0) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'd':
+			ttydev = optarg;
+			break;
+
+		case 'r':
+			ringname = optarg;
+			break;
+
+		case 's':
+			sockpath = optarg;
+			break;
+
+		case 'S':
+			stats_s = (uint32_t)strtoul(optarg, NULL, 10);
+
+			if (!stats_s) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'w':
+			capture = optarg;
+			break;
+
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	/* with -b the radio is probed at that rate only */
+	xctx = xb_open_baud(ttydev, api_mode, baud);
+	if (!xctx) {
+		err(EXIT_FAILURE, "failed to open serial console");
+	}
+	if (xctx->api_mode == XB_AT) {
+		errx(EXIT_FAILURE, "the radio has to be in API mode");
+	}
+	xb_set_coalesce(xctx, XBMUXD_COALESCE_US, 0);
+	if (stats_s) {
+		if (xb_stats_init(xctx) < 0) {
+			err(EXIT_FAILURE, "failed to set up statistics");
+		}
+		xb_stats_set_dump(xctx, stderr, stats_s * 1000);
+	}
+	if (capture && xb_capture_start(xctx, capture) < 0) {
+		err(EXIT_FAILURE, "failed to start capture %s", capture);
+	}
+	if (ringname && xb_ring_create(xctx, ringname, 0) < 0) {
+		err(EXIT_FAILURE, "failed to create ring %s", ringname);
+	}
+
+	for(n = 0; n < XBMUXD_CLIENTS_MAX; n++) {
+		clients[n].fd = -1;
+	}
+	for(i = 0; i < 256; i++) {
+		ids[i].client = -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGUSR1, on_signal);
+	/* a no-op unless built with --enable-trace */
+	xb_trace_dump_on_error(stderr);
+
+	lfd = listen_socket(sockpath);
+
+	while (!quit) {
+		/* requests from several clients share a write, within budget */
+		if (xb_flush_expired(xctx) < 0) {
+			err(EXIT_FAILURE, "failed to write to the radio");
+		}
+
+		pfds[0].fd = xctx->xbfd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = lfd;
+		pfds[1].events = POLLIN;
+		for(i = 2, n = 0; n < XBMUXD_CLIENTS_MAX; n++) {
+			c = &clients[n];
+			if (c->fd < 0) {
+				continue;
+			}
+			pfds[i].fd = c->fd;
+			pfds[i].events = 0;
+			/* per-client flow control: stop reading a client that is
+			 * waiting on a frame ID or has too much outstanding */
+			if (!c->blocked && c->inflight < XBMUXD_INFLIGHT_MAX &&
+					c->in->writepos < c->in->size) {
+				pfds[i].events |= POLLIN;
+			}
+			if (c->out->readpos < c->out->writepos) {
+				pfds[i].events |= POLLOUT;
+			}
+			map[i++] = n;
+		}
+
+		if (dump_trace) {
+			dump_trace = 0;
+			xb_trace_dump(stderr);
+		}
+		/* also while the radio is quiet */
+		if (xctx->stats) {
+			xb_stats_tick(xctx);
+		}
+
+		if ( (ret = poll(pfds, i, xb_timeout_until(1000, xb_flush_deadline(xctx)))) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		id_expire(xb_time_us());
+
+		if (pfds[0].revents & POLLIN) {
+			if (xb_fill(xctx, 0) < 0) {
+				err(EXIT_FAILURE, "failed to read from the radio");
+			}
+			while (xb_read_frame(xctx, &frame, 0) > 0) {
+				radio_frame(&frame);
+			}
+		}
+		if (pfds[1].revents & POLLIN) {
+			client_accept(lfd);
+		}
+
+		for(n = 2; n < i; n++) {
+			if (clients[map[n]].fd != pfds[n].fd) {
+				continue;
+			}
+			if (pfds[n].revents & POLLOUT) {
+				client_write(map[n]);
+			}
+			if (clients[map[n]].fd < 0) {
+				continue;
+			}
+			if (pfds[n].revents & (POLLIN | POLLHUP | POLLERR)) {
+				client_read(xctx, map[n]);
+			}
+			else if (clients[map[n]].blocked ||
+					clients[map[n]].in->readpos < clients[map[n]].in->writepos) {
+				/* answers came back; carry on with what was held */
+				client_input(xctx, map[n]);
+			}
+		}
+	}
+
+	for(n = 0; n < XBMUXD_CLIENTS_MAX; n++) {
+		if (clients[n].fd >= 0) {
+			client_close(n);
+		}
+	}
+	close(lfd);
+	unlink(sockpath);
+	xb_close(xctx);
+
+	return EXIT_SUCCESS;
+}
+
+// vim: cindent
@@ -0,0 +1,159 @@
+/*
+ * xbprofile: bring radios in line with a saved configuration
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xb_ctx.h"
+#include "xb_profile.h"
+#include "xb_serial.h"
+#include "xb_tx.h"
+
+static int failures;
+
+static void
+usage(const char *argv0, int status) {
+	fprintf(stderr, "Usage: %s [-A api_mode|auto] [-b baud] [-d /dev/ttyX] [-r dest64]... profile\n", argv0);
+	exit(status);
+}
+
+static void
+print_value(const struct xb_profile_entry *entry) {
+	if (!entry) {
+		printf("?");
+	}
+	else if (entry->is_string) {
+		printf("\"%s\"", entry->str);
+	}
+	else {
+		printf("%llX", (unsigned long long)entry->value);
+	}
+}
+
+static void
+report(struct xb_ctx *xctx, uint64_t dest64, const struct xb_profile_entry *want,
+		const struct xb_profile_entry *was, int status, void *arg) {
+	if (dest64 == XB_ADDR64_UNKNOWN) {
+		printf("local            ");
+	}
+	else {
+		printf("%016llx ", (unsigned long long)dest64);
+	}
+	printf("%c%c ", want->cmd[0], want->cmd[1]);
+	print_value(was);
+	printf(" -> ");
+	print_value(want);
+	printf("%s\n", status < 0 ? " FAILED" : "");
+
+	if (status < 0) {
+		failures++;
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *ttydev = "/dev/ttyUSB0";
+	enum xb_api_mode api_mode = XB_AUTO;
+	struct xb_profile *prof;
+	struct xb_ctx *xctx;
+	uint64_t *dests = NULL;
+	unsigned int ndests = 0;
+	uint32_t baud = 0;
+	int i, changed;
+
+	while ( (i = getopt(argc, argv, "A:b:d:r:")) != -1) {
+		switch (i) {
+		case 'A':
+			if (!strcmp(optarg, "auto")) {
+				api_mode = XB_AUTO;
+				break;
+			}
+
+			api_mode = atoi(optarg);
+
+			if (api_mode < 0 || api_mode > 2) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'b':
+			baud = (uint32_t)strtoul(optarg, NULL, 10);
+
+			if (xb_baud_to_speed(baud) == B0) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'd':
+			ttydev = optarg;
+			break;
+
+		case 'r':
+			if ( (dests = realloc(dests, (ndests + 1) * sizeof(uint64_t))) == NULL) {
+				err(EXIT_FAILURE, "realloc");
+			}
+			dests[ndests++] = strtoull(optarg, NULL, 16);
+			break;
+
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0], EXIT_FAILURE);
+	}
+
+	if ( (prof = xb_profile_load(argv[optind])) == NULL) {
+		err(EXIT_FAILURE, "failed to load profile %s", argv[optind]);
+	}
+
+	/* with -b the radio is probed at that rate only */
+	xctx = xb_open_baud(ttydev, api_mode, baud);
+	if (!xctx) {
+		err(EXIT_FAILURE, "failed to open serial console");
+	}
+
+	if (ndests) {
+		if (xctx->api_mode == XB_AT) {
+			errx(EXIT_FAILURE, "remote configuration needs an API mode radio");
+		}
+		changed = xb_profile_apply_remote(xctx, prof, dests, ndests, report, NULL);
+	}
+	else {
+		changed = xb_profile_apply(xctx, prof, report, NULL);
+	}
+	if (changed < 0) {
+		errx(EXIT_FAILURE, "failed to apply profile");
+	}
+	printf("%d setting%s changed\n", changed, changed == 1 ? "" : "s");
+
+	xb_close(xctx);
+	xb_profile_free(prof);
+	free(dests);
+
+	return failures ? 1 : EXIT_SUCCESS;
+}
+
+// vim: cindent
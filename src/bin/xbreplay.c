@@ -0,0 +1,123 @@
+/*
+ * xbreplay: play back or export a serial capture
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xb_capture.h"
+#include "xb_ctx.h"
+
+static unsigned long types[256];
+
+static void
+usage(const char *argv0, int status) {
+	fprintf(stderr, "Usage: %s [-p out.pcap] [-s speed] [-t seconds] capture\n", argv0);
+	exit(status);
+}
+
+static void
+count_frame(struct xb_ctx *xctx, struct xb_frame *frame, void *arg) {
+	types[frame->data[0]]++;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct xb_capture_file *f;
+	struct xb_ctx *xctx;
+	const char *pcap = NULL;
+	double speed = 0, skip = 0;
+	uint64_t start, elapsed;
+	long frames;
+	int i;
+
+	while ( (i = getopt(argc, argv, "p:s:t:")) != -1) {
+		switch (i) {
+		case 'p':
+			pcap = optarg;
+			break;
+
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+
+		case 't':
+			skip = strtod(optarg, NULL);
+			break;
+
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0], EXIT_FAILURE);
+	}
+
+	if ( (f = xb_capture_open(argv[optind])) == NULL) {
+		err(EXIT_FAILURE, "failed to open capture %s", argv[optind]);
+	}
+	if (skip > 0) {
+		xb_capture_seek(f, f->mono_start + (uint64_t)(skip * 1000000));
+	}
+
+	if (pcap) {
+		if (xb_capture_export_pcap(f, pcap) < 0) {
+			err(EXIT_FAILURE, "failed to write %s", pcap);
+		}
+		xb_capture_close(f);
+		return EXIT_SUCCESS;
+	}
+
+	if (f->api_mode != XB_API && f->api_mode != XB_API_ESC) {
+		errx(EXIT_FAILURE, "only API mode captures can be replayed");
+	}
+
+	/* the decoder and handlers run as usual; anything sent goes nowhere */
+	if ( (xctx = xb_open("/dev/null", f->api_mode)) == NULL) {
+		err(EXIT_FAILURE, "failed to set up a context");
+	}
+	xb_set_frame_handler(xctx, count_frame, NULL);
+
+	start = xb_time_us();
+	if ( (frames = xb_replay(xctx, f, speed)) < 0) {
+		err(EXIT_FAILURE, "replay failed");
+	}
+	elapsed = xb_time_us() - start;
+
+	printf("%ld frames in %.3f s", frames, elapsed / 1e6);
+	if (elapsed) {
+		printf(" (%.0f frames/s)", frames * 1e6 / elapsed);
+	}
+	printf("\n");
+	for(i = 0; i < 256; i++) {
+		if (types[i]) {
+			printf("  0x%02x %lu\n", i, types[i]);
+		}
+	}
+
+	xb_close(xctx);
+	xb_capture_close(f);
+
+	return EXIT_SUCCESS;
+}
+
+// vim: cindent
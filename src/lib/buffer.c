@@ -70,10 +70,29 @@ buffer_sprintf(struct buffer *buf, const char *format, ...) {
 	return -1;
 }
 
-/*
-int buffer_get_data(struct buffer *, const char *, uint64_t);
-int buffer_put_data(struct buffer *, const char *, uint64_t);
-*/
+int
+buffer_get_data(struct buffer *buf, char *data, uint64_t len) {
+	if (buf->readpos + len > buf->size) {
+		return -1;
+	}
+
+	memcpy(data, buf->data + buf->readpos, len);
+	buf->readpos += len;
+
+	return 0;
+}
+
+int
+buffer_put_data(struct buffer *buf, const char *data, uint64_t len) {
+	if (buf->writepos + len > buf->size) {
+		return -1;
+	}
+
+	memcpy(buf->data + buf->writepos, data, len);
+	buf->writepos += len;
+
+	return 0;
+}
 
 int
 buffer_get_uint8(struct buffer *buf, uint8_t *u8) {
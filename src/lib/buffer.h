@@ -40,7 +40,7 @@ void buffer_free(struct buffer *);
 
 int buffer_sprintf(struct buffer *, const char *, ...);
 
-int buffer_get_data(struct buffer *, const char *, uint64_t);
+int buffer_get_data(struct buffer *, char *, uint64_t);
 int buffer_put_data(struct buffer *, const char *, uint64_t);
 
 int buffer_get_uint8(struct buffer *, uint8_t *);
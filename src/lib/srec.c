@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "srec.h"
+
+/* on-disk index: "XBSI", block size, count, then start/end/crc triples */
+#define SREC_INDEX_MAGIC		"XBSI"
+#define SREC_INDEX_HDRLEN		12
+#define SREC_INDEX_ENTLEN		12
+
+static uint32_t crc_table[256];
+
+static void
+crc_init() {
+	uint32_t c;
+	int i, j;
+
+	if (crc_table[1]) {
+		return;
+	}
+
+	for(i = 0; i < 256; i++) {
+		c = (uint32_t)i;
+		for(j = 0; j < 8; j++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t
+crc_update(uint32_t crc, const uint8_t *data, size_t len) {
+	while (len--) {
+		crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+static int
+hexval(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+struct srec_index *
+srec_index_new(uint32_t block_size) {
+	struct srec_index *idx;
+
+	if (!block_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	idx = (struct srec_index *)calloc(1, sizeof(struct srec_index));
+	if (!idx) {
+		return NULL;
+	}
+
+	idx->block_size = block_size;
+	crc_init();
+
+	return idx;
+}
+
+void
+srec_index_free(struct srec_index *idx) {
+	free(idx->segs);
+	free(idx);
+}
+
+static struct srec_segment *
+srec_index_add(struct srec_index *idx) {
+	struct srec_segment *segs;
+	uint32_t max;
+
+	if (idx->nsegs == idx->maxsegs) {
+		max = idx->maxsegs ? idx->maxsegs * 2 : 64;
+		segs = (struct srec_segment *)realloc(idx->segs, max * sizeof(*segs));
+		if (!segs) {
+			return NULL;
+		}
+		idx->segs = segs;
+		idx->maxsegs = max;
+	}
+
+	return &idx->segs[idx->nsegs++];
+}
+
+static void
+srec_index_close(struct srec_index *idx) {
+	if (idx->open) {
+		idx->segs[idx->nsegs - 1].crc = ~idx->crc;
+		idx->open = 0;
+	}
+}
+
+/*
+ * append data bytes at addr, extending the open segment when contiguous
+ * and splitting at every block boundary
+ */
+static int
+srec_index_data(struct srec_index *idx, uint32_t addr, const uint8_t *data, size_t len) {
+	struct srec_segment *seg;
+	size_t run;
+
+	while (len > 0) {
+		run = idx->block_size - (addr % idx->block_size);
+		if (run > len) {
+			run = len;
+		}
+
+		if (!idx->open || idx->segs[idx->nsegs - 1].end != addr ||
+				addr % idx->block_size == 0) {
+			srec_index_close(idx);
+			if ( (seg = srec_index_add(idx)) == NULL) {
+				return -1;
+			}
+			seg->start = seg->end = addr;
+			idx->crc = 0xffffffff;
+			idx->open = 1;
+		}
+
+		seg = &idx->segs[idx->nsegs - 1];
+		idx->crc = crc_update(idx->crc, data, run);
+		seg->end += (uint32_t)run;
+
+		addr += (uint32_t)run;
+		data += run;
+		len -= run;
+	}
+
+	return 0;
+}
+
+static int
+srec_index_line(struct srec_index *idx, const char *line, size_t len) {
+	uint8_t bytes[256], csum;
+	uint32_t addr;
+	int addrlen, count, hi, lo, i;
+
+	if (len < 4 || line[0] != 'S') {
+		return 0;
+	}
+
+	switch (line[1]) {
+	case '1': addrlen = 2; break;
+	case '2': addrlen = 3; break;
+	case '3': addrlen = 4; break;
+	default:
+		/* header, count and start records carry no image data */
+		return 0;
+	}
+
+	idx->records++;
+
+	if ( (hi = hexval(line[2])) < 0 || (lo = hexval(line[3])) < 0) {
+		goto bad;
+	}
+	count = (hi << 4) | lo;
+	if (count < addrlen + 1 || len < (size_t)(4 + count * 2)) {
+		goto bad;
+	}
+
+	for(csum = (uint8_t)count, i = 0; i < count; i++) {
+		if ( (hi = hexval(line[4 + i * 2])) < 0 ||
+				(lo = hexval(line[5 + i * 2])) < 0) {
+			goto bad;
+		}
+		bytes[i] = (uint8_t)((hi << 4) | lo);
+		csum += bytes[i];
+	}
+	if (csum != 0xff) {
+		goto bad;
+	}
+
+	for(addr = 0, i = 0; i < addrlen; i++) {
+		addr = (addr << 8) | bytes[i];
+	}
+
+	return srec_index_data(idx, addr, bytes + addrlen, count - addrlen - 1);
+
+bad:
+	idx->bad_records++;
+	return 0;
+}
+
+/*
+ * feed S-record text as it is produced; lines may be split arbitrarily
+ * across calls
+ */
+int
+srec_index_feed(struct srec_index *idx, const char *data, size_t len) {
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		if (data[i] == '\r' || data[i] == '\n') {
+			if (idx->linelen &&
+					srec_index_line(idx, idx->line, idx->linelen) < 0) {
+				return -1;
+			}
+			idx->linelen = 0;
+		}
+		else if (idx->linelen < SREC_LINE_MAX) {
+			idx->line[idx->linelen++] = data[i];
+		}
+	}
+
+	return 0;
+}
+
+int
+srec_index_finish(struct srec_index *idx) {
+	int ret = 0;
+
+	if (idx->linelen) {
+		ret = srec_index_line(idx, idx->line, idx->linelen);
+		idx->linelen = 0;
+	}
+	srec_index_close(idx);
+
+	return ret;
+}
+
+static void
+put_be32(uint8_t *p, uint32_t v) {
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+static uint32_t
+get_be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+static int
+write_fully(int fd, const uint8_t *buf, size_t count) {
+	ssize_t ret;
+
+	while (count > 0) {
+		if ( (ret = write(fd, buf, count)) <= 0) {
+			return -1;
+		}
+		count -= ret;
+		buf += ret;
+	}
+
+	return 0;
+}
+
+static int
+read_fully(int fd, uint8_t *buf, size_t count) {
+	ssize_t ret;
+
+	while (count > 0) {
+		if ( (ret = read(fd, buf, count)) <= 0) {
+			/* a short file is a bad file */
+			if (ret == 0) {
+				errno = EINVAL;
+			}
+			return -1;
+		}
+		count -= ret;
+		buf += ret;
+	}
+
+	return 0;
+}
+
+int
+srec_index_write(struct srec_index *idx, int fd) {
+	uint8_t hdr[SREC_INDEX_HDRLEN], *ents;
+	uint32_t i;
+	int ret;
+
+	memcpy(hdr, SREC_INDEX_MAGIC, 4);
+	put_be32(hdr + 4, idx->block_size);
+	put_be32(hdr + 8, idx->nsegs);
+
+	if ( (ents = (uint8_t *)malloc((size_t)idx->nsegs * SREC_INDEX_ENTLEN + 1)) == NULL) {
+		return -1;
+	}
+	for(i = 0; i < idx->nsegs; i++) {
+		put_be32(ents + i * SREC_INDEX_ENTLEN, idx->segs[i].start);
+		put_be32(ents + i * SREC_INDEX_ENTLEN + 4, idx->segs[i].end);
+		put_be32(ents + i * SREC_INDEX_ENTLEN + 8, idx->segs[i].crc);
+	}
+
+	ret = write_fully(fd, hdr, sizeof(hdr));
+	if (!ret) {
+		ret = write_fully(fd, ents, (size_t)idx->nsegs * SREC_INDEX_ENTLEN);
+	}
+	free(ents);
+
+	return ret;
+}
+
+static struct srec_index *
+srec_index_read_body(int fd, const uint8_t *hdr) {
+	struct srec_index *idx;
+	struct srec_segment *seg;
+	uint8_t ent[SREC_INDEX_ENTLEN];
+	uint32_t i, count;
+
+	if ( (idx = srec_index_new(get_be32(hdr + 4))) == NULL) {
+		return NULL;
+	}
+
+	count = get_be32(hdr + 8);
+	for(i = 0; i < count; i++) {
+		if (read_fully(fd, ent, sizeof(ent)) || (seg = srec_index_add(idx)) == NULL) {
+			srec_index_free(idx);
+			return NULL;
+		}
+		seg->start = get_be32(ent);
+		seg->end = get_be32(ent + 4);
+		seg->crc = get_be32(ent + 8);
+	}
+
+	return idx;
+}
+
+struct srec_index *
+srec_index_read(int fd) {
+	uint8_t hdr[SREC_INDEX_HDRLEN];
+
+	if (read_fully(fd, hdr, sizeof(hdr))) {
+		return NULL;
+	}
+	if (memcmp(hdr, SREC_INDEX_MAGIC, 4)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return srec_index_read_body(fd, hdr);
+}
+
+/*
+ * load either a saved index or an S-record file, indexing it on the fly;
+ * errno is EINVAL if the file does not parse
+ */
+struct srec_index *
+srec_index_load(const char *path) {
+	char buf[4096];
+	int fd, saved;
+	ssize_t ret;
+	size_t have;
+	struct srec_index *idx;
+
+	if ( (fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+
+	for(have = 0; have < SREC_INDEX_HDRLEN; have += ret) {
+		if ( (ret = read(fd, buf + have, SREC_INDEX_HDRLEN - have)) <= 0) {
+			break;
+		}
+	}
+
+	if (have == SREC_INDEX_HDRLEN && !memcmp(buf, SREC_INDEX_MAGIC, 4)) {
+		idx = srec_index_read_body(fd, (const uint8_t *)buf);
+		close(fd);
+		return idx;
+	}
+
+	if ( (idx = srec_index_new(SREC_BLOCK_SIZE)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	/* parse errors leave errno alone; allocation and read errors don't */
+	errno = 0;
+	ret = (ssize_t)have;
+	do {
+		if (srec_index_feed(idx, buf, (size_t)ret) < 0) {
+			goto error;
+		}
+	} while ( (ret = read(fd, buf, sizeof(buf))) > 0);
+
+	if (ret < 0 || srec_index_finish(idx) < 0) {
+		goto error;
+	}
+
+	close(fd);
+	srec_index_sort(idx);
+
+	return idx;
+
+error:
+	saved = errno ? errno : EINVAL;
+	close(fd);
+	srec_index_free(idx);
+	errno = saved;
+	return NULL;
+}
+
+static int
+srec_segment_cmp(const void *a, const void *b) {
+	const struct srec_segment *sa = a, *sb = b;
+
+	if (sa->start != sb->start) {
+		return sa->start < sb->start ? -1 : 1;
+	}
+	return 0;
+}
+
+void
+srec_index_sort(struct srec_index *idx) {
+	srec_index_close(idx);
+	qsort(idx->segs, idx->nsegs, sizeof(struct srec_segment), srec_segment_cmp);
+}
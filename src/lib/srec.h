@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SREC_H
+#define SREC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* default granularity of the address-range index */
+#define SREC_BLOCK_SIZE			256
+
+/* longest possible record: "S3" + count + 255 bytes as hex + "\r\n" */
+#define SREC_LINE_MAX			(2 + 2 + 255 * 2 + 2)
+
+/*
+ * One contiguous run of data bytes, [start, end).  Runs never cross a
+ * block boundary so that two images can be compared block by block.
+ */
+struct srec_segment {
+	uint32_t start, end;
+	uint32_t crc;
+};
+
+struct srec_index {
+	uint32_t block_size;
+
+	struct srec_segment *segs;
+	uint32_t nsegs, maxsegs;
+
+	/* running crc of the open segment (the last one in segs) */
+	uint32_t crc;
+	int open;
+
+	/* partial line carried between srec_index_feed() calls */
+	char line[SREC_LINE_MAX + 1];
+	size_t linelen;
+
+	uint32_t records, bad_records;
+};
+
+struct srec_index *srec_index_new(uint32_t);
+void srec_index_free(struct srec_index *);
+
+int srec_index_feed(struct srec_index *, const char *, size_t);
+int srec_index_finish(struct srec_index *);
+
+int srec_index_write(struct srec_index *, int);
+struct srec_index *srec_index_read(int);
+struct srec_index *srec_index_load(const char *);
+
+void srec_index_sort(struct srec_index *);
+
+#endif
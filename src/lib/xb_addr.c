@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_addr.h"
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_tx.h"
+
+/* ZigBee TX status delivery codes that mean the address went stale */
+#define XB_TX_STATUS_ADDRESS_NOT_FOUND		0x24
+#define XB_TX_STATUS_ROUTE_NOT_FOUND		0x25
+
+/*
+ * size is rounded up to a power of two
+ */
+int
+xb_addr_init(struct xb_ctx *xctx, unsigned int size, uint32_t max_age) {
+	struct xb_addr_table *tab;
+	unsigned int n;
+
+	tab = (struct xb_addr_table *)calloc(1, sizeof(struct xb_addr_table));
+	if (!tab) {
+		return -1;
+	}
+
+	for(n = XB_ADDR_PROBE; n < (size ? size : XB_ADDR_SIZE_DEFAULT); n <<= 1)
+		;
+	tab->entries = (struct xb_addr_entry *)calloc(n, sizeof(struct xb_addr_entry));
+	if (!tab->entries) {
+		free(tab);
+		return -1;
+	}
+	tab->size = n;
+	tab->max_age = max_age ? max_age : XB_ADDR_MAX_AGE_MS;
+
+	xb_addr_free(xctx);
+	xctx->addr = tab;
+
+	return 0;
+}
+
+void
+xb_addr_free(struct xb_ctx *xctx) {
+	if (xctx->addr) {
+		free(xctx->addr->entries);
+		free(xctx->addr);
+		xctx->addr = NULL;
+	}
+}
+
+static unsigned int
+xb_addr_hash(struct xb_addr_table *tab, uint64_t addr64) {
+	return (unsigned int)((addr64 * 0x9e3779b97f4a7c15ULL) >> 32) & (tab->size - 1);
+}
+
+static int
+xb_addr_fresh(struct xb_addr_table *tab, struct xb_addr_entry *ent, uint64_t now) {
+	return ent->updated && now - ent->updated < (uint64_t)tab->max_age * 1000;
+}
+
+static struct xb_addr_entry *
+xb_addr_find(struct xb_addr_table *tab, uint64_t addr64) {
+	struct xb_addr_entry *ent;
+	unsigned int h, i;
+
+	h = xb_addr_hash(tab, addr64);
+	for(i = 0; i < XB_ADDR_PROBE; i++) {
+		ent = &tab->entries[(h + i) & (tab->size - 1)];
+		if (ent->updated && ent->addr64 == addr64) {
+			return ent;
+		}
+	}
+
+	return NULL;
+}
+
+void
+xb_addr_update(struct xb_ctx *xctx, uint64_t addr64, uint16_t addr16) {
+	struct xb_addr_table *tab = xctx->addr;
+	struct xb_addr_entry *ent, *victim = NULL;
+	unsigned int h, i;
+	uint64_t now;
+
+	if (!tab || addr64 == XB_ADDR64_BROADCAST || addr64 == XB_ADDR64_UNKNOWN) {
+		return;
+	}
+	if (addr16 == XB_ADDR16_UNKNOWN) {
+		xb_addr_forget(xctx, addr64);
+		return;
+	}
+
+	now = xb_time_us();
+	if ( (ent = xb_addr_find(tab, addr64)) == NULL) {
+		/* an empty or stale slot, otherwise the oldest nearby */
+		h = xb_addr_hash(tab, addr64);
+		for(i = 0; i < XB_ADDR_PROBE; i++) {
+			ent = &tab->entries[(h + i) & (tab->size - 1)];
+			if (!xb_addr_fresh(tab, ent, now)) {
+				victim = ent;
+				break;
+			}
+			if (!victim || ent->updated < victim->updated) {
+				victim = ent;
+			}
+		}
+		ent = victim;
+		if (!ent->updated) {
+			tab->count++;
+		}
+		ent->addr64 = addr64;
+	}
+
+	ent->addr16 = addr16;
+	ent->updated = now;
+}
+
+/*
+ * the 16-bit address last seen for addr64, XB_ADDR16_UNKNOWN if none
+ */
+uint16_t
+xb_addr_lookup(struct xb_ctx *xctx, uint64_t addr64) {
+	struct xb_addr_table *tab = xctx->addr;
+	struct xb_addr_entry *ent;
+
+	if (!tab) {
+		return XB_ADDR16_UNKNOWN;
+	}
+
+	if ( (ent = xb_addr_find(tab, addr64)) == NULL ||
+			!xb_addr_fresh(tab, ent, xb_time_us())) {
+		tab->misses++;
+		return XB_ADDR16_UNKNOWN;
+	}
+
+	tab->hits++;
+	return ent->addr16;
+}
+
+void
+xb_addr_forget(struct xb_ctx *xctx, uint64_t addr64) {
+	struct xb_addr_entry *ent;
+
+	if (xctx->addr && (ent = xb_addr_find(xctx->addr, addr64)) != NULL) {
+		memset(ent, 0, sizeof(*ent));
+		xctx->addr->count--;
+	}
+}
+
+/*
+ * learn addresses from received packets, delivery reports and node
+ * discovery; called before the transmit window releases the slot
+ */
+void
+xb_addr_observe(struct xb_ctx *xctx, struct xb_frame *frame) {
+	struct xb_tx_slot *slot;
+	struct xb_rx rx;
+	const uint8_t *d = frame->data;
+
+	switch (d[0]) {
+	case XB_FRAME_TYPE_RX:
+	case XB_FRAME_TYPE_EXPLICIT_RX:
+		if (xb_frame_rx(frame, &rx) == 0) {
+			xb_addr_update(xctx, rx.src64, rx.src16);
+		}
+		break;
+	case XB_FRAME_TYPE_REMOTE_AT_RESPONSE:
+		/* 0x97, frame id, source 64, source 16, ... */
+		if (frame->len >= 12) {
+			xb_addr_update(xctx, xb_get_be(d + 2, 8),
+					(uint16_t)xb_get_be(d + 10, 2));
+		}
+		break;
+	case XB_FRAME_TYPE_TX_STATUS:
+		/* 0x8b, frame id, 16-bit dest, retries, delivery, discovery */
+		if (frame->len < 7 || !xctx->txwin) {
+			break;
+		}
+		slot = &xctx->txwin->slots[d[1]];
+		if (!d[1] || !slot->in_use) {
+			break;
+		}
+		if (d[5] == XB_TX_STATUS_SUCCESS) {
+			xb_addr_update(xctx, slot->dest64,
+					(uint16_t)xb_get_be(d + 2, 2));
+		}
+		else if (d[5] == XB_TX_STATUS_ADDRESS_NOT_FOUND ||
+				d[5] == XB_TX_STATUS_ROUTE_NOT_FOUND) {
+			xb_addr_forget(xctx, slot->dest64);
+		}
+		break;
+	case XB_FRAME_TYPE_AT_CMD_RESPONSE:
+		/* 0x88, frame id, "ND", status, MY, SH, SL, ... */
+		if (frame->len >= 15 && d[2] == 'N' && d[3] == 'D' &&
+				d[4] == XB_AT_STATUS_OK) {
+			xb_addr_update(xctx, xb_get_be(d + 7, 8),
+					(uint16_t)xb_get_be(d + 5, 2));
+		}
+		break;
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_ADDR_H
+#define XB_ADDR_H
+
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+/*
+ * ZigBee 16-bit addresses change when a node rejoins, so entries are
+ * only trusted for so long
+ */
+#define XB_ADDR_SIZE_DEFAULT			256
+#define XB_ADDR_MAX_AGE_MS			600000
+/* an address lives within this many slots of where it hashes to */
+#define XB_ADDR_PROBE				8
+
+struct xb_addr_entry {
+	uint64_t addr64;
+	uint16_t addr16;
+	uint64_t updated;
+};
+
+struct xb_addr_table {
+	unsigned int size, count;
+	uint32_t max_age;
+	unsigned long hits, misses;
+	struct xb_addr_entry *entries;
+};
+
+int xb_addr_init(struct xb_ctx *, unsigned int, uint32_t);
+void xb_addr_free(struct xb_ctx *);
+
+void xb_addr_update(struct xb_ctx *, uint64_t, uint16_t);
+uint16_t xb_addr_lookup(struct xb_ctx *, uint64_t);
+void xb_addr_forget(struct xb_ctx *, uint64_t);
+
+void xb_addr_observe(struct xb_ctx *, struct xb_frame *);
+
+#endif
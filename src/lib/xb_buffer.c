@@ -71,7 +71,9 @@ xb_buffer_free(struct xb_buffer *buf) {
 	struct xb_buffer_value *valptr, *nextval;
 
 	for(valptr = buf->head; valptr; valptr = nextval) {
-		//if (valptr->type == XB_BUFFER_TYPE_DATA)
+		if (valptr->type == XB_BUFFER_TYPE_DATA) {
+			free(valptr->value.data);
+		}
 		nextval = valptr->next;
 		free(valptr);
 	}
@@ -89,6 +91,24 @@ xb_buffer_set_frame_id(struct xb_buffer *xbuf, uint8_t frame_id) {
 	xbuf->frame_id = frame_id;
 }
 
+/*
+ * overwrite the nth value (counting from 0), which must be a uint8
+ */
+int
+xb_buffer_set_uint8(struct xb_buffer *buf, unsigned int n, uint8_t u8) {
+	struct xb_buffer_value *valptr;
+
+	for(valptr = buf->head; valptr && n; valptr = valptr->next, n--)
+		;
+
+	if (!valptr || valptr->type != XB_BUFFER_TYPE_U8) {
+		return -1;
+	}
+	valptr->value.u8 = u8;
+
+	return 0;
+}
+
 struct xb_buffer_value *
 xb_buffer_new_value(struct xb_buffer *buf, enum xb_buffer_value_type type) {
 	struct xb_buffer_value *val;
@@ -114,9 +134,31 @@ xb_buffer_new_value(struct xb_buffer *buf, enum xb_buffer_value_type type) {
 
 /*
 int xb_buffer_get_data(struct xb_buffer *, const char *, uint16_t);
-int xb_buffer_put_data(struct xb_buffer *, const char *, uint16_t);
 */
 
+int
+xb_buffer_put_data(struct xb_buffer *buf, const char *data, uint16_t len) {
+	struct xb_buffer_value *val;
+	char *copy;
+
+	copy = (char *)malloc(len ? len : 1);
+	if (!copy) {
+		return -1;
+	}
+	memcpy(copy, data, len);
+
+	val = xb_buffer_new_value(buf, XB_BUFFER_TYPE_DATA);
+	if (!val) {
+		free(copy);
+		return -1;
+	}
+
+	val->len = len;
+	val->value.data = copy;
+
+	return len;
+}
+
 int
 xb_buffer_get_uint8(struct xb_buffer *buf, uint8_t *u8) {
 	return 0;
@@ -213,6 +255,20 @@ xb_buffer_put_at_cmd(struct xb_buffer *buf, char at_cmd[2]) {
 	return 2;
 }
 
+/*
+ * API frames carry multi-byte values big-endian
+ */
+static int
+xb_buffer_put_be(struct buffer *buf, uint64_t value, int len) {
+	while (len--) {
+		if (buffer_put_uint8(buf, (uint8_t)(value >> (len * 8))) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 struct buffer *
 xb_buffer_as_api(struct xb_buffer *xbuf) {
 	struct buffer *buf;
@@ -220,6 +276,7 @@ xb_buffer_as_api(struct xb_buffer *xbuf) {
 	uint8_t csum;
 	uint16_t len;
 	uint64_t i;
+	int ret = 0;
 
 	buf = buffer_new(512);
 	if (!buf) {
@@ -229,25 +286,25 @@ xb_buffer_as_api(struct xb_buffer *xbuf) {
 	buffer_put_uint8(buf, 0x7e);
 	buf->writepos = 3;
 
-	for(valptr = xbuf->head; valptr; valptr = valptr->next) {
+	for(valptr = xbuf->head; valptr && ret >= 0; valptr = valptr->next) {
 		switch(valptr->type) {
 		case XB_BUFFER_TYPE_DATA:
-			//buffer_put_data(buf, valptr->value.data, valptr->len);
+			ret = buffer_put_data(buf, valptr->value.data, valptr->len);
 			break;
 		case XB_BUFFER_TYPE_U8:
-			buffer_put_uint8(buf, valptr->value.u8);
+			ret = buffer_put_uint8(buf, valptr->value.u8);
 			break;
 		case XB_BUFFER_TYPE_U16:
-			buffer_put_uint16(buf, valptr->value.u16);
+			ret = xb_buffer_put_be(buf, valptr->value.u16, 2);
 			break;
 		case XB_BUFFER_TYPE_U32:
-			buffer_put_uint32(buf, valptr->value.u32);
+			ret = xb_buffer_put_be(buf, valptr->value.u32, 4);
 			break;
 		case XB_BUFFER_TYPE_U64:
-			buffer_put_uint64(buf, valptr->value.u64);
+			ret = xb_buffer_put_be(buf, valptr->value.u64, 8);
 			break;
 		case XB_BUFFER_TYPE_AT_COMMAND:
-			buffer_sprintf(buf, "%c%c", valptr->value.at_cmd[0],
+			ret = buffer_sprintf(buf, "%c%c", valptr->value.at_cmd[0],
 					valptr->value.at_cmd[1]);
 			break;
 		case XB_BUFFER_TYPE_NULL:
@@ -255,7 +312,11 @@ xb_buffer_as_api(struct xb_buffer *xbuf) {
 		}
 	}
 
-	/* XXX check writepos vs size here */
+	/* leave room for the checksum */
+	if (ret < 0 || buf->writepos >= buf->size) {
+		buffer_free(buf);
+		return NULL;
+	}
 
 	len = htobe16((uint16_t)buf->writepos - 3);
 	memcpy(buf->data + 1, &len, 2);
@@ -268,35 +329,35 @@ xb_buffer_as_api(struct xb_buffer *xbuf) {
 	return buf;
 }
 
-struct buffer *
-xb_buffer_as_at(struct xb_buffer *xbuf) {
-	struct buffer *buf;
+/*
+ * render the command and its parameters as command mode text, without
+ * the "AT" prefix or the trailing carriage return
+ */
+static int
+xb_buffer_render_at(struct xb_buffer *xbuf, struct buffer *buf) {
 	struct xb_buffer_value *valptr;
+	int ret = 0;
 
-	buf = buffer_new(512);
-	if (!buf) {
-		return NULL;
-	}
-
-	for(valptr = xbuf->head; valptr; valptr = valptr->next) {
+	for(valptr = xbuf->head; valptr && ret >= 0; valptr = valptr->next) {
 		switch(valptr->type) {
 		case XB_BUFFER_TYPE_DATA:
-			//buffer_put_data(buf, valptr->value.data, valptr->len);
+			/* e.g. the string argument of ATNI */
+			ret = buffer_put_data(buf, valptr->value.data, valptr->len);
 			break;
 		case XB_BUFFER_TYPE_U8:
-			buffer_sprintf(buf, "%02hhX", valptr->value.u8);
+			ret = buffer_sprintf(buf, "%02hhX", valptr->value.u8);
 			break;
 		case XB_BUFFER_TYPE_U16:
-			buffer_sprintf(buf, "%04hX", valptr->value.u16);
+			ret = buffer_sprintf(buf, "%04hX", valptr->value.u16);
 			break;
 		case XB_BUFFER_TYPE_U32:
-			buffer_sprintf(buf, "%08X", valptr->value.u32);
+			ret = buffer_sprintf(buf, "%08X", valptr->value.u32);
 			break;
 		case XB_BUFFER_TYPE_U64:
-			buffer_sprintf(buf, "%016lX", valptr->value.u64);
+			ret = buffer_sprintf(buf, "%016lX", valptr->value.u64);
 			break;
 		case XB_BUFFER_TYPE_AT_COMMAND:
-			buffer_sprintf(buf, "AT%c%c", valptr->value.at_cmd[0],
+			ret = buffer_sprintf(buf, "%c%c", valptr->value.at_cmd[0],
 					valptr->value.at_cmd[1]);
 			break;
 		case XB_BUFFER_TYPE_NULL:
@@ -304,10 +365,68 @@ xb_buffer_as_at(struct xb_buffer *xbuf) {
 		}
 	}
 
+	return ret < 0 ? -1 : 0;
+}
+
+struct buffer *
+xb_buffer_as_at(struct xb_buffer *xbuf) {
+	struct buffer *buf;
+
+	buf = buffer_new(512);
+	if (!buf) {
+		return NULL;
+	}
+
+	if (buffer_sprintf(buf, "AT") < 0 || xb_buffer_render_at(xbuf, buf) < 0 ||
+			buffer_put_uint8(buf, '\r') < 0) {
+		buffer_free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * chain as many commands as fit on one command mode line, e.g.
+ * "ATID,CH,MY\r"; the number of commands consumed is stored in *used
+ */
+struct buffer *
+xb_buffer_as_at_batch(struct xb_buffer **xbufs, int count, int *used) {
+	struct buffer *buf;
+	uint64_t mark;
+	int i;
+
+	buf = buffer_new(XB_AT_LINE_MAX + 1);
+	if (!buf) {
+		return NULL;
+	}
+
+	if (buffer_sprintf(buf, "AT") < 0) {
+		goto error;
+	}
+
+	for(i = 0; i < count; i++) {
+		mark = buf->writepos;
+
+		if ((i && buffer_sprintf(buf, ",") < 0) ||
+				xb_buffer_render_at(xbufs[i], buf) < 0 ||
+				buf->writepos >= XB_AT_LINE_MAX) {
+			/* doesn't fit, leave it for the next line */
+			buf->writepos = mark;
+			break;
+		}
+	}
 
-	/* XXX check writepos vs size here */
+	if (!i) {
+		goto error;
+	}
 
 	buf->data[buf->writepos++] = '\r';
+	*used = i;
 
 	return buf;
+
+error:
+	buffer_free(buf);
+	return NULL;
 }
@@ -22,6 +22,9 @@
 
 #include "buffer.h"
 
+/* keep chained command mode lines within the radio's input buffer */
+#define XB_AT_LINE_MAX				96
+
 struct xb_buffer;
 
 struct xb_buffer *xb_buffer_new();
@@ -35,6 +38,7 @@ int xb_buffer_put_data(struct xb_buffer *, const char *, uint16_t);
 
 int xb_buffer_get_uint8(struct xb_buffer *, uint8_t *);
 int xb_buffer_put_uint8(struct xb_buffer *, uint8_t);
+int xb_buffer_set_uint8(struct xb_buffer *, unsigned int, uint8_t);
 
 int xb_buffer_get_uint16(struct xb_buffer *, uint16_t *);
 int xb_buffer_put_uint16(struct xb_buffer *, uint16_t);
@@ -49,5 +53,6 @@ int xb_buffer_put_at_cmd(struct xb_buffer *, char[2]);
 
 struct buffer *xb_buffer_as_api(struct xb_buffer *);
 struct buffer *xb_buffer_as_at(struct xb_buffer *);
+struct buffer *xb_buffer_as_at_batch(struct xb_buffer **, int, int *);
 
 #endif
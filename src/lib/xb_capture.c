@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "xb_capture.h"
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_io.h"
+
+static char *
+xb_capture_idxpath(const char *path) {
+	char *idxpath;
+
+	if ( (idxpath = (char *)malloc(strlen(path) + 5)) != NULL) {
+		sprintf(idxpath, "%s.idx", path);
+	}
+
+	return idxpath;
+}
+
+/*
+ * record all serial traffic of xctx to path, replacing what was there;
+ * start it before any reader thread
+ */
+int
+xb_capture_start(struct xb_ctx *xctx, const char *path) {
+	uint8_t hdr[XB_CAPTURE_HDRLEN];
+	struct xb_capture *cap;
+	char *idxpath;
+
+	if (xctx->reader) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if ( (cap = (struct xb_capture *)calloc(1, sizeof(struct xb_capture))) == NULL) {
+		return -1;
+	}
+	if ( (idxpath = xb_capture_idxpath(path)) == NULL) {
+		free(cap);
+		return -1;
+	}
+	cap->fp = fopen(path, "wb");
+	cap->idx = fopen(idxpath, "wb");
+	free(idxpath);
+	if (!cap->fp || !cap->idx) {
+		goto error;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, XB_CAPTURE_MAGIC, 4);
+	xb_put_be(hdr + 4, XB_CAPTURE_VERSION, 4);
+	hdr[8] = (uint8_t)xctx->api_mode;
+	xb_put_be(hdr + 12, xb_wall_time_us(), 8);
+	xb_put_be(hdr + 20, xb_time_us(), 8);
+	if (fwrite(hdr, sizeof(hdr), 1, cap->fp) != 1) {
+		goto error;
+	}
+	cap->offset = XB_CAPTURE_HDRLEN;
+
+	memset(hdr, 0, XB_CAPTURE_INDEX_HDRLEN);
+	memcpy(hdr, XB_CAPTURE_INDEX_MAGIC, 4);
+	xb_put_be(hdr + 4, XB_CAPTURE_VERSION, 4);
+	if (fwrite(hdr, XB_CAPTURE_INDEX_HDRLEN, 1, cap->idx) != 1) {
+		goto error;
+	}
+
+	if (pthread_mutex_init(&cap->lock, NULL) != 0) {
+		goto error;
+	}
+
+	if (xb_capture_stop(xctx) < 0) {
+		goto error;
+	}
+	xctx->capture = cap;
+
+	return 0;
+
+error:
+	if (cap->fp) {
+		fclose(cap->fp);
+	}
+	if (cap->idx) {
+		fclose(cap->idx);
+	}
+	free(cap);
+	return -1;
+}
+
+/*
+ * the reader thread writes to the capture too, so it has to go first
+ */
+int
+xb_capture_stop(struct xb_ctx *xctx) {
+	struct xb_capture *cap = xctx->capture;
+
+	if (!cap) {
+		return 0;
+	}
+	if (xctx->reader) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	fclose(cap->fp);
+	fclose(cap->idx);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap);
+	xctx->capture = NULL;
+
+	return 0;
+}
+
+/*
+ * append one read or write; called from the receive and send paths,
+ * which may be different threads
+ */
+void
+xb_capture_write(struct xb_capture *cap, int dir, const void *data, size_t len) {
+	uint8_t rec[XB_CAPTURE_RECLEN], ent[XB_CAPTURE_INDEX_ENTLEN];
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t now;
+	size_t n;
+
+	pthread_mutex_lock(&cap->lock);
+
+	now = xb_time_us();
+
+	/* writes can be longer than a record holds */
+	while (len > 0) {
+		n = len > 0xffff ? 0xffff : len;
+
+		if (now >= cap->next_index) {
+			xb_put_be(ent, now, 8);
+			xb_put_be(ent + 8, cap->offset, 8);
+			fwrite(ent, sizeof(ent), 1, cap->idx);
+			cap->next_index = now + XB_CAPTURE_INDEX_US;
+		}
+
+		xb_put_be(rec, now, 8);
+		xb_put_be(rec + 8, n, 2);
+		rec[10] = (uint8_t)dir;
+		rec[11] = 0;
+		if (fwrite(rec, sizeof(rec), 1, cap->fp) != 1 || fwrite(p, n, 1, cap->fp) != 1) {
+			break;
+		}
+		cap->offset += sizeof(rec) + n;
+		p += n;
+		len -= n;
+	}
+
+	pthread_mutex_unlock(&cap->lock);
+}
+
+static const uint8_t *
+xb_capture_map(const char *path, size_t *size) {
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+
+	return (const uint8_t *)p;
+}
+
+/*
+ * map a capture for reading; the index is optional, without it seeking
+ * reads from the start
+ */
+struct xb_capture_file *
+xb_capture_open(const char *path) {
+	struct xb_capture_file *f;
+	char *idxpath;
+
+	if ( (f = (struct xb_capture_file *)calloc(1, sizeof(struct xb_capture_file))) == NULL) {
+		return NULL;
+	}
+
+	f->data = xb_capture_map(path, &f->size);
+	if (!f->data || f->size < XB_CAPTURE_HDRLEN || memcmp(f->data, XB_CAPTURE_MAGIC, 4) ||
+			xb_get_be(f->data + 4, 4) != XB_CAPTURE_VERSION) {
+		xb_capture_close(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	f->api_mode = (enum xb_api_mode)f->data[8];
+	f->wall_start = xb_get_be(f->data + 12, 8);
+	f->mono_start = xb_get_be(f->data + 20, 8);
+	f->pos = XB_CAPTURE_HDRLEN;
+
+	if ( (idxpath = xb_capture_idxpath(path)) != NULL) {
+		f->idx = xb_capture_map(idxpath, &f->idxsize);
+		free(idxpath);
+	}
+	if (f->idx && (f->idxsize < XB_CAPTURE_INDEX_HDRLEN || memcmp(f->idx, XB_CAPTURE_INDEX_MAGIC, 4))) {
+		munmap((void *)f->idx, f->idxsize);
+		f->idx = NULL;
+	}
+
+	return f;
+}
+
+void
+xb_capture_close(struct xb_capture_file *f) {
+	if (f->data) {
+		munmap((void *)f->data, f->size);
+	}
+	if (f->idx) {
+		munmap((void *)f->idx, f->idxsize);
+	}
+	free(f);
+}
+
+/*
+ * the next record, 0 at the end (or where a capture was cut short)
+ */
+int
+xb_capture_next(struct xb_capture_file *f, struct xb_capture_rec *rec) {
+	const uint8_t *p = f->data + f->pos;
+
+	if (f->pos + XB_CAPTURE_RECLEN > f->size) {
+		return 0;
+	}
+
+	rec->time_us = xb_get_be(p, 8);
+	rec->len = (uint16_t)xb_get_be(p + 8, 2);
+	rec->dir = p[10];
+	rec->data = p + XB_CAPTURE_RECLEN;
+	if (f->pos + XB_CAPTURE_RECLEN + rec->len > f->size) {
+		return 0;
+	}
+	f->pos += XB_CAPTURE_RECLEN + rec->len;
+
+	return 1;
+}
+
+/*
+ * position at the first record at or after time_us (monotonic, as
+ * recorded)
+ */
+int
+xb_capture_seek(struct xb_capture_file *f, uint64_t time_us) {
+	struct xb_capture_rec rec;
+	size_t lo, hi, mid, n, pos = XB_CAPTURE_HDRLEN;
+	const uint8_t *ent;
+
+	/* last index entry at or before time_us */
+	if (f->idx) {
+		n = (f->idxsize - XB_CAPTURE_INDEX_HDRLEN) / XB_CAPTURE_INDEX_ENTLEN;
+		for(lo = 0, hi = n; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			ent = f->idx + XB_CAPTURE_INDEX_HDRLEN + mid * XB_CAPTURE_INDEX_ENTLEN;
+			if (xb_get_be(ent, 8) <= time_us) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		if (lo) {
+			ent = f->idx + XB_CAPTURE_INDEX_HDRLEN + (lo - 1) * XB_CAPTURE_INDEX_ENTLEN;
+			pos = (size_t)xb_get_be(ent + 8, 8);
+		}
+		if (pos < XB_CAPTURE_HDRLEN || pos > f->size) {
+			pos = XB_CAPTURE_HDRLEN;
+		}
+	}
+
+	f->pos = pos;
+	for(;;) {
+		pos = f->pos;
+		if (!xb_capture_next(f, &rec)) {
+			break;
+		}
+		if (rec.time_us >= time_us) {
+			f->pos = pos;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int
+xb_pcap_put(FILE *fp, uint64_t time_us, int dir, const struct xb_frame *frame) {
+	uint32_t rh[4];
+	uint8_t d = (uint8_t)dir;
+
+	rh[0] = (uint32_t)(time_us / 1000000);
+	rh[1] = (uint32_t)(time_us % 1000000);
+	rh[2] = rh[3] = (uint32_t)frame->len + 1;
+
+	if (fwrite(rh, sizeof(rh), 1, fp) != 1 || fwrite(&d, 1, 1, fp) != 1 ||
+			fwrite(frame->data, frame->len, 1, fp) != 1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * write every API frame from the current position on as a pcap file,
+ * stamped with wall-clock time
+ */
+int
+xb_capture_export_pcap(struct xb_capture_file *f, const char *path) {
+	struct xb_decoder dec[2];
+	struct xb_capture_rec rec;
+	uint32_t gh[5];
+	uint16_t vh[2];
+	size_t off, used;
+	int done, ret = 0;
+	FILE *fp;
+
+	if (f->api_mode != XB_API && f->api_mode != XB_API_ESC) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ( (fp = fopen(path, "wb")) == NULL) {
+		return -1;
+	}
+
+	/* host byte order; readers go by the magic */
+	gh[0] = 0xa1b2c3d4;
+	vh[0] = 2;
+	vh[1] = 4;
+	gh[1] = 0;	/* thiszone */
+	gh[2] = 0;	/* sigfigs */
+	gh[3] = 65535;	/* snaplen */
+	gh[4] = XB_PCAP_LINKTYPE;
+	if (fwrite(&gh[0], 4, 1, fp) != 1 || fwrite(vh, sizeof(vh), 1, fp) != 1 ||
+			fwrite(&gh[1], 4, 4, fp) != 4) {
+		fclose(fp);
+		return -1;
+	}
+
+	xb_decoder_init(&dec[XB_CAPTURE_RX], f->api_mode == XB_API_ESC);
+	xb_decoder_init(&dec[XB_CAPTURE_TX], f->api_mode == XB_API_ESC);
+
+	while (ret == 0 && xb_capture_next(f, &rec)) {
+		if (rec.dir != XB_CAPTURE_RX && rec.dir != XB_CAPTURE_TX) {
+			continue;
+		}
+		for(off = 0; ret == 0 && off < rec.len; off += used) {
+			used = xb_decoder_feed(&dec[rec.dir], rec.data + off, rec.len - off, &done);
+			if (done) {
+				ret = xb_pcap_put(fp, f->wall_start + (rec.time_us - f->mono_start),
+						rec.dir, &dec[rec.dir].frame);
+			}
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * put bytes into the receive buffer as if read from the port
+ */
+static size_t
+xb_replay_feed(struct xb_ctx *xctx, const uint8_t *data, size_t len) {
+	struct buffer *rx = xctx->rxbuf;
+	size_t n;
+
+	if (rx->readpos == rx->writepos) {
+		rx->readpos = rx->writepos = 0;
+	}
+	else if (rx->readpos) {
+		memmove(rx->data, rx->data + rx->readpos, rx->writepos - rx->readpos);
+		rx->writepos -= rx->readpos;
+		rx->readpos = 0;
+	}
+
+	n = rx->size - rx->writepos;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(rx->data + rx->writepos, data, n);
+	rx->writepos += n;
+
+	return n;
+}
+
+static void
+xb_replay_sleep(uint64_t us) {
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)(us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * run what the radio sent, from the current position on, through
+ * xctx's decoder and handlers as though it were arriving now; speed 1
+ * keeps the recorded pacing, 0 goes as fast as possible.  Returns the
+ * number of frames dispatched.
+ */
+long
+xb_replay(struct xb_ctx *xctx, struct xb_capture_file *f, double speed) {
+	struct xb_capture_rec rec;
+	struct xb_frame frame;
+	uint64_t first = 0, start = 0, due, now;
+	long frames = 0;
+	size_t off;
+
+	if (xctx->reader) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	while (xb_capture_next(f, &rec)) {
+		if (rec.dir != XB_CAPTURE_RX) {
+			continue;
+		}
+
+		if (speed > 0) {
+			if (!start) {
+				first = rec.time_us;
+				start = xb_time_us();
+			}
+			due = start + (uint64_t)((double)(rec.time_us - first) / speed);
+			if ( (now = xb_time_us()) < due) {
+				xb_replay_sleep(due - now);
+			}
+		}
+
+		for(off = 0; off < rec.len; ) {
+			off += xb_replay_feed(xctx, rec.data + off, rec.len - off);
+			while (xb_read_frame(xctx, &frame, 0) > 0) {
+				xb_dispatch_frame(xctx, &frame);
+				frames++;
+			}
+		}
+	}
+
+	return frames;
+}
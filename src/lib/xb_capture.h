@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_CAPTURE_H
+#define XB_CAPTURE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "xb_ctx.h"
+
+/*
+ * Everything read from and written to the radio, as it went over the
+ * wire, with monotonic timestamps.  All integers are big endian.
+ *
+ *   file:    "XBCP" version api_mode pad[3]		(32 bytes)
+ *            wall_start mono_start reserved
+ *   record:  time len dir reserved data[len]		(12 + len bytes)
+ *   index:   "XBCI" version reserved			(16 bytes)
+ *            time offset				(16 bytes each)
+ *
+ * The index (path + ".idx") gets an entry for the first record of every
+ * XB_CAPTURE_INDEX_US so a replay can start anywhere without reading
+ * what comes before.  mono_start and wall_start let record times be
+ * turned into wall-clock times.
+ */
+#define XB_CAPTURE_MAGIC			"XBCP"
+#define XB_CAPTURE_INDEX_MAGIC			"XBCI"
+#define XB_CAPTURE_VERSION			1
+#define XB_CAPTURE_HDRLEN			32
+#define XB_CAPTURE_RECLEN			12
+#define XB_CAPTURE_INDEX_HDRLEN			16
+#define XB_CAPTURE_INDEX_ENTLEN			16
+#define XB_CAPTURE_INDEX_US			1000000ULL
+
+#define XB_CAPTURE_RX				0
+#define XB_CAPTURE_TX				1
+
+/*
+ * pcap export: one packet per API frame, a direction byte (the above)
+ * followed by the unescaped frame from API identifier to the end of
+ * the payload.  There is no registered link type for XBee API frames.
+ */
+#define XB_PCAP_LINKTYPE			147	/* LINKTYPE_USER0 */
+
+struct xb_capture {
+	pthread_mutex_t lock;
+	FILE *fp, *idx;
+	uint64_t offset, next_index;
+};
+
+struct xb_capture_rec {
+	uint64_t time_us;
+	int dir;
+	const uint8_t *data;
+	uint16_t len;
+};
+
+/* a capture mapped for reading */
+struct xb_capture_file {
+	const uint8_t *data, *idx;
+	size_t size, idxsize, pos;
+	enum xb_api_mode api_mode;
+	uint64_t wall_start, mono_start;
+};
+
+int xb_capture_start(struct xb_ctx *, const char *);
+int xb_capture_stop(struct xb_ctx *);
+void xb_capture_write(struct xb_capture *, int, const void *, size_t);
+
+struct xb_capture_file *xb_capture_open(const char *);
+void xb_capture_close(struct xb_capture_file *);
+int xb_capture_seek(struct xb_capture_file *, uint64_t);
+int xb_capture_next(struct xb_capture_file *, struct xb_capture_rec *);
+int xb_capture_export_pcap(struct xb_capture_file *, const char *);
+
+long xb_replay(struct xb_ctx *, struct xb_capture_file *, double);
+
+#endif
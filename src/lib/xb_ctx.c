@@ -15,19 +15,50 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "xb_addr.h"
 #include "xb_buffer.h"
+#include "xb_capture.h"
 #include "xb_ctx.h"
+#include "xb_frag.h"
+#include "xb_frame.h"
+#include "xb_probe.h"
+#include "xb_reader.h"
+#include "xb_ring.h"
+#include "xb_sched.h"
+#include "xb_serial.h"
+#include "xb_sleepy.h"
+#include "xb_stats.h"
+#include "xb_trace.h"
+#include "xb_tx.h"
 
 struct xb_ctx *
 xb_open(const char *device, enum xb_api_mode api_mode) {
-	int xbfd;
+	return xb_open_baud(device, api_mode, 0);
+}
+
+/*
+ * xb_open() for a radio known to be at baud bps (0 if not known): the
+ * port is set to it, and XB_AUTO probes there only, without autobaud or
+ * the probe cache
+ */
+struct xb_ctx *
+xb_open_baud(const char *device, enum xb_api_mode api_mode, uint32_t baud) {
+	int i, xbfd;
 	struct xb_ctx *xctx;
 
 	if ( (xbfd = open(device, O_RDWR | O_NOCTTY)) < 0) {
@@ -40,140 +71,1323 @@ xb_open(const char *device, enum xb_api_mode api_mode) {
 		return NULL;
 	}
 
+	xctx->rxbuf = buffer_new(1024);
+	if (!xctx->rxbuf) {
+		free(xctx);
+		close(xbfd);
+		return NULL;
+	}
+
+	xctx->device = strdup(device);
+	if (!xctx->device) {
+		buffer_free(xctx->rxbuf);
+		free(xctx);
+		close(xbfd);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&xctx->send_lock, NULL) != 0) {
+		free(xctx->device);
+		buffer_free(xctx->rxbuf);
+		free(xctx);
+		close(xbfd);
+		return NULL;
+	}
+
 	xctx->api_mode = api_mode;
-//	xctx->device = strdup(device);
 	xctx->xbfd = xbfd;
-	xctx->frame_id = 1;
+	atomic_init(&xctx->frame_id, 1);
+	for(i = 0; i < 256; i++) {
+		atomic_init(&xctx->id_claimed[i], 0);
+	}
+	xb_decoder_init(&xctx->decoder, api_mode == XB_API_ESC);
+	xctx->trace_id = xb_trace_new_id();
+	xctx->decoder.trace_id = xctx->trace_id;
+	xctx->reader = NULL;
+	xctx->capture = NULL;
+	xctx->stats = NULL;
+	xctx->baud = baud ? baud : XB_BAUD_DEFAULT;
+	xctx->parity = XB_PARITY_DEFAULT;
+	xctx->stop_bits = XB_STOP_BITS_DEFAULT;
+	xctx->flow_control = XB_FLOW_NONE;
+
+	xctx->fw_family = XB_FW_UNKNOWN;
+	xctx->fw_version = xctx->hw_version = 0;
+	xctx->max_payload = 0;
+	xctx->frame_handler = NULL;
+	xctx->frame_handler_arg = NULL;
+	xctx->wake = NULL;
+	xctx->wake_arg = NULL;
+	xctx->txwin = NULL;
+	xctx->sched = NULL;
+	xctx->frag = NULL;
+	xctx->addr = NULL;
+	xctx->ring = NULL;
+	xctx->sleepy = NULL;
+	xctx->txbuf = NULL;
+	xctx->coalesce_us = 0;
+	xctx->txbuf_since = 0;
+
+	xctx->guard_time = XB_GUARD_TIME_DEFAULT;
+	xctx->saved_guard_time = 0;
+	xctx->command_timeout = XB_COMMAND_TIMEOUT_DEFAULT;
+	xctx->command_char = XB_COMMAND_CHAR_DEFAULT;
+	xctx->in_command_mode = 0;
+	/* someone may have been talking to the radio right before us */
+	xctx->last_tx = xb_time_us();
+
+	if (api_mode == XB_AUTO &&
+			xb_probe(xctx, baud ? 0 : XB_PROBE_CACHE | XB_PROBE_AUTOBAUD) < 0) {
+		xb_close(xctx);
+		errno = ENXIO;
+		return NULL;
+	}
+	if (api_mode != XB_AUTO && baud && xb_serial_setup(xctx) < 0) {
+		xb_close(xctx);
+		return NULL;
+	}
 
 	return xctx;
 }
 
+void
+xb_close(struct xb_ctx *xctx) {
+	xb_reader_stop(xctx);
+	xb_flush(xctx);
+	if (xctx->saved_guard_time) {
+		xb_restore_guard_time(xctx);
+	}
+	close(xctx->xbfd);
+	buffer_free(xctx->rxbuf);
+	if (xctx->txbuf) {
+		buffer_free(xctx->txbuf);
+	}
+	xb_sched_free(xctx);
+	xb_frag_free(xctx);
+	xb_addr_free(xctx);
+	xb_ring_destroy(xctx);
+	xb_sleepy_free(xctx);
+	xb_capture_stop(xctx);
+	xb_stats_free(xctx);
+	xb_tx_window_free(xctx);
+	pthread_mutex_destroy(&xctx->send_lock);
+	free(xctx->device);
+	free(xctx);
+}
+
+void
+xb_set_api_mode(struct xb_ctx *xctx, enum xb_api_mode api_mode) {
+	xctx->api_mode = api_mode;
+	xctx->decoder.escaped = (api_mode == XB_API_ESC);
+}
+
+void
+xb_set_frame_handler(struct xb_ctx *xctx, xb_frame_handler handler, void *arg) {
+	xctx->frame_handler = handler;
+	xctx->frame_handler_arg = arg;
+}
+
+/*
+ * have cb called whenever another thread leaves work for the one that
+ * reads this context: held writes to flush or frames queued to send.
+ * It may run on any thread, with nothing locked, and must not block.
+ */
+void
+xb_set_wake(struct xb_ctx *xctx, xb_wake_cb cb, void *arg) {
+	xctx->wake = cb;
+	xctx->wake_arg = arg;
+}
+
+void
+xb_wake(struct xb_ctx *xctx) {
+	if (xctx->wake) {
+		xctx->wake(xctx, xctx->wake_arg);
+	}
+}
+
+uint64_t
+xb_time_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * milliseconds left until deadline for poll(); -1 (forever) stays -1
+ */
+int
+xb_remaining(int timeout, uint64_t deadline) {
+	uint64_t now;
+
+	if (timeout < 0) {
+		return -1;
+	}
+
+	now = xb_time_us();
+	if (now >= deadline) {
+		return 0;
+	}
+
+	return (int)((deadline - now + 999) / 1000);
+}
+
+/*
+ * a poll() timeout, shortened to end by due if that is sooner; a due of
+ * 0 means nothing is due
+ */
+int
+xb_timeout_until(int timeout, uint64_t due) {
+	int ms;
+
+	if (!due) {
+		return timeout;
+	}
+
+	ms = xb_remaining(0, due);
+
+	return (timeout < 0 || ms < timeout) ? ms : timeout;
+}
+
+static int xb_flush_locked(struct xb_ctx *);
+
+/*
+ * about to wait for a reply, so whatever it replies to must go now
+ */
+static int
+xb_flush_due(struct xb_ctx *xctx, int timeout) {
+	int ret = 0;
+
+	pthread_mutex_lock(&xctx->send_lock);
+	if (xctx->txbuf && xctx->txbuf->writepos && (timeout != 0 ||
+			xb_time_us() - xctx->txbuf_since >= xctx->coalesce_us)) {
+		ret = xb_flush_locked(xctx);
+	}
+	pthread_mutex_unlock(&xctx->send_lock);
+
+	return ret;
+}
+
+/*
+ * read whatever is available into rxbuf, waiting at most timeout ms
+ * (-1 waits forever); returns the number of bytes read, 0 on timeout,
+ * -1 on error (ENOBUFS if rxbuf is full of bytes nobody has taken)
+ */
+int
+xb_fill(struct xb_ctx *xctx, int timeout) {
+	struct buffer *rx = xctx->rxbuf;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	if (xctx->reader) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (rx->readpos == rx->writepos) {
+		rx->readpos = rx->writepos = 0;
+	}
+	else if (rx->writepos == rx->size) {
+		memmove(rx->data, rx->data + rx->readpos, rx->writepos - rx->readpos);
+		rx->writepos -= rx->readpos;
+		rx->readpos = 0;
+	}
+	if (rx->writepos == rx->size) {
+		/* nobody is consuming; leave it to them what to drop */
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (xb_flush_due(xctx, timeout) < 0) {
+		return -1;
+	}
+
+	pfd.fd = xctx->xbfd;
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		return (int)ret;
+	}
+
+	ret = read(xctx->xbfd, rx->data + rx->writepos, rx->size - rx->writepos);
+	if (ret <= 0) {
+		XB_TRACE_FAIL(xctx->trace_id, XB_EV_IO_ERROR, ret ? errno : 0, 0);
+		return -1;
+	}
+	XB_TRACE_FRAME(xctx->trace_id, XB_EV_READ, ret, 0);
+	if (xctx->capture) {
+		xb_capture_write(xctx->capture, XB_CAPTURE_RX, rx->data + rx->writepos, (size_t)ret);
+	}
+	if (xctx->stats) {
+		xb_stats_add(xctx->stats->rx_bytes, (unsigned long)ret);
+	}
+	rx->writepos += (uint64_t)ret;
+
+	return (int)ret;
+}
+
+/*
+ * read one command mode reply line, without its terminator; lines end in
+ * '\r' from the radio, or '\n' if the tty is translating (ICRNL)
+ */
+int
+xb_read_line(struct xb_ctx *xctx, char *line, size_t max, int timeout) {
+	struct buffer *rx = xctx->rxbuf;
+	uint64_t deadline, i;
+	size_t len;
+	int ret, wait;
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	for(;;) {
+		for(i = rx->readpos; i < rx->writepos; i++) {
+			if (rx->data[i] != '\r' && rx->data[i] != '\n') {
+				continue;
+			}
+
+			len = i - rx->readpos;
+			if (len >= max) {
+				len = max - 1;
+			}
+			memcpy(line, rx->data + rx->readpos, len);
+			line[len] = '\0';
+			rx->readpos = i + 1;
+
+			if (len) {
+				return (int)len;
+			}
+			/* blank line, e.g. the '\n' of a "\r\n" pair */
+			break;
+		}
+		if (i < rx->writepos) {
+			continue;
+		}
+
+		/* no terminator in a whole buffer; hand it out as a long line */
+		if (rx->readpos == 0 && rx->writepos == rx->size) {
+			len = rx->writepos < max ? rx->writepos : max - 1;
+			memcpy(line, rx->data, len);
+			line[len] = '\0';
+			rx->readpos = rx->writepos;
+			return (int)len;
+		}
+
+		if ( (wait = xb_remaining(timeout, deadline)) == 0) {
+			return 0;
+		}
+		if ( (ret = xb_fill(xctx, wait)) <= 0) {
+			return ret;
+		}
+	}
+}
+
+/*
+ * write all of buf, however many write() calls it takes
+ */
 int
-xb_write_fully(int fd, const char *buf, size_t count) {
+xb_write_fully(int fd, const void *buf, size_t count) {
+	const char *p = (const char *)buf;
 	ssize_t ret;
 
 	while (count > 0) {
-		ret = write(fd, buf, count);
+		ret = write(fd, p, count);
 
 		if (ret <= 0) {
 			return -1;
 		}
 
 		count -= ret;
-		buf += ret;
+		p += ret;
 	}
 
 	return 0;
 }
 
-int
-xb_send(struct xb_ctx *xctx, struct xb_buffer *xbuf) {
+/*
+ * write out anything held back by coalescing; send_lock held
+ */
+static int
+xb_flush_locked(struct xb_ctx *xctx) {
+	struct buffer *tx = xctx->txbuf;
 	int ret;
-	struct buffer *packet;
 
-	if (xctx->api_mode == XB_API || xctx->api_mode == XB_API_ESC) {
-		packet = xb_buffer_as_api(xbuf);
+	if (!tx || !tx->writepos) {
+		return 0;
+	}
+
+	ret = xb_write_fully(xctx->xbfd, tx->data, tx->writepos);
+	xctx->last_tx = xb_time_us();
+	if (ret < 0) {
+		XB_TRACE_FAIL(xctx->trace_id, XB_EV_IO_ERROR, errno, 1);
 	}
 	else {
-		packet = xb_buffer_as_at(xbuf);
+		XB_TRACE_FRAME(xctx->trace_id, XB_EV_WRITE, tx->writepos, 0);
 	}
-
-	ret = xb_write_fully(xctx->xbfd, packet->data, packet->writepos);
-	buffer_free(packet);
+	if (xctx->capture && ret == 0) {
+		xb_capture_write(xctx->capture, XB_CAPTURE_TX, tx->data, tx->writepos);
+	}
+	if (xctx->stats && ret == 0) {
+		xb_stats_add(xctx->stats->tx_bytes, tx->writepos);
+	}
+	tx->writepos = 0;
 
 	return ret;
 }
 
-struct buffer *
-xb_wait_for_reply(struct xb_ctx *xctx, uint8_t frame_id) {
-	ssize_t ret;
-	struct buffer *buf;
-	uint16_t len;
+static int
+xb_output_locked(struct xb_ctx *xctx, const char *buf, size_t count) {
+	int ret;
 
-	buf = buffer_new(512);
-	if (!buf) {
-		return NULL;
+	if (xb_flush_locked(xctx) < 0) {
+		return -1;
 	}
 
-	/* XXX actually look for frame_id (if API) or OK\r (if AT) here */
-	do {
-		ret = read(xctx->xbfd, buf->data + buf->writepos, buf->size - buf->writepos);
-		if (ret < 0) {
-			free(buf);
-			return NULL;
-		}
+	ret = xb_write_fully(xctx->xbfd, buf, count);
+	xctx->last_tx = xb_time_us();
+	if (ret < 0) {
+		XB_TRACE_FAIL(xctx->trace_id, XB_EV_IO_ERROR, errno, 1);
+	}
+	else {
+		XB_TRACE_FRAME(xctx->trace_id, XB_EV_WRITE, count, 0);
+	}
+	if (xctx->capture && ret == 0) {
+		xb_capture_write(xctx->capture, XB_CAPTURE_TX, buf, count);
+	}
+	if (xctx->stats && ret == 0) {
+		xb_stats_add(xctx->stats->tx_bytes, count);
+	}
 
-		buf->writepos += (uint64_t)ret;
+	return ret;
+}
 
-		if (xctx->api_mode == XB_AT) {
-			break;
-		}
-		else if (buf->data[0] == 0x7e) {
-			memcpy(&len, buf->data + 1, 2);
-			len = be16toh(len);
-			if (buf->writepos >= len + 4) {
-				break;
-			}
-		}
-	} while(buf->writepos != buf->size);
+/*
+ * write to the radio, noting the time for the command mode guard
+ */
+int
+xb_output(struct xb_ctx *xctx, const char *buf, size_t count) {
+	int ret;
 
-	return buf;
+	pthread_mutex_lock(&xctx->send_lock);
+	ret = xb_output_locked(xctx, buf, count);
+	pthread_mutex_unlock(&xctx->send_lock);
+
+	return ret;
 }
 
-struct xb_buffer *
-xb_create_at_cmd(struct xb_ctx *xctx, char at_cmd[2], int flags) {
-	struct xb_buffer *xbuf;
-	uint8_t frame_id;
+/*
+ * hold frames from xb_send for up to budget_us, or until max bytes are
+ * waiting, and write them together; a budget of 0 turns this off
+ */
+int
+xb_set_coalesce(struct xb_ctx *xctx, uint32_t budget_us, size_t max) {
+	int ret = 0;
 
-	xbuf = xb_buffer_new();
-	if (!xbuf) {
-		return NULL;
-	}
+	pthread_mutex_lock(&xctx->send_lock);
 
-	if (xctx->api_mode == XB_API || xctx->api_mode == XB_API_ESC) {
-		if (xb_buffer_put_uint8(xbuf, XB_FRAME_TYPE_AT_CMD) < 0) {
-			goto error;
-		}
+	if (xb_flush_locked(xctx) < 0) {
+		ret = -1;
+		goto out;
+	}
 
-		if (flags & API_REQUEST_ACK) {
-			frame_id = xctx->frame_id++;
-			if (xctx->frame_id == 0) {
-				/* when it wraps around, make sure it doesn't stay on 0 */
-				xctx->frame_id++;
-			}
+	if (xctx->txbuf) {
+		buffer_free(xctx->txbuf);
+		xctx->txbuf = NULL;
+	}
+	xctx->coalesce_us = budget_us;
 
-			xb_buffer_set_frame_id(xbuf, frame_id);
-			if (xb_buffer_put_uint8(xbuf, frame_id) < 0) {
-				goto error;
-			}
-		}
+	if (!budget_us) {
+		goto out;
 	}
 
-	if (xb_buffer_put_at_cmd(xbuf, at_cmd) < 0) {
-		goto error;
+	if ( (xctx->txbuf = buffer_new(max ? max : XB_COALESCE_MAX_DEFAULT)) == NULL) {
+		xctx->coalesce_us = 0;
+		ret = -1;
 	}
 
-	return xbuf;
+out:
+	pthread_mutex_unlock(&xctx->send_lock);
+	return ret;
+}
 
-error:
-	xb_buffer_free(xbuf);
-	return NULL;
+int
+xb_flush(struct xb_ctx *xctx) {
+	int ret;
+
+	pthread_mutex_lock(&xctx->send_lock);
+	ret = xb_flush_locked(xctx);
+	pthread_mutex_unlock(&xctx->send_lock);
+
+	return ret;
+}
+
+/*
+ * when coalesced bytes have to be written by, 0 if none are held; a
+ * poll loop should wake up then and call xb_flush_expired()
+ */
+uint64_t
+xb_flush_deadline(struct xb_ctx *xctx) {
+	uint64_t due = 0;
+
+	pthread_mutex_lock(&xctx->send_lock);
+	if (xctx->txbuf && xctx->txbuf->writepos) {
+		due = xctx->txbuf_since + xctx->coalesce_us;
+	}
+	pthread_mutex_unlock(&xctx->send_lock);
+
+	return due;
 }
 
+/*
+ * write out coalesced bytes whose budget has run out
+ */
 int
-xb_send_at_cmd(struct xb_ctx *xctx, char at_cmd[2], uint8_t *frame_id) {
-	struct xb_buffer *xbuf;
+xb_flush_expired(struct xb_ctx *xctx) {
+	return xb_flush_due(xctx, 0);
+}
 
-	xbuf = xb_create_at_cmd(xctx, at_cmd, API_REQUEST_ACK);
-	if (!xbuf) {
+/*
+ * the earliest time the context needs looking after without any input:
+ * held writes due, unanswered frames, partial messages or messages held
+ * for sleeping nodes to give up on, queued frames a rate limit lets go.
+ * 0 if nothing is waiting.  For the thread that reads the context, which
+ * then calls xb_run_timers().
+ */
+uint64_t
+xb_next_timer(struct xb_ctx *xctx) {
+	uint64_t due[5], next = 0;
+	int i;
+
+	due[0] = xb_flush_deadline(xctx);
+	due[1] = xb_tx_next_expiry(xctx);
+	due[2] = xb_frag_next_expiry(xctx);
+	due[3] = xb_sleepy_next_expiry(xctx);
+	due[4] = xb_sched_next_due(xctx);
+
+	for(i = 0; i < 5; i++) {
+		if (due[i] && (!next || due[i] < next)) {
+			next = due[i];
+		}
+	}
+
+	return next;
+}
+
+/*
+ * do whatever has come due: flush, expire and send queued frames
+ */
+int
+xb_run_timers(struct xb_ctx *xctx) {
+	if (xb_flush_expired(xctx) < 0) {
 		return -1;
 	}
-	if (xb_send(xctx, xbuf) < 0) {
-		xb_buffer_free(xbuf);
+	xb_tx_expire(xctx);
+	xb_frag_expire(xctx);
+	xb_sleepy_expire(xctx);
+	if (xb_sched_pending(xctx) && xb_sched_run(xctx, 0) < 0) {
 		return -1;
 	}
-	*frame_id = xb_buffer_get_frame_id(xbuf);
-	xb_buffer_free(xbuf);
 
 	return 0;
 }
+
+static int
+xb_coalesce_locked(struct xb_ctx *xctx, const char *buf, size_t count) {
+	struct buffer *tx = xctx->txbuf;
+
+	if (!tx) {
+		return xb_output_locked(xctx, buf, count);
+	}
+
+	if (tx->writepos + count > tx->size && xb_flush_locked(xctx) < 0) {
+		return -1;
+	}
+	if (count > tx->size) {
+		return xb_output_locked(xctx, buf, count);
+	}
+
+	if (!tx->writepos) {
+		xctx->txbuf_since = xb_time_us();
+	}
+	memcpy(tx->data + tx->writepos, buf, count);
+	tx->writepos += count;
+
+	if (tx->writepos == tx->size ||
+			xb_time_us() - xctx->txbuf_since >= xctx->coalesce_us) {
+		return xb_flush_locked(xctx);
+	}
+
+	return 0;
+}
+
+/*
+ * one whole frame, never interleaved with another thread's
+ */
+static int
+xb_output_coalesced(struct xb_ctx *xctx, const char *buf, size_t count) {
+	int held, ret;
+
+	pthread_mutex_lock(&xctx->send_lock);
+	held = xctx->txbuf && xctx->txbuf->writepos;
+	ret = xb_coalesce_locked(xctx, buf, count);
+	/* newly held bytes have a deadline the reading thread must know of */
+	held = !held && xctx->txbuf && xctx->txbuf->writepos;
+	pthread_mutex_unlock(&xctx->send_lock);
+
+	if (held) {
+		xb_wake(xctx);
+	}
+
+	return ret;
+}
+
+/*
+ * escape (API mode 2), count and write out a whole packet, freeing it
+ */
+static int
+xb_send_packet(struct xb_ctx *xctx, struct buffer *packet) {
+	struct buffer *out = packet;
+	int ret;
+
+	if (xctx->api_mode == XB_API_ESC) {
+		if ( (out = xb_frame_escape(packet)) == NULL) {
+			buffer_free(packet);
+			return -1;
+		}
+	}
+
+	/* counted before the write, so a quick answer finds the send time */
+	if (xctx->api_mode == XB_API || xctx->api_mode == XB_API_ESC) {
+		XB_TRACE_FRAME(xctx->trace_id, XB_EV_TX_FRAME,
+				(uint8_t)packet->data[3] | (uint8_t)packet->data[4] << 8,
+				packet->writepos - 4);
+		if (xctx->stats) {
+			xb_stats_tx(xctx, (const uint8_t *)packet->data + 3, packet->writepos - 4,
+					out->writepos - packet->writepos);
+		}
+	}
+
+	ret = xb_output_coalesced(xctx, out->data, out->writepos);
+	if (out != packet) {
+		buffer_free(out);
+	}
+	buffer_free(packet);
+
+	return ret;
+}
+
+int
+xb_send(struct xb_ctx *xctx, struct xb_buffer *xbuf) {
+	struct buffer *packet;
+
+	if (xctx->api_mode == XB_API || xctx->api_mode == XB_API_ESC) {
+		packet = xb_buffer_as_api(xbuf);
+	}
+	else {
+		packet = xb_buffer_as_at(xbuf);
+	}
+	if (!packet) {
+		return -1;
+	}
+
+	return xb_send_packet(xctx, packet);
+}
+
+/*
+ * library bookkeeping that must see every frame, whoever reads it
+ */
+static void
+xb_observe_frame(struct xb_ctx *xctx, struct xb_frame *frame) {
+	int frame_id;
+
+	XB_TRACE_FRAME(xctx->trace_id, XB_EV_RX_FRAME,
+			frame->data[0] | (frame->len > 1 ? frame->data[1] : 0) << 8, frame->len);
+	if (xctx->stats) {
+		xb_stats_rx(xctx, frame);
+	}
+
+	/* answered, so the ID can go out again */
+	if ((frame->data[0] & 0x80) && (frame_id = xb_frame_id(frame)) > 0) {
+		atomic_store(&xctx->id_claimed[frame_id], 0);
+	}
+
+	/* before the window forgets where a status was for */
+	if (xctx->addr) {
+		xb_addr_observe(xctx, frame);
+	}
+	if (xctx->txwin) {
+		xb_tx_observe(xctx, frame);
+	}
+	/* after the window, so slots just freed can carry held messages */
+	if (xctx->sleepy) {
+		xb_sleepy_observe(xctx, frame);
+	}
+	if (xctx->ring) {
+		xb_ring_put(xctx->ring, frame);
+	}
+}
+
+/*
+ * send a frame that is already built, API identifier onwards
+ */
+int
+xb_send_frame(struct xb_ctx *xctx, const struct xb_frame *frame) {
+	struct buffer *packet;
+	uint8_t csum = 0;
+	uint16_t i;
+
+	if ( (packet = buffer_new(frame->len + 4)) == NULL) {
+		return -1;
+	}
+
+	packet->data[0] = (char)XB_FRAME_DELIM;
+	packet->data[1] = (char)(frame->len >> 8);
+	packet->data[2] = (char)frame->len;
+	for(i = 0; i < frame->len; i++) {
+		packet->data[3 + i] = (char)frame->data[i];
+		csum += frame->data[i];
+	}
+	packet->data[3 + i] = (char)(0xff - csum);
+	packet->writepos = frame->len + 4;
+
+	return xb_send_packet(xctx, packet);
+}
+
+/*
+ * decode the next API frame, waiting at most timeout ms; returns 1 with
+ * a frame, 0 on timeout, -1 on error
+ */
+int
+xb_read_frame(struct xb_ctx *xctx, struct xb_frame *frame, int timeout) {
+	struct buffer *rx = xctx->rxbuf;
+	uint64_t deadline;
+	size_t used;
+	int done, ret, wait;
+
+	if (xctx->stats && xctx->stats->dump_fp) {
+		xb_stats_tick(xctx);
+	}
+
+	if (xctx->reader) {
+		if (xb_flush_due(xctx, timeout) < 0) {
+			return -1;
+		}
+		if ( (ret = xb_reader_get(xctx, frame, timeout)) == 1) {
+			xb_observe_frame(xctx, frame);
+		}
+		return ret;
+	}
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	for(;;) {
+		used = xb_decoder_feed(&xctx->decoder,
+				(const uint8_t *)rx->data + rx->readpos,
+				rx->writepos - rx->readpos, &done);
+		rx->readpos += used;
+
+		if (done) {
+			frame->len = xctx->decoder.frame.len;
+			memcpy(frame->data, xctx->decoder.frame.data, frame->len);
+			xb_observe_frame(xctx, frame);
+			return 1;
+		}
+
+		if ( (wait = xb_remaining(timeout, deadline)) == 0) {
+			return 0;
+		}
+		if ( (ret = xb_fill(xctx, wait)) <= 0) {
+			return ret;
+		}
+	}
+}
+
+/*
+ * hand a frame nobody was waiting for to the application
+ */
+void
+xb_dispatch_frame(struct xb_ctx *xctx, struct xb_frame *frame) {
+	if (xctx->frag && xb_frag_input(xctx, frame)) {
+		return;
+	}
+	if (xctx->frame_handler) {
+		xctx->frame_handler(xctx, frame, xctx->frame_handler_arg);
+	}
+}
+
+/*
+ * wait for the response carrying frame_id; everything else that arrives
+ * meanwhile is dispatched
+ */
+int
+xb_wait_for_frame(struct xb_ctx *xctx, uint8_t frame_id, struct xb_frame *frame, int timeout) {
+	uint64_t deadline;
+	int ret, wait;
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	for(;;) {
+		if ( (wait = xb_remaining(timeout, deadline)) == 0) {
+			return 0;
+		}
+		if ( (ret = xb_read_frame(xctx, frame, wait)) <= 0) {
+			return ret;
+		}
+
+		if ((frame->data[0] & 0x80) && xb_frame_id(frame) == frame_id) {
+			return 1;
+		}
+		xb_dispatch_frame(xctx, frame);
+	}
+}
+
+struct buffer *
+xb_wait_for_reply(struct xb_ctx *xctx, uint8_t frame_id) {
+	char line[XB_AT_LINE_MAX];
+	int ret;
+	struct buffer *buf;
+	struct xb_frame frame;
+	uint8_t csum;
+	uint16_t i;
+
+	if (xctx->api_mode == XB_AT) {
+		if ( (ret = xb_read_line(xctx, line, sizeof(line), -1)) <= 0) {
+			return NULL;
+		}
+
+		buf = buffer_new(ret + 1);
+		if (!buf) {
+			return NULL;
+		}
+		memcpy(buf->data, line, ret + 1);
+		buf->writepos = ret;
+
+		return buf;
+	}
+
+	if (xb_wait_for_frame(xctx, frame_id, &frame, -1) <= 0) {
+		return NULL;
+	}
+
+	/* hand back the whole (unescaped) frame, as it was on the wire */
+	buf = buffer_new(frame.len + 4);
+	if (!buf) {
+		return NULL;
+	}
+
+	buffer_put_uint8(buf, XB_FRAME_DELIM);
+	buffer_put_uint8(buf, (uint8_t)(frame.len >> 8));
+	buffer_put_uint8(buf, (uint8_t)frame.len);
+	for(csum = 0, i = 0; i < frame.len; i++) {
+		buffer_put_uint8(buf, frame.data[i]);
+		csum += frame.data[i];
+	}
+	buffer_put_uint8(buf, 0xff - csum);
+
+	return buf;
+}
+
+/*
+ * whether frame_id was handed out and is neither answered nor stale
+ */
+int
+xb_frame_id_busy(struct xb_ctx *xctx, uint8_t frame_id) {
+	uint64_t claimed;
+
+	if (xb_tx_in_flight(xctx, frame_id)) {
+		return 1;
+	}
+
+	claimed = atomic_load(&xctx->id_claimed[frame_id]);
+
+	return claimed && xb_time_us() - claimed < XB_FRAME_ID_TIMEOUT_MS * 1000ULL;
+}
+
+/*
+ * hand out frame IDs in turn, skipping any still in flight; safe to call
+ * from several threads at once
+ */
+uint8_t
+xb_next_frame_id(struct xb_ctx *xctx) {
+	uint64_t claimed, now;
+	uint8_t frame_id = 1;
+	int tries;
+
+	now = xb_time_us();
+
+	for(tries = 0; tries < 256; tries++) {
+		frame_id = atomic_fetch_add(&xctx->frame_id, 1);
+		if (!frame_id || xb_tx_in_flight(xctx, frame_id)) {
+			continue;
+		}
+
+		claimed = atomic_load(&xctx->id_claimed[frame_id]);
+		if (claimed && now - claimed < XB_FRAME_ID_TIMEOUT_MS * 1000ULL) {
+			continue;
+		}
+		/* another thread may have just taken it */
+		if (atomic_compare_exchange_strong(&xctx->id_claimed[frame_id], &claimed, now)) {
+			return frame_id;
+		}
+	}
+
+	/* all in flight; reuse one rather than fail */
+	return frame_id ? frame_id : 1;
+}
+
+struct xb_buffer *
+xb_create_at_cmd(struct xb_ctx *xctx, char at_cmd[2], int flags) {
+	struct xb_buffer *xbuf;
+	uint8_t frame_id;
+
+	xbuf = xb_buffer_new();
+	if (!xbuf) {
+		return NULL;
+	}
+
+	if (xctx->api_mode == XB_API || xctx->api_mode == XB_API_ESC) {
+		if (xb_buffer_put_uint8(xbuf, XB_FRAME_TYPE_AT_CMD) < 0) {
+			goto error;
+		}
+
+		if (flags & API_REQUEST_ACK) {
+			frame_id = xb_next_frame_id(xctx);
+
+			xb_buffer_set_frame_id(xbuf, frame_id);
+			if (xb_buffer_put_uint8(xbuf, frame_id) < 0) {
+				goto error;
+			}
+		}
+	}
+
+	if (xb_buffer_put_at_cmd(xbuf, at_cmd) < 0) {
+		goto error;
+	}
+
+	return xbuf;
+
+error:
+	xb_buffer_free(xbuf);
+	return NULL;
+}
+
+int
+xb_send_at_cmd(struct xb_ctx *xctx, char at_cmd[2], uint8_t *frame_id) {
+	struct xb_buffer *xbuf;
+
+	xbuf = xb_create_at_cmd(xctx, at_cmd, API_REQUEST_ACK);
+	if (!xbuf) {
+		return -1;
+	}
+	if (xb_send(xctx, xbuf) < 0) {
+		xb_buffer_free(xbuf);
+		return -1;
+	}
+	*frame_id = xb_buffer_get_frame_id(xbuf);
+	xb_buffer_free(xbuf);
+
+	return 0;
+}
+
+/*
+ * append a register value of len bytes to an AT command
+ */
+static int
+xb_put_at_value(struct xb_buffer *xbuf, uint64_t value, int len) {
+	switch (len) {
+	case 0:
+		/* commands like AC and WR take no value */
+		return 0;
+	case 1:
+		return xb_buffer_put_uint8(xbuf, (uint8_t)value);
+	case 2:
+		return xb_buffer_put_uint16(xbuf, (uint16_t)value);
+	case 4:
+		return xb_buffer_put_uint32(xbuf, (uint32_t)value);
+	case 8:
+		return xb_buffer_put_uint64(xbuf, value);
+	}
+
+	return -1;
+}
+
+/*
+ * write a numeric register, in either API or command mode; the value is
+ * sent as len (1, 2, 4 or 8) bytes, or not at all if len is 0
+ */
+int
+xb_at_set(struct xb_ctx *xctx, char at_cmd[2], uint64_t value, int len, int timeout) {
+	struct buffer *reply;
+	struct xb_buffer *xbuf;
+	struct xb_frame frame;
+	int api, ret = -1;
+
+	api = (xctx->api_mode == XB_API || xctx->api_mode == XB_API_ESC);
+	if (!api && xb_enter_command_mode(xctx) < 0) {
+		return -1;
+	}
+
+	if ( (xbuf = xb_create_at_cmd(xctx, at_cmd, api ? API_REQUEST_ACK : 0)) == NULL) {
+		return -1;
+	}
+	if (xb_put_at_value(xbuf, value, len) < 0) {
+		goto out;
+	}
+
+	if (!api) {
+		if (xb_at_batch(xctx, &xbuf, &reply, 1) == 1) {
+			ret = strcmp(reply->data, "OK") ? -1 : 0;
+			buffer_free(reply);
+		}
+		goto out;
+	}
+
+	if (xb_send(xctx, xbuf) < 0 ||
+			xb_wait_for_frame(xctx, xb_buffer_get_frame_id(xbuf), &frame, timeout) <= 0) {
+		goto out;
+	}
+	if (frame.data[0] == XB_FRAME_TYPE_AT_CMD_RESPONSE && frame.len >= 5 &&
+			frame.data[4] == XB_AT_STATUS_OK) {
+		ret = 0;
+	}
+
+out:
+	xb_buffer_free(xbuf);
+	return ret;
+}
+
+/*
+ * read a numeric register, in either API or command mode
+ */
+int
+xb_at_query(struct xb_ctx *xctx, char at_cmd[2], uint64_t *value, int timeout) {
+	struct buffer *reply;
+	struct xb_buffer *xbuf;
+	struct xb_frame frame;
+	char *end;
+	uint16_t i;
+	uint8_t frame_id;
+	int ret;
+
+	if (xctx->api_mode == XB_AT) {
+		if (xb_enter_command_mode(xctx) < 0) {
+			return -1;
+		}
+		if ( (xbuf = xb_create_at_cmd(xctx, at_cmd, 0)) == NULL) {
+			return -1;
+		}
+		ret = xb_at_batch(xctx, &xbuf, &reply, 1);
+		xb_buffer_free(xbuf);
+		if (ret != 1) {
+			return -1;
+		}
+
+		*value = strtoull(reply->data, &end, 16);
+		ret = (end == reply->data || *end) ? -1 : 0;
+		buffer_free(reply);
+
+		return ret;
+	}
+
+	if (xb_send_at_cmd(xctx, at_cmd, &frame_id) < 0) {
+		return -1;
+	}
+	if (xb_wait_for_frame(xctx, frame_id, &frame, timeout) <= 0) {
+		return -1;
+	}
+
+	/* 0x88, frame id, command, status, value */
+	if (frame.data[0] != XB_FRAME_TYPE_AT_CMD_RESPONSE || frame.len < 5 ||
+			frame.data[4] != XB_AT_STATUS_OK) {
+		return -1;
+	}
+
+	for(*value = 0, i = 5; i < frame.len && i < 13; i++) {
+		*value = (*value << 8) | frame.data[i];
+	}
+
+	return 0;
+}
+
+/*
+ * run many command mode commands, chaining as many as fit onto each line
+ * ("ATID,CH,MY\r") and splitting the replies back out per command;
+ * replies[i] receives the reply text for xbufs[i] (NULL if none arrived).
+ * returns the number of replies received, or -1 on error with every
+ * replies[i] NULL
+ */
+int
+xb_at_batch(struct xb_ctx *xctx, struct xb_buffer **xbufs, struct buffer **replies, int count) {
+	char line[XB_AT_LINE_MAX];
+	int done, i, len, used, got = 0;
+	struct buffer *packet;
+
+	if (xctx->api_mode != XB_AT) {
+		return -1;
+	}
+
+	for(i = 0; i < count; i++) {
+		replies[i] = NULL;
+	}
+
+	for(done = 0; done < count; done += used) {
+		packet = xb_buffer_as_at_batch(xbufs + done, count - done, &used);
+		if (!packet) {
+			goto error;
+		}
+
+		len = xb_output(xctx, packet->data, packet->writepos);
+		buffer_free(packet);
+		if (len < 0) {
+			goto error;
+		}
+
+		/* one reply line per command, in order */
+		for(i = 0; i < used; i++) {
+			if ( (len = xb_read_line(xctx, line, sizeof(line), XB_AT_TIMEOUT_MS)) < 0) {
+				goto error;
+			}
+			if (!len) {
+				/* the radio gives up on a line after an ERROR */
+				break;
+			}
+
+			if ( (replies[done + i] = buffer_new(len + 1)) == NULL) {
+				goto error;
+			}
+			memcpy(replies[done + i]->data, line, len + 1);
+			replies[done + i]->writepos = len;
+			got++;
+		}
+		if (i < used) {
+			break;
+		}
+	}
+
+	return got;
+
+error:
+	/* the caller has no count to free by */
+	for(i = 0; i < count; i++) {
+		if (replies[i]) {
+			buffer_free(replies[i]);
+			replies[i] = NULL;
+		}
+	}
+	return -1;
+}
+
+static int
+xb_wait_for_ok(struct xb_ctx *xctx, int timeout) {
+	char line[16];
+	uint64_t deadline, now;
+	int ret;
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	/* skip any transparent-mode data still arriving */
+	while ( (now = xb_time_us()) < deadline) {
+		ret = xb_read_line(xctx, line, sizeof(line),
+				(int)((deadline - now + 999) / 1000));
+		if (ret <= 0) {
+			return -1;
+		}
+		if (!strcmp(line, "OK")) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int
+xb_try_command_mode(struct xb_ctx *xctx, uint16_t guard_time) {
+	char seq[3];
+	uint64_t idle, now;
+
+	/* the line must be quiet for a full guard time before... */
+	now = xb_time_us();
+	idle = (uint64_t)guard_time * 1000;
+	if (now - xctx->last_tx < idle) {
+		usleep((useconds_t)(idle - (now - xctx->last_tx)));
+	}
+
+	/* drop stale input so the OK isn't confused with it */
+	xctx->rxbuf->readpos = xctx->rxbuf->writepos = 0;
+	tcflush(xctx->xbfd, TCIFLUSH);
+
+	memset(seq, xctx->command_char, sizeof(seq));
+	if (xb_output(xctx, seq, sizeof(seq)) < 0) {
+		return -1;
+	}
+
+	/* ...and after; the radio answers OK as soon as it has elapsed */
+	return xb_wait_for_ok(xctx, guard_time + XB_GUARD_SLACK_MS);
+}
+
+/*
+ * enter AT command mode, waiting only as long as the radio's guard time
+ * requires; a no-op if we are still inside the command mode timeout
+ */
+int
+xb_enter_command_mode(struct xb_ctx *xctx) {
+	if (xctx->api_mode != XB_AT) {
+		return -1;
+	}
+
+	if (xctx->in_command_mode &&
+			xb_time_us() - xctx->last_tx + XB_GUARD_SLACK_MS * 1000 <
+			(uint64_t)xctx->command_timeout * 1000) {
+		return 0;
+	}
+	xctx->in_command_mode = 0;
+
+	if (xb_try_command_mode(xctx, xctx->guard_time) < 0) {
+		/* a lowered GT is lost if the radio was reset behind our back */
+		if (!xctx->saved_guard_time ||
+				xb_try_command_mode(xctx, xctx->saved_guard_time) < 0) {
+			return -1;
+		}
+		xctx->guard_time = xctx->saved_guard_time;
+		xctx->saved_guard_time = 0;
+	}
+
+	xctx->in_command_mode = 1;
+
+	return 0;
+}
+
+int
+xb_exit_command_mode(struct xb_ctx *xctx) {
+	struct buffer *reply;
+	struct xb_buffer *xbuf;
+	int ret;
+
+	if (!xctx->in_command_mode) {
+		return 0;
+	}
+
+	if ( (xbuf = xb_create_at_cmd(xctx, "CN", 0)) == NULL) {
+		return -1;
+	}
+	ret = xb_at_batch(xctx, &xbuf, &reply, 1);
+	xb_buffer_free(xbuf);
+
+	xctx->in_command_mode = 0;
+	if (ret != 1) {
+		return -1;
+	}
+	ret = strcmp(reply->data, "OK") ? -1 : 0;
+	buffer_free(reply);
+
+	return ret;
+}
+
+/*
+ * read the radio's GT, CC and CT settings (in one line) so later command
+ * mode entries wait exactly as long as needed
+ */
+int
+xb_learn_command_mode(struct xb_ctx *xctx) {
+	static char *cmds[] = { "GT", "CC", "CT" };
+	struct xb_buffer *xbufs[3];
+	struct buffer *replies[3];
+	int i, ret = -1;
+
+	if (xb_enter_command_mode(xctx) < 0) {
+		return -1;
+	}
+
+	for(i = 0; i < 3; i++) {
+		if ( (xbufs[i] = xb_create_at_cmd(xctx, cmds[i], 0)) == NULL) {
+			while (i--) {
+				xb_buffer_free(xbufs[i]);
+			}
+			return -1;
+		}
+	}
+
+	if (xb_at_batch(xctx, xbufs, replies, 3) == 3) {
+		xctx->guard_time = (uint16_t)strtoul(replies[0]->data, NULL, 16);
+		xctx->command_char = (char)strtoul(replies[1]->data, NULL, 16);
+		xctx->command_timeout = (uint32_t)strtoul(replies[2]->data, NULL, 16) * 100;
+		ret = 0;
+	}
+
+	for(i = 0; i < 3; i++) {
+		xb_buffer_free(xbufs[i]);
+		if (replies[i]) {
+			buffer_free(replies[i]);
+		}
+	}
+
+	return ret;
+}
+
+static int
+xb_write_guard_time(struct xb_ctx *xctx, uint16_t guard_time) {
+	struct buffer *reply;
+	struct xb_buffer *xbuf;
+	int ret = -1;
+
+	if (xb_enter_command_mode(xctx) < 0) {
+		return -1;
+	}
+
+	if ( (xbuf = xb_create_at_cmd(xctx, "GT", 0)) == NULL) {
+		return -1;
+	}
+	if (xb_buffer_put_uint16(xbuf, guard_time) > 0 &&
+			xb_at_batch(xctx, &xbuf, &reply, 1) == 1) {
+		ret = strcmp(reply->data, "OK") ? -1 : 0;
+		buffer_free(reply);
+	}
+	xb_buffer_free(xbuf);
+
+	if (!ret) {
+		xctx->guard_time = guard_time;
+	}
+
+	return ret;
+}
+
+/*
+ * lower (or raise) GT for this session only; it is not written to flash
+ * and xb_close() puts the old value back
+ */
+int
+xb_set_guard_time(struct xb_ctx *xctx, uint16_t guard_time) {
+	uint16_t old = xctx->guard_time;
+
+	/* the radio won't accept anything shorter */
+	if (guard_time < 2) {
+		guard_time = 2;
+	}
+
+	if (xb_write_guard_time(xctx, guard_time) < 0) {
+		return -1;
+	}
+	if (!xctx->saved_guard_time) {
+		xctx->saved_guard_time = old;
+	}
+
+	return 0;
+}
+
+int
+xb_restore_guard_time(struct xb_ctx *xctx) {
+	if (!xctx->saved_guard_time) {
+		return 0;
+	}
+
+	if (xb_write_guard_time(xctx, xctx->saved_guard_time) < 0) {
+		return -1;
+	}
+	xctx->saved_guard_time = 0;
+
+	return xb_exit_command_mode(xctx);
+}
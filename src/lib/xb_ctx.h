@@ -18,36 +18,201 @@
 #ifndef XB_CTX_H
 #define XB_CTX_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "xb_buffer.h"
+#include "xb_frame.h"
 
 #define XB_FRAME_TYPE_AT_CMD			0x08
+#define XB_FRAME_TYPE_AT_CMD_QUEUE		0x09
+#define XB_FRAME_TYPE_TX_REQUEST		0x10
 #define XB_FRAME_TYPE_EXPLICIT_TX		0x11
+#define XB_FRAME_TYPE_REMOTE_AT_CMD		0x17
+#define XB_FRAME_TYPE_RX64			0x80
+#define XB_FRAME_TYPE_RX16			0x81
+#define XB_FRAME_TYPE_RX64_IO			0x82
+#define XB_FRAME_TYPE_RX16_IO			0x83
 #define XB_FRAME_TYPE_AT_CMD_RESPONSE		0x88
+#define XB_FRAME_TYPE_TX_STATUS_LEGACY		0x89
+#define XB_FRAME_TYPE_TX_STATUS			0x8b
+#define XB_FRAME_TYPE_RX			0x90
+#define XB_FRAME_TYPE_EXPLICIT_RX		0x91
+#define XB_FRAME_TYPE_IO_SAMPLE			0x92
+#define XB_FRAME_TYPE_SENSOR_READ		0x94
+#define XB_FRAME_TYPE_NODE_IDENT		0x95
+#define XB_FRAME_TYPE_REMOTE_AT_RESPONSE	0x97
+
+/* AT command response status */
+#define XB_AT_STATUS_OK				0
+#define XB_AT_STATUS_ERROR			1
+#define XB_AT_STATUS_INVALID_COMMAND		2
+#define XB_AT_STATUS_INVALID_PARAMETER		3
+
+/* how long to wait for each command mode reply */
+#define XB_AT_TIMEOUT_MS			1000
+
+/* factory GT/CC/CT settings */
+#define XB_GUARD_TIME_DEFAULT			1000
+#define XB_COMMAND_CHAR_DEFAULT			'+'
+#define XB_COMMAND_TIMEOUT_DEFAULT		10000
+/* allowance for tty/USB latency on top of the guard time */
+#define XB_GUARD_SLACK_MS			100
+
+/* default write coalescing threshold, in bytes */
+#define XB_COALESCE_MAX_DEFAULT			256
+
+/* a frame ID counts as in flight until answered, or for this long */
+#define XB_FRAME_ID_TIMEOUT_MS			30000
 
 /* xb_create_at_cmd flags */
 #define API_REQUEST_ACK				(1 << 0)
 
 enum xb_api_mode {
+	XB_AUTO = -1,	/* probe the radio in xb_open */
 	XB_AT = 0,
 	XB_API = 1,
 	XB_API_ESC = 2,
 };
 
+enum xb_fw_family {
+	XB_FW_UNKNOWN = 0,
+	XB_FW_802_15_4,
+	XB_FW_ZB,
+	XB_FW_DIGIMESH,
+};
+
+struct xb_ctx;
+struct xb_tx_window;
+struct xb_sched;
+struct xb_frag;
+struct xb_addr_table;
+struct xb_ring;
+struct xb_reader;
+struct xb_sleepy;
+struct xb_capture;
+struct xb_stats;
+
+typedef void (*xb_frame_handler)(struct xb_ctx *, struct xb_frame *, void *);
+typedef void (*xb_wake_cb)(struct xb_ctx *, void *);
+
 struct xb_ctx {
 	enum xb_api_mode api_mode;
-	//char *device;
+	char *device;
 	int xbfd;
-	// baud/stop/parity
-	// debug
-	uint8_t frame_id;
+	struct buffer *rxbuf;
+	struct xb_decoder decoder;
+	/* thread reading the port for us; nobody else may then */
+	struct xb_reader *reader;
+	/* everything read and written, if recording */
+	struct xb_capture *capture;
+	/* traffic counters and latency, if counting */
+	struct xb_stats *stats;
+
+	/* serial line settings, applied by xb_serial_setup */
+	uint32_t baud;
+	char parity;
+	uint8_t stop_bits;
+	int flow_control;
+
+	/* what xb_probe found out */
+	enum xb_fw_family fw_family;
+	uint16_t fw_version, hw_version;
+	/* largest RF payload (NP), 0 until asked */
+	uint16_t max_payload;
+
+	/* frames that arrive while waiting for something else */
+	xb_frame_handler frame_handler;
+	void *frame_handler_arg;
+	/* tells the reading thread, from any thread, that it has work */
+	xb_wake_cb wake;
+	void *wake_arg;
+
+	/* outstanding transmit requests, if windowing is on */
+	struct xb_tx_window *txwin;
+	/* and the priority queues that feed it */
+	struct xb_sched *sched;
+	/* splitting and reassembly of long messages */
+	struct xb_frag *frag;
+	/* 64-bit to 16-bit network addresses we have seen */
+	struct xb_addr_table *addr;
+	/* shared memory every decoded frame is published to */
+	struct xb_ring *ring;
+	/* messages held for end devices until they wake */
+	struct xb_sleepy *sleepy;
+
+	/* small writes held back to go out in one write() */
+	struct buffer *txbuf;
+	uint32_t coalesce_us;
+	uint64_t txbuf_since;
+
+	/* command mode (AT) state */
+	uint16_t guard_time, saved_guard_time;
+	uint32_t command_timeout;
+	char command_char;
+	int in_command_mode;
+	uint64_t last_tx;
+	/* tags this context's records in the trace ring (xb_trace.h) */
+	uint16_t trace_id;
+
+	/*
+	 * any thread may send: frame IDs are claimed atomically and whole
+	 * frames are written under send_lock.  Reading stays with one
+	 * thread (or the reader thread), and so do the transmit window,
+	 * scheduler runs and fragmenter, which read while they wait; other
+	 * threads hand frames over with xb_sched_enqueue().
+	 */
+	atomic_uint_least8_t frame_id;
+	/* when each frame ID was handed out, 0 once answered */
+	atomic_uint_least64_t id_claimed[256];
+	pthread_mutex_t send_lock;
 };
 
 struct xb_ctx *xb_open(const char *, enum xb_api_mode);
+struct xb_ctx *xb_open_baud(const char *, enum xb_api_mode, uint32_t);
+void xb_close(struct xb_ctx *);
+void xb_set_api_mode(struct xb_ctx *, enum xb_api_mode);
+void xb_set_frame_handler(struct xb_ctx *, xb_frame_handler, void *);
+void xb_set_wake(struct xb_ctx *, xb_wake_cb, void *);
+void xb_wake(struct xb_ctx *);
+
+uint64_t xb_time_us();
+int xb_remaining(int, uint64_t);
+int xb_timeout_until(int, uint64_t);
+
+int xb_write_fully(int, const void *, size_t);
+int xb_output(struct xb_ctx *, const char *, size_t);
+int xb_set_coalesce(struct xb_ctx *, uint32_t, size_t);
+int xb_flush(struct xb_ctx *);
+uint64_t xb_flush_deadline(struct xb_ctx *);
+int xb_flush_expired(struct xb_ctx *);
+uint64_t xb_next_timer(struct xb_ctx *);
+int xb_run_timers(struct xb_ctx *);
+int xb_fill(struct xb_ctx *, int);
+int xb_read_line(struct xb_ctx *, char *, size_t, int);
 
 int xb_send(struct xb_ctx *, struct xb_buffer *);
+int xb_send_frame(struct xb_ctx *, const struct xb_frame *);
+int xb_read_frame(struct xb_ctx *, struct xb_frame *, int);
+int xb_wait_for_frame(struct xb_ctx *, uint8_t, struct xb_frame *, int);
+void xb_dispatch_frame(struct xb_ctx *, struct xb_frame *);
 struct buffer *xb_wait_for_reply(struct xb_ctx *, uint8_t);
 
+uint8_t xb_next_frame_id(struct xb_ctx *);
+int xb_frame_id_busy(struct xb_ctx *, uint8_t);
 struct xb_buffer *xb_create_at_cmd(struct xb_ctx *, char[2], int);
 int xb_send_at_cmd(struct xb_ctx *, char[2], uint8_t *);
+int xb_at_query(struct xb_ctx *, char[2], uint64_t *, int);
+int xb_at_set(struct xb_ctx *, char[2], uint64_t, int, int);
+
+int xb_at_batch(struct xb_ctx *, struct xb_buffer **, struct buffer **, int);
+
+int xb_enter_command_mode(struct xb_ctx *);
+int xb_exit_command_mode(struct xb_ctx *);
+int xb_learn_command_mode(struct xb_ctx *);
+int xb_set_guard_time(struct xb_ctx *, uint16_t);
+int xb_restore_guard_time(struct xb_ctx *);
 
 #endif
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_frag.h"
+#include "xb_lz.h"
+#include "xb_tx.h"
+
+int
+xb_frag_init(struct xb_ctx *xctx, size_t msg_max) {
+	struct xb_frag *frag;
+
+	frag = (struct xb_frag *)calloc(1, sizeof(struct xb_frag));
+	if (!frag) {
+		return -1;
+	}
+
+	frag->msg_max = msg_max ? msg_max : XB_FRAG_MSG_MAX_DEFAULT;
+	frag->timeout = XB_FRAG_TIMEOUT_MS;
+
+	xb_frag_free(xctx);
+	xctx->frag = frag;
+
+	return 0;
+}
+
+static void
+xb_frag_release(struct xb_frag_partial *part) {
+	free(part->data);
+	memset(part, 0, sizeof(*part));
+}
+
+void
+xb_frag_free(struct xb_ctx *xctx) {
+	int i;
+
+	if (!xctx->frag) {
+		return;
+	}
+
+	for(i = 0; i < XB_FRAG_PARTIALS; i++) {
+		xb_frag_release(&xctx->frag->partials[i]);
+	}
+	free(xctx->frag->dict);
+	free(xctx->frag);
+	xctx->frag = NULL;
+}
+
+void
+xb_frag_set_handler(struct xb_ctx *xctx, xb_msg_handler handler, void *arg) {
+	if (xctx->frag) {
+		xctx->frag->handler = handler;
+		xctx->frag->handler_arg = arg;
+	}
+}
+
+/*
+ * turn on compression with a dictionary both ends share (len may be 0),
+ * or off with NULL.  Peers are asked what they support before anything
+ * is compressed for them.
+ */
+int
+xb_frag_set_dict(struct xb_ctx *xctx, const char *dict, size_t len) {
+	struct xb_frag *frag = xctx->frag;
+	uint8_t *copy = NULL;
+
+	if (!frag) {
+		return -1;
+	}
+
+	if (dict) {
+		/* the codec only reaches back this far */
+		if (len > XB_LZ_DICT_MAX) {
+			dict += len - XB_LZ_DICT_MAX;
+			len = XB_LZ_DICT_MAX;
+		}
+		if ( (copy = (uint8_t *)malloc(len + 1)) == NULL) {
+			return -1;
+		}
+		memcpy(copy, dict, len);
+	}
+
+	free(frag->dict);
+	frag->dict = copy;
+	frag->dict_len = dict ? len : 0;
+	frag->dict_id = xb_lz_dict_id(frag->dict, frag->dict_len);
+	frag->lz = dict != NULL;
+
+	/* they have to hear about the new dictionary */
+	memset(frag->peers, 0, sizeof(frag->peers));
+
+	return 0;
+}
+
+/*
+ * the largest RF payload the radio takes, asked once and then kept
+ */
+int
+xb_frag_payload(struct xb_ctx *xctx) {
+	uint64_t np;
+
+	if (xctx->max_payload) {
+		return xctx->max_payload;
+	}
+
+	if (xctx->fw_family == XB_FW_802_15_4) {
+		xctx->max_payload = XB_PAYLOAD_802_15_4;
+	}
+	else if (xb_at_query(xctx, "NP", &np, XB_AT_TIMEOUT_MS) == 0 &&
+			np > XB_FRAG_HDR_LEN && np <= XB_FRAME_MAX) {
+		xctx->max_payload = (uint16_t)np;
+	}
+	else {
+		xctx->max_payload = XB_PAYLOAD_DEFAULT;
+	}
+
+	return xctx->max_payload;
+}
+
+static int
+xb_frag_send_flags(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		uint8_t flags, const char *data, size_t len, int tx_flags) {
+	struct xb_frag *frag = xctx->frag;
+	char buf[XB_FRAME_MAX];
+	size_t chunk, count, i, n;
+	uint8_t msg_id;
+
+	chunk = (size_t)xb_frag_payload(xctx) - XB_FRAG_HDR_LEN;
+	count = len ? (len + chunk - 1) / chunk : 1;
+	if (count > XB_FRAG_COUNT_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	msg_id = frag->next_msg_id++;
+
+	for(i = 0; i < count; i++) {
+		n = len - i * chunk;
+		if (n > chunk) {
+			n = chunk;
+		}
+
+		buf[0] = (char)XB_FRAG_MAGIC0;
+		buf[1] = (char)XB_FRAG_MAGIC1;
+		buf[2] = (char)(XB_FRAG_VERSION | flags);
+		buf[3] = (char)msg_id;
+		buf[4] = (char)i;
+		buf[5] = (char)count;
+		memcpy(buf + XB_FRAG_HDR_LEN, data + i * chunk, n);
+
+		if (xb_tx_send(xctx, dest64, dest16, buf,
+				(uint16_t)(n + XB_FRAG_HDR_LEN), tx_flags) < 0) {
+			return -1;
+		}
+	}
+
+	return msg_id;
+}
+
+/*
+ * the remembered peer for addr64; with create, the least recently used
+ * entry is recycled if need be
+ */
+static struct xb_frag_peer *
+xb_frag_peer(struct xb_frag *frag, uint64_t addr64, int create) {
+	struct xb_frag_peer *peer, *victim = NULL;
+	int i;
+
+	for(i = 0; i < XB_FRAG_PEERS; i++) {
+		peer = &frag->peers[i];
+		if (peer->used && peer->addr64 == addr64) {
+			peer->used = xb_time_us();
+			return peer;
+		}
+		if (!victim || peer->used < victim->used) {
+			victim = peer;
+		}
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	memset(victim, 0, sizeof(*victim));
+	victim->addr64 = addr64;
+	victim->used = xb_time_us();
+
+	return victim;
+}
+
+static int
+xb_frag_send_ctrl(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16, uint8_t type) {
+	struct xb_frag *frag = xctx->frag;
+	char msg[XB_FRAG_CTRL_LEN];
+
+	msg[0] = (char)type;
+	msg[1] = (char)(frag->lz ? XB_FRAG_CAP_LZ : 0);
+	msg[2] = (char)(frag->dict_id >> 24);
+	msg[3] = (char)(frag->dict_id >> 16);
+	msg[4] = (char)(frag->dict_id >> 8);
+	msg[5] = (char)frag->dict_id;
+
+	/* may be called while the window is being waited on; never block */
+	return xb_frag_send_flags(xctx, dest64, dest16, XB_FRAG_F_CTRL,
+			msg, sizeof(msg), XB_TX_NONBLOCK);
+}
+
+/*
+ * compress for dest64 if it has told us it shares our dictionary, and
+ * ask it if we have not heard from it
+ */
+static size_t
+xb_frag_compress(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		const char *data, size_t len, uint8_t **out) {
+	struct xb_frag *frag = xctx->frag;
+	struct xb_frag_peer *peer;
+	uint64_t now;
+	size_t clen;
+
+	if (!frag->lz || !len || dest64 == XB_ADDR64_BROADCAST ||
+			dest64 == XB_ADDR64_UNKNOWN) {
+		return 0;
+	}
+
+	peer = xb_frag_peer(frag, dest64, 1);
+	if (!peer->answered) {
+		now = xb_time_us();
+		if (!peer->asked ||
+				now - peer->asked >= (uint64_t)XB_FRAG_HELLO_INTERVAL_MS * 1000) {
+			peer->asked = now;
+			xb_frag_send_ctrl(xctx, dest64, dest16, XB_FRAG_CTRL_HELLO);
+		}
+		return 0;
+	}
+	if (!(peer->caps & XB_FRAG_CAP_LZ) || peer->dict_id != frag->dict_id) {
+		return 0;
+	}
+
+	/* only worth it if it saves something */
+	if ( (*out = (uint8_t *)malloc(len)) == NULL) {
+		return 0;
+	}
+	clen = xb_lz_compress(frag->dict, frag->dict_len, (const uint8_t *)data, len,
+			*out, len - 1);
+	if (!clen) {
+		free(*out);
+	}
+
+	return clen;
+}
+
+/*
+ * send a message of any length up to XB_FRAG_COUNT_MAX fragments,
+ * compressed where the destination can take it; the fragments are
+ * pipelined through the transmit window.  Returns the message ID.
+ */
+int
+xb_frag_send(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		const char *data, size_t len) {
+	uint8_t *packed;
+	size_t plen;
+	int ret;
+
+	if (!xctx->frag) {
+		return -1;
+	}
+
+	if ( (plen = xb_frag_compress(xctx, dest64, dest16, data, len, &packed)) > 0) {
+		ret = xb_frag_send_flags(xctx, dest64, dest16, XB_FRAG_F_LZ,
+				(const char *)packed, plen, 0);
+		free(packed);
+		return ret;
+	}
+
+	return xb_frag_send_flags(xctx, dest64, dest16, 0, data, len, 0);
+}
+
+/*
+ * drop messages that have been waiting for their missing pieces too long
+ */
+void
+xb_frag_expire(struct xb_ctx *xctx) {
+	struct xb_frag *frag = xctx->frag;
+	uint64_t now;
+	int i;
+
+	if (!frag) {
+		return;
+	}
+
+	now = xb_time_us();
+	for(i = 0; i < XB_FRAG_PARTIALS; i++) {
+		if (frag->partials[i].in_use &&
+				now - frag->partials[i].started >= (uint64_t)frag->timeout * 1000) {
+			xb_frag_release(&frag->partials[i]);
+			frag->dropped++;
+		}
+	}
+}
+
+/*
+ * when the oldest partial message will be given up on, 0 if none is
+ */
+uint64_t
+xb_frag_next_expiry(struct xb_ctx *xctx) {
+	struct xb_frag *frag = xctx->frag;
+	uint64_t due, next = 0;
+	int i;
+
+	if (!frag) {
+		return 0;
+	}
+
+	for(i = 0; i < XB_FRAG_PARTIALS; i++) {
+		if (frag->partials[i].in_use) {
+			due = frag->partials[i].started + (uint64_t)frag->timeout * 1000;
+			if (!next || due < next) {
+				next = due;
+			}
+		}
+	}
+
+	return next;
+}
+
+static int
+xb_frag_same_source(struct xb_frag_partial *part, struct xb_rx *rx) {
+	if (rx->src64 != XB_ADDR64_UNKNOWN) {
+		return part->src64 == rx->src64;
+	}
+	return part->src64 == XB_ADDR64_UNKNOWN && part->src16 == rx->src16;
+}
+
+/*
+ * the partial for this fragment, starting one if need be; when all are
+ * taken the oldest gives way
+ */
+static struct xb_frag_partial *
+xb_frag_partial(struct xb_frag *frag, struct xb_rx *rx, uint8_t msg_id, uint8_t count) {
+	struct xb_frag_partial *part, *free_part = NULL, *oldest = NULL;
+	int i;
+
+	for(i = 0; i < XB_FRAG_PARTIALS; i++) {
+		part = &frag->partials[i];
+		if (!part->in_use) {
+			if (!free_part) {
+				free_part = part;
+			}
+			continue;
+		}
+		if (part->msg_id == msg_id && xb_frag_same_source(part, rx)) {
+			if (part->count == count) {
+				return part;
+			}
+			/* the sender has wrapped its message IDs */
+			xb_frag_release(part);
+			frag->dropped++;
+			free_part = part;
+			break;
+		}
+		if (!oldest || part->started < oldest->started) {
+			oldest = part;
+		}
+	}
+
+	if (!free_part) {
+		xb_frag_release(oldest);
+		frag->dropped++;
+		free_part = oldest;
+	}
+
+	part = free_part;
+	part->in_use = 1;
+	part->src64 = rx->src64;
+	part->src16 = rx->src16;
+	part->msg_id = msg_id;
+	part->count = count;
+	part->started = xb_time_us();
+
+	return part;
+}
+
+static void
+xb_frag_control(struct xb_ctx *xctx, struct xb_rx *rx, const char *data, size_t len) {
+	struct xb_frag_peer *peer;
+	const uint8_t *msg = (const uint8_t *)data;
+
+	if (len < XB_FRAG_CTRL_LEN || rx->src64 == XB_ADDR64_UNKNOWN) {
+		return;
+	}
+	if (msg[0] != XB_FRAG_CTRL_HELLO && msg[0] != XB_FRAG_CTRL_HELLO_ACK) {
+		return;
+	}
+
+	peer = xb_frag_peer(xctx->frag, rx->src64, 1);
+	peer->answered = 1;
+	peer->caps = msg[1];
+	peer->dict_id = ((uint32_t)msg[2] << 24) | ((uint32_t)msg[3] << 16) |
+		((uint32_t)msg[4] << 8) | msg[5];
+
+	if (msg[0] == XB_FRAG_CTRL_HELLO) {
+		xb_frag_send_ctrl(xctx, rx->src64, rx->src16, XB_FRAG_CTRL_HELLO_ACK);
+	}
+}
+
+static void
+xb_frag_deliver(struct xb_ctx *xctx, struct xb_rx *rx, uint8_t flags,
+		const char *data, size_t len) {
+	struct xb_frag *frag = xctx->frag;
+	char *plain;
+	int plen;
+
+	if (flags & XB_FRAG_F_CTRL) {
+		xb_frag_control(xctx, rx, data, len);
+		return;
+	}
+
+	if (flags & XB_FRAG_F_LZ) {
+		if (!frag->lz || (plain = (char *)malloc(frag->msg_max)) == NULL) {
+			frag->dropped++;
+			return;
+		}
+		plen = xb_lz_decompress(frag->dict, frag->dict_len, (const uint8_t *)data,
+				len, (uint8_t *)plain, frag->msg_max);
+		if (plen < 0) {
+			frag->dropped++;
+		}
+		else if (frag->handler) {
+			frag->handler(xctx, rx->src64, rx->src16, plain, (size_t)plen,
+					frag->handler_arg);
+		}
+		free(plain);
+		return;
+	}
+
+	if (frag->handler) {
+		frag->handler(xctx, rx->src64, rx->src16, data, len, frag->handler_arg);
+	}
+}
+
+/*
+ * take a received fragment; returns 1 if the frame was one of ours, 0
+ * for anything that does not look like one, to be passed on
+ */
+int
+xb_frag_input(struct xb_ctx *xctx, struct xb_frame *frame) {
+	struct xb_frag *frag = xctx->frag;
+	struct xb_frag_partial *part;
+	struct xb_rx rx;
+	uint8_t flags, msg_id, idx, count;
+	uint16_t len;
+	const char *data;
+
+	if (xb_frame_rx(frame, &rx) < 0 || rx.len < XB_FRAG_HDR_LEN ||
+			rx.data[0] != XB_FRAG_MAGIC0 || rx.data[1] != XB_FRAG_MAGIC1 ||
+			(rx.data[2] & XB_FRAG_VERSION_MASK) != XB_FRAG_VERSION) {
+		return 0;
+	}
+
+	flags = rx.data[2] & XB_FRAG_FLAGS_MASK;
+	msg_id = rx.data[3];
+	idx = rx.data[4];
+	count = rx.data[5];
+	data = (const char *)rx.data + XB_FRAG_HDR_LEN;
+	len = (uint16_t)(rx.len - XB_FRAG_HDR_LEN);
+
+	/* not a header after all */
+	if (!count || idx >= count) {
+		return 0;
+	}
+	if (count == 1) {
+		xb_frag_deliver(xctx, &rx, flags, data, len);
+		return 1;
+	}
+
+	xb_frag_expire(xctx);
+	part = xb_frag_partial(frag, &rx, msg_id, count);
+	part->flags = flags;
+
+	if (part->have[idx / 8] & (1 << (idx % 8))) {
+		/* a retransmission we already have */
+		return 1;
+	}
+
+	if (idx == count - 1) {
+		memcpy(part->last, data, len);
+		part->last_len = len;
+	}
+	else {
+		if (!part->frag_len) {
+			if (!len || (size_t)count * len > frag->msg_max ||
+					(part->data = (char *)malloc((size_t)count * len)) == NULL) {
+				goto drop;
+			}
+			part->frag_len = len;
+		}
+		else if (len != part->frag_len) {
+			goto drop;
+		}
+		memcpy(part->data + (size_t)idx * len, data, len);
+	}
+
+	part->have[idx / 8] |= (uint8_t)(1 << (idx % 8));
+	if (++part->nrecv < count) {
+		return 1;
+	}
+
+	if (part->last_len > part->frag_len) {
+		goto drop;
+	}
+	memcpy(part->data + (size_t)(count - 1) * part->frag_len, part->last, part->last_len);
+	xb_frag_deliver(xctx, &rx, part->flags, part->data,
+			(size_t)(count - 1) * part->frag_len + part->last_len);
+	xb_frag_release(part);
+
+	return 1;
+
+drop:
+	xb_frag_release(part);
+	frag->dropped++;
+	return 1;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_FRAG_H
+#define XB_FRAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+/*
+ * every fragment starts with a 6 byte header: two magic bytes, version
+ * and flags, message ID, fragment index and fragment count.  Payloads
+ * without it belong to the application.
+ */
+#define XB_FRAG_HDR_LEN				6
+#define XB_FRAG_MAGIC0				0xfa
+#define XB_FRAG_MAGIC1				0xce
+#define XB_FRAG_VERSION				0x10
+#define XB_FRAG_VERSION_MASK			0xf0
+#define XB_FRAG_FLAGS_MASK			0x0f
+#define XB_FRAG_COUNT_MAX			255
+
+/* header flags */
+#define XB_FRAG_F_LZ				0x01	/* message is compressed */
+#define XB_FRAG_F_CTRL				0x02	/* for us, not the application */
+
+/*
+ * control messages: type, our capabilities and, with XB_FRAG_CAP_LZ,
+ * the ID of our dictionary
+ */
+#define XB_FRAG_CTRL_HELLO			0x01
+#define XB_FRAG_CTRL_HELLO_ACK			0x02
+#define XB_FRAG_CTRL_LEN			6
+#define XB_FRAG_CAP_LZ				0x01
+
+/* peers whose capabilities we remember, and how often to ask again */
+#define XB_FRAG_PEERS				32
+#define XB_FRAG_HELLO_INTERVAL_MS		60000
+
+/* RF payload sizes when the radio has no NP to tell us */
+#define XB_PAYLOAD_DEFAULT			72
+#define XB_PAYLOAD_802_15_4			100
+
+/* messages being reassembled at once, and how long one may take */
+#define XB_FRAG_PARTIALS			8
+#define XB_FRAG_TIMEOUT_MS			5000
+#define XB_FRAG_MSG_MAX_DEFAULT			16384
+
+typedef void (*xb_msg_handler)(struct xb_ctx *, uint64_t, uint16_t,
+		const char *, size_t, void *);
+
+struct xb_frag_partial {
+	int in_use;
+	uint64_t src64;
+	uint16_t src16;
+	uint8_t msg_id, count, nrecv, flags;
+	uint8_t have[32];
+	uint64_t started;
+
+	/* every fragment but the last is frag_len long */
+	uint16_t frag_len;
+	char *data;
+
+	uint16_t last_len;
+	char last[XB_FRAME_MAX];
+};
+
+struct xb_frag_peer {
+	uint64_t addr64;
+	int answered;
+	uint8_t caps;
+	uint32_t dict_id;
+	uint64_t asked, used;
+};
+
+struct xb_frag {
+	uint8_t next_msg_id;
+	size_t msg_max;
+	uint32_t timeout;
+	unsigned long dropped;
+
+	xb_msg_handler handler;
+	void *handler_arg;
+
+	/* compression, once a dictionary is set */
+	int lz;
+	uint8_t *dict;
+	size_t dict_len;
+	uint32_t dict_id;
+	struct xb_frag_peer peers[XB_FRAG_PEERS];
+
+	struct xb_frag_partial partials[XB_FRAG_PARTIALS];
+};
+
+int xb_frag_init(struct xb_ctx *, size_t);
+void xb_frag_free(struct xb_ctx *);
+void xb_frag_set_handler(struct xb_ctx *, xb_msg_handler, void *);
+int xb_frag_set_dict(struct xb_ctx *, const char *, size_t);
+
+/* like the transmit window, only for the thread that reads frames */
+int xb_frag_payload(struct xb_ctx *);
+int xb_frag_send(struct xb_ctx *, uint64_t, uint16_t, const char *, size_t);
+
+int xb_frag_input(struct xb_ctx *, struct xb_frame *);
+void xb_frag_expire(struct xb_ctx *);
+uint64_t xb_frag_next_expiry(struct xb_ctx *);
+
+#endif
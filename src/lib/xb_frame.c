@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_trace.h"
+#include "xb_tx.h"
+
+#define xb_decoder_count(c)	atomic_store_explicit(&(c), \
+		atomic_load_explicit(&(c), memory_order_relaxed) + 1, memory_order_relaxed)
+
+#define xb_decoder_state(dec, s)	do { \
+		XB_TRACE_DEC((dec)->trace_id, XB_EV_DECODER, (dec)->state, (s)); \
+		(dec)->state = (s); \
+	} while (0)
+
+void
+xb_decoder_init(struct xb_decoder *dec, int escaped) {
+	memset(dec, 0, sizeof(*dec));
+	dec->state = XB_DEC_SYNC;
+	dec->escaped = escaped;
+}
+
+/*
+ * run bytes through the decoder, stopping right after a complete frame;
+ * returns the number of bytes consumed and sets *done if dec->frame is
+ * now valid
+ */
+size_t
+xb_decoder_feed(struct xb_decoder *dec, const uint8_t *data, size_t len, int *done) {
+	size_t i;
+	uint8_t b;
+
+	*done = 0;
+
+	for(i = 0; i < len; i++) {
+		b = data[i];
+
+		/* with escaping a delimiter always starts a new frame */
+		if (b == XB_FRAME_DELIM && (dec->state == XB_DEC_SYNC || dec->escaped)) {
+			if (dec->state != XB_DEC_SYNC) {
+				xb_decoder_count(dec->resyncs);
+				XB_TRACE_ERR(dec->trace_id, XB_EV_RESYNC, dec->state, dec->pos);
+			}
+			xb_decoder_state(dec, XB_DEC_LEN_HI);
+			dec->escape_next = 0;
+			continue;
+		}
+		if (dec->state == XB_DEC_SYNC) {
+			xb_decoder_count(dec->discarded);
+			continue;
+		}
+
+		if (dec->escaped) {
+			if (b == XB_FRAME_ESCAPE) {
+				xb_decoder_count(dec->escapes);
+				dec->escape_next = 1;
+				continue;
+			}
+			if (dec->escape_next) {
+				b ^= 0x20;
+				dec->escape_next = 0;
+			}
+		}
+
+		switch (dec->state) {
+		case XB_DEC_LEN_HI:
+			dec->frame.len = (uint16_t)(b << 8);
+			xb_decoder_state(dec, XB_DEC_LEN_LO);
+			break;
+		case XB_DEC_LEN_LO:
+			dec->frame.len |= b;
+			if (!dec->frame.len || dec->frame.len > XB_FRAME_MAX) {
+				xb_decoder_count(dec->resyncs);
+				XB_TRACE_ERR(dec->trace_id, XB_EV_RESYNC, dec->state, dec->frame.len);
+				xb_decoder_state(dec, XB_DEC_SYNC);
+				break;
+			}
+			dec->pos = 0;
+			dec->csum = 0;
+			xb_decoder_state(dec, XB_DEC_DATA);
+			break;
+		case XB_DEC_DATA:
+			dec->frame.data[dec->pos++] = b;
+			dec->csum += b;
+			if (dec->pos == dec->frame.len) {
+				xb_decoder_state(dec, XB_DEC_CSUM);
+			}
+			break;
+		case XB_DEC_CSUM:
+			xb_decoder_state(dec, XB_DEC_SYNC);
+			if ((uint8_t)(dec->csum + b) == 0xff) {
+				*done = 1;
+				return i + 1;
+			}
+			xb_decoder_count(dec->csum_errors);
+			XB_TRACE_ERR(dec->trace_id, XB_EV_CSUM, dec->frame.data[0], (uint8_t)(dec->csum + b));
+			break;
+		case XB_DEC_SYNC:
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * frame ID of a request or response frame, -1 for frame types without one
+ */
+int
+xb_frame_id(const struct xb_frame *frame) {
+	if (frame->len < 2) {
+		return -1;
+	}
+
+	switch (frame->data[0]) {
+	case XB_FRAME_TYPE_TX64_REQUEST:
+	case XB_FRAME_TYPE_TX16_REQUEST:
+	case XB_FRAME_TYPE_AT_CMD:
+	case XB_FRAME_TYPE_AT_CMD_QUEUE:
+	case XB_FRAME_TYPE_TX_REQUEST:
+	case XB_FRAME_TYPE_EXPLICIT_TX:
+	case XB_FRAME_TYPE_REMOTE_AT_CMD:
+	case XB_FRAME_TYPE_AT_CMD_RESPONSE:
+	case XB_FRAME_TYPE_TX_STATUS_LEGACY:
+	case XB_FRAME_TYPE_TX_STATUS:
+	case XB_FRAME_TYPE_REMOTE_AT_RESPONSE:
+		return frame->data[1];
+	}
+
+	return -1;
+}
+
+/*
+ * len bytes of big-endian (network order) integer, as radio frames and
+ * our own files store them
+ */
+uint64_t
+xb_get_be(const uint8_t *p, int len) {
+	uint64_t v = 0;
+
+	while (len--) {
+		v = (v << 8) | *p++;
+	}
+
+	return v;
+}
+
+void
+xb_put_be(uint8_t *p, uint64_t v, int len) {
+	while (len--) {
+		p[len] = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+/*
+ * and little-endian, for files laid out to be read in place
+ */
+uint64_t
+xb_get_le(const uint8_t *p, int len) {
+	uint64_t v = 0;
+
+	while (len--) {
+		v = (v << 8) | p[len];
+	}
+
+	return v;
+}
+
+void
+xb_put_le(uint8_t *p, uint64_t v, int len) {
+	while (len--) {
+		*p++ = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+/*
+ * pick apart any of the receive packet frames; returns 0 and fills in rx,
+ * -1 if this is not one
+ */
+int
+xb_frame_rx(const struct xb_frame *frame, struct xb_rx *rx) {
+	const uint8_t *d = frame->data;
+	uint16_t hdr;
+
+	switch (d[0]) {
+	case XB_FRAME_TYPE_RX:
+		/* source 64, source 16, options */
+		hdr = 12;
+		break;
+	case XB_FRAME_TYPE_EXPLICIT_RX:
+		/* ... plus endpoints, cluster and profile before the options */
+		hdr = 18;
+		break;
+	case XB_FRAME_TYPE_RX64:
+		/* source 64, RSSI, options */
+		hdr = 11;
+		break;
+	case XB_FRAME_TYPE_RX16:
+		/* source 16, RSSI, options */
+		hdr = 5;
+		break;
+	default:
+		return -1;
+	}
+
+	if (frame->len < hdr) {
+		return -1;
+	}
+
+	if (d[0] == XB_FRAME_TYPE_RX16) {
+		rx->src64 = XB_ADDR64_UNKNOWN;
+		rx->src16 = (uint16_t)xb_get_be(d + 1, 2);
+	}
+	else {
+		rx->src64 = xb_get_be(d + 1, 8);
+		rx->src16 = d[0] == XB_FRAME_TYPE_RX64 ? XB_ADDR16_UNKNOWN :
+			(uint16_t)xb_get_be(d + 9, 2);
+	}
+	rx->options = d[hdr - 1];
+	rx->data = d + hdr;
+	rx->len = (uint16_t)(frame->len - hdr);
+
+	return 0;
+}
+
+/*
+ * API mode 2: escape everything after the start delimiter
+ */
+struct buffer *
+xb_frame_escape(struct buffer *packet) {
+	struct buffer *buf;
+	uint64_t i;
+	uint8_t b;
+
+	buf = buffer_new(packet->writepos * 2);
+	if (!buf) {
+		return NULL;
+	}
+
+	buf->data[buf->writepos++] = packet->data[0];
+	for(i = 1; i < packet->writepos; i++) {
+		b = (uint8_t)packet->data[i];
+		if (b == XB_FRAME_DELIM || b == XB_FRAME_ESCAPE ||
+				b == XB_FRAME_XON || b == XB_FRAME_XOFF) {
+			buf->data[buf->writepos++] = XB_FRAME_ESCAPE;
+			b ^= 0x20;
+		}
+		buf->data[buf->writepos++] = (char)b;
+	}
+
+	return buf;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_FRAME_H
+#define XB_FRAME_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+#define XB_FRAME_DELIM				0x7e
+#define XB_FRAME_ESCAPE				0x7d
+#define XB_FRAME_XON				0x11
+#define XB_FRAME_XOFF				0x13
+
+/* largest frame data (API identifier through payload) we accept */
+#define XB_FRAME_MAX				512
+
+/* a decoded API frame, without delimiter, length, escapes or checksum */
+struct xb_frame {
+	uint16_t len;
+	uint8_t data[XB_FRAME_MAX];
+};
+
+/* where a received RF payload came from, pointing into the frame */
+struct xb_rx {
+	uint64_t src64;
+	uint16_t src16;
+	uint8_t options;
+	const uint8_t *data;
+	uint16_t len;
+};
+
+enum xb_decoder_state {
+	XB_DEC_SYNC = 0,
+	XB_DEC_LEN_HI,
+	XB_DEC_LEN_LO,
+	XB_DEC_DATA,
+	XB_DEC_CSUM,
+};
+
+struct xb_decoder {
+	enum xb_decoder_state state;
+	int escaped, escape_next;
+	uint16_t pos;
+	uint8_t csum;
+	struct xb_frame frame;
+	/* whose decoder this is, in the trace */
+	uint16_t trace_id;
+
+	/* only the decoding thread writes these; anyone may read them */
+	atomic_ulong escapes, csum_errors, resyncs, discarded;
+};
+
+void xb_decoder_init(struct xb_decoder *, int);
+size_t xb_decoder_feed(struct xb_decoder *, const uint8_t *, size_t, int *);
+
+int xb_frame_id(const struct xb_frame *);
+int xb_frame_rx(const struct xb_frame *, struct xb_rx *);
+struct buffer *xb_frame_escape(struct buffer *);
+
+uint64_t xb_get_be(const uint8_t *, int);
+void xb_put_be(uint8_t *, uint64_t, int);
+uint64_t xb_get_le(const uint8_t *, int);
+void xb_put_le(uint8_t *, uint64_t, int);
+
+#endif
@@ -0,0 +1,552 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_io.h"
+#include "xb_tx.h"
+
+/* column widths, in block order */
+static const unsigned int xb_io_widths[XB_IO_COLUMNS] = {
+	8, 8, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+};
+
+#define XB_IO_ALIGN(n)				(((n) + 7) & ~(size_t)7)
+
+uint64_t
+xb_wall_time_us(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+/*
+ * one set of readings: digital levels if any line is enabled, then each
+ * enabled analog channel in bit order
+ */
+static int
+xb_io_parse_one(const uint8_t *p, const uint8_t *end, struct xb_io_sample *s) {
+	const uint8_t *start = p;
+	int i;
+
+	if (s->dmask) {
+		if (end - p < 2) {
+			return -1;
+		}
+		s->digital = (uint16_t)xb_get_be(p, 2);
+		p += 2;
+	}
+	for(i = 0; i < XB_IO_ANALOG_MAX; i++) {
+		if (!(s->amask & (1 << i))) {
+			continue;
+		}
+		if (end - p < 2) {
+			return -1;
+		}
+		s->analog[i] = (uint16_t)xb_get_be(p, 2);
+		p += 2;
+	}
+
+	return (int)(p - start);
+}
+
+/*
+ * unpack an IO sample frame (ZigBee 0x92, 802.15.4 0x82/0x83) into up to
+ * max samples; returns how many, -1 if this is not one or is short
+ */
+int
+xb_io_parse(const struct xb_frame *frame, struct xb_io_sample *samples, int max) {
+	const uint8_t *d = frame->data, *p, *end = frame->data + frame->len;
+	struct xb_io_sample tmpl;
+	uint16_t mask;
+	int i, n, ret;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+
+	switch (d[0]) {
+	case XB_FRAME_TYPE_IO_SAMPLE:
+		/* source 64, source 16, options, count (always 1), masks */
+		if (frame->len < 16) {
+			return -1;
+		}
+		tmpl.src64 = xb_get_be(d + 1, 8);
+		tmpl.src16 = (uint16_t)xb_get_be(d + 9, 2);
+		n = 1;
+		tmpl.dmask = (uint16_t)xb_get_be(d + 13, 2);
+		tmpl.amask = d[15];
+		p = d + 16;
+		break;
+	case XB_FRAME_TYPE_RX64_IO:
+	case XB_FRAME_TYPE_RX16_IO:
+		/* source, RSSI, options, count, then A5-A0 and D8-D0 in one mask */
+		p = d + (d[0] == XB_FRAME_TYPE_RX64_IO ? 9 : 3) + 2;
+		if (p + 3 > end) {
+			return -1;
+		}
+		if (d[0] == XB_FRAME_TYPE_RX64_IO) {
+			tmpl.src64 = xb_get_be(d + 1, 8);
+			tmpl.src16 = XB_ADDR16_UNKNOWN;
+		}
+		else {
+			tmpl.src64 = XB_ADDR64_UNKNOWN;
+			tmpl.src16 = (uint16_t)xb_get_be(d + 1, 2);
+		}
+		n = p[0];
+		mask = (uint16_t)xb_get_be(p + 1, 2);
+		tmpl.dmask = mask & 0x1ff;
+		tmpl.amask = (uint8_t)((mask >> 9) & 0x3f);
+		p += 3;
+		break;
+	default:
+		return -1;
+	}
+
+	for(i = 0; i < n && i < max; i++) {
+		samples[i] = tmpl;
+		if ( (ret = xb_io_parse_one(p, end, &samples[i])) < 0) {
+			return i ? i : -1;
+		}
+		p += ret;
+	}
+
+	return i;
+}
+
+static int
+xb_io_log_alloc(struct xb_io_log *log) {
+	uint8_t *mem;
+	size_t size = 0;
+	int i;
+
+	for(i = 0; i < XB_IO_COLUMNS; i++) {
+		size += XB_IO_ALIGN((size_t)log->block_rows * xb_io_widths[i]);
+	}
+	if ( (mem = (uint8_t *)malloc(size)) == NULL) {
+		return -1;
+	}
+
+	log->time = (uint64_t *)mem;
+	mem += XB_IO_ALIGN((size_t)log->block_rows * 8);
+	log->src64 = (uint64_t *)mem;
+	mem += XB_IO_ALIGN((size_t)log->block_rows * 8);
+	log->src16 = (uint16_t *)mem;
+	mem += XB_IO_ALIGN((size_t)log->block_rows * 2);
+	log->dmask = (uint16_t *)mem;
+	mem += XB_IO_ALIGN((size_t)log->block_rows * 2);
+	log->digital = (uint16_t *)mem;
+	mem += XB_IO_ALIGN((size_t)log->block_rows * 2);
+	log->amask = mem;
+	mem += XB_IO_ALIGN((size_t)log->block_rows);
+	for(i = 0; i < XB_IO_ANALOG_MAX; i++) {
+		log->analog[i] = (uint16_t *)mem;
+		mem += XB_IO_ALIGN((size_t)log->block_rows * 2);
+	}
+
+	return 0;
+}
+
+/*
+ * open a log for appending, creating it (and its index) if need be; an
+ * existing log keeps its own block size.  EINVAL for a block size that
+ * is 0 or over XB_IO_BLOCK_ROWS_MAX.
+ */
+struct xb_io_log *
+xb_io_log_open(const char *path, unsigned int block_rows) {
+	struct xb_io_log *log;
+	uint8_t hdr[XB_IO_HDRLEN];
+	char *idxpath;
+	struct stat st;
+
+	if ( (log = (struct xb_io_log *)calloc(1, sizeof(struct xb_io_log))) == NULL) {
+		return NULL;
+	}
+	log->fd = log->idxfd = -1;
+	log->block_rows = block_rows ? block_rows : XB_IO_BLOCK_ROWS;
+	if (log->block_rows > XB_IO_BLOCK_ROWS_MAX) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	if ( (log->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(log->fd, &st) < 0) {
+		goto error;
+	}
+	if (st.st_size >= XB_IO_HDRLEN) {
+		if (pread(log->fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+				memcmp(hdr, XB_IO_MAGIC, 4) || xb_get_le(hdr + 4, 4) != XB_IO_VERSION) {
+			errno = EINVAL;
+			goto error;
+		}
+		log->block_rows = (unsigned int)xb_get_le(hdr + 8, 4);
+		if (!log->block_rows || log->block_rows > XB_IO_BLOCK_ROWS_MAX) {
+			errno = EINVAL;
+			goto error;
+		}
+		log->offset = st.st_size;
+	}
+	else {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, XB_IO_MAGIC, 4);
+		xb_put_le(hdr + 4, XB_IO_VERSION, 4);
+		xb_put_le(hdr + 8, log->block_rows, 4);
+		if (ftruncate(log->fd, 0) < 0 || xb_write_fully(log->fd, hdr, sizeof(hdr)) < 0) {
+			goto error;
+		}
+		log->offset = XB_IO_HDRLEN;
+	}
+
+	if ( (idxpath = (char *)malloc(strlen(path) + 5)) == NULL) {
+		goto error;
+	}
+	sprintf(idxpath, "%s.idx", path);
+	log->idxfd = open(idxpath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	free(idxpath);
+	if (log->idxfd < 0 || fstat(log->idxfd, &st) < 0) {
+		goto error;
+	}
+	if (st.st_size < XB_IO_HDRLEN) {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, XB_IO_INDEX_MAGIC, 4);
+		xb_put_le(hdr + 4, XB_IO_VERSION, 4);
+		if (ftruncate(log->idxfd, 0) < 0 || xb_write_fully(log->idxfd, hdr, sizeof(hdr)) < 0) {
+			goto error;
+		}
+	}
+
+	if (xb_io_log_alloc(log) < 0) {
+		goto error;
+	}
+
+	return log;
+
+error:
+	if (log->fd >= 0) {
+		close(log->fd);
+	}
+	if (log->idxfd >= 0) {
+		close(log->idxfd);
+	}
+	free(log);
+	return NULL;
+}
+
+int
+xb_io_log_add(struct xb_io_log *log, uint64_t time_us, const struct xb_io_sample *s) {
+	unsigned int r = log->rows;
+	int i;
+
+	if (!r || time_us < log->t_min) {
+		log->t_min = time_us;
+	}
+	if (!r || time_us > log->t_max) {
+		log->t_max = time_us;
+	}
+
+	log->time[r] = time_us;
+	log->src64[r] = s->src64;
+	log->src16[r] = s->src16;
+	log->dmask[r] = s->dmask;
+	log->digital[r] = s->digital;
+	log->amask[r] = s->amask;
+	for(i = 0; i < XB_IO_ANALOG_MAX; i++) {
+		log->analog[i][r] = (s->amask & (1 << i)) ? s->analog[i] : 0;
+	}
+
+	if (++log->rows == log->block_rows) {
+		return xb_io_log_flush(log);
+	}
+
+	return 0;
+}
+
+/*
+ * log every sample in an IO frame, stamped now; returns how many
+ */
+int
+xb_io_log_frame(struct xb_io_log *log, const struct xb_frame *frame) {
+	struct xb_io_sample samples[XB_IO_SAMPLES_MAX];
+	uint64_t now;
+	int i, n;
+
+	if ( (n = xb_io_parse(frame, samples, XB_IO_SAMPLES_MAX)) <= 0) {
+		return n;
+	}
+
+	now = xb_wall_time_us();
+	for(i = 0; i < n; i++) {
+		if (xb_io_log_add(log, now, &samples[i]) < 0) {
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+static size_t
+xb_io_block_size(unsigned int rows) {
+	size_t size = XB_IO_BLOCK_HDRLEN;
+	int i;
+
+	for(i = 0; i < XB_IO_COLUMNS; i++) {
+		size += XB_IO_ALIGN((size_t)rows * xb_io_widths[i]);
+	}
+
+	return size;
+}
+
+/*
+ * append the rows collected so far as a block, then index it
+ */
+int
+xb_io_log_flush(struct xb_io_log *log) {
+	uint8_t ent[XB_IO_INDEX_ENTLEN], *blk, *p;
+	unsigned int r, rows = log->rows;
+	size_t size;
+	int i, ret;
+
+	if (!rows) {
+		return 0;
+	}
+
+	size = xb_io_block_size(rows);
+	if ( (blk = (uint8_t *)calloc(1, size)) == NULL) {
+		return -1;
+	}
+
+	memcpy(blk, XB_IO_BLOCK_MAGIC, 4);
+	xb_put_le(blk + 4, rows, 4);
+	xb_put_le(blk + 8, log->t_min, 8);
+	xb_put_le(blk + 16, log->t_max, 8);
+
+	p = blk + XB_IO_BLOCK_HDRLEN;
+	for(r = 0; r < rows; r++) {
+		xb_put_le(p + r * 8, log->time[r], 8);
+	}
+	p += XB_IO_ALIGN((size_t)rows * 8);
+	for(r = 0; r < rows; r++) {
+		xb_put_le(p + r * 8, log->src64[r], 8);
+	}
+	p += XB_IO_ALIGN((size_t)rows * 8);
+	for(r = 0; r < rows; r++) {
+		xb_put_le(p + r * 2, log->src16[r], 2);
+	}
+	p += XB_IO_ALIGN((size_t)rows * 2);
+	for(r = 0; r < rows; r++) {
+		xb_put_le(p + r * 2, log->dmask[r], 2);
+	}
+	p += XB_IO_ALIGN((size_t)rows * 2);
+	for(r = 0; r < rows; r++) {
+		xb_put_le(p + r * 2, log->digital[r], 2);
+	}
+	p += XB_IO_ALIGN((size_t)rows * 2);
+	memcpy(p, log->amask, rows);
+	p += XB_IO_ALIGN((size_t)rows);
+	for(i = 0; i < XB_IO_ANALOG_MAX; i++) {
+		for(r = 0; r < rows; r++) {
+			xb_put_le(p + r * 2, log->analog[i][r], 2);
+		}
+		p += XB_IO_ALIGN((size_t)rows * 2);
+	}
+
+	/* the block is in place before the index points at it */
+	ret = (pwrite(log->fd, blk, size, log->offset) == (ssize_t)size) ? 0 : -1;
+	free(blk);
+	if (ret < 0) {
+		return -1;
+	}
+
+	memset(ent, 0, sizeof(ent));
+	xb_put_le(ent, log->t_min, 8);
+	xb_put_le(ent + 8, log->t_max, 8);
+	xb_put_le(ent + 16, (uint64_t)log->offset, 8);
+	xb_put_le(ent + 24, rows, 4);
+	if (xb_write_fully(log->idxfd, ent, sizeof(ent)) < 0) {
+		return -1;
+	}
+
+	log->offset += (off_t)size;
+	log->rows = 0;
+
+	return 0;
+}
+
+int
+xb_io_log_close(struct xb_io_log *log) {
+	int ret;
+
+	ret = xb_io_log_flush(log);
+	close(log->fd);
+	close(log->idxfd);
+	free(log->time);
+	free(log);
+
+	return ret;
+}
+
+static const uint8_t *
+xb_io_map(const char *path, size_t *size) {
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < XB_IO_HDRLEN) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+
+	return (const uint8_t *)p;
+}
+
+struct xb_io_file *
+xb_io_file_open(const char *path) {
+	struct xb_io_file *f;
+	char *idxpath;
+
+	if ( (f = (struct xb_io_file *)calloc(1, sizeof(struct xb_io_file))) == NULL) {
+		return NULL;
+	}
+	if ( (idxpath = (char *)malloc(strlen(path) + 5)) == NULL) {
+		free(f);
+		return NULL;
+	}
+	sprintf(idxpath, "%s.idx", path);
+
+	f->data = xb_io_map(path, &f->size);
+	f->idx = xb_io_map(idxpath, &f->idxsize);
+	free(idxpath);
+
+	if (!f->data || !f->idx || memcmp(f->data, XB_IO_MAGIC, 4) ||
+			xb_get_le(f->data + 4, 4) != XB_IO_VERSION ||
+			memcmp(f->idx, XB_IO_INDEX_MAGIC, 4)) {
+		xb_io_file_close(f);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return f;
+}
+
+void
+xb_io_file_close(struct xb_io_file *f) {
+	if (f->data) {
+		munmap((void *)f->data, f->size);
+	}
+	if (f->idx) {
+		munmap((void *)f->idx, f->idxsize);
+	}
+	free(f);
+}
+
+/*
+ * hand every sample stamped within [from, to] to cb, block by block in
+ * the order logged; cb returning nonzero stops the scan.  Returns the
+ * number of samples handed over, -1 if the log is damaged.
+ */
+/*
+ * value r of a column; the columns are aligned little-endian arrays, so
+ * a little-endian host reads them straight from the mapping
+ */
+static uint64_t
+xb_io_col(const uint8_t *col, unsigned int r, unsigned int width) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	switch (width) {
+	case 8:
+		return ((const uint64_t *)col)[r];
+	case 2:
+		return ((const uint16_t *)col)[r];
+	}
+	return col[r];
+#else
+	return xb_get_le(col + (size_t)r * width, (int)width);
+#endif
+}
+
+long
+xb_io_scan(struct xb_io_file *f, uint64_t from, uint64_t to, xb_io_scan_cb cb, void *arg) {
+	const uint8_t *ent, *blk, *col[XB_IO_COLUMNS];
+	struct xb_io_sample s;
+	uint64_t t, offset;
+	unsigned int r, rows;
+	long n = 0;
+	int i;
+
+	for(ent = f->idx + XB_IO_HDRLEN; ent + XB_IO_INDEX_ENTLEN <= f->idx + f->idxsize;
+			ent += XB_IO_INDEX_ENTLEN) {
+		if (xb_get_le(ent + 8, 8) < from || xb_get_le(ent, 8) > to) {
+			continue;
+		}
+
+		offset = xb_get_le(ent + 16, 8);
+		rows = (unsigned int)xb_get_le(ent + 24, 4);
+		if (offset % 8 || offset + xb_io_block_size(rows) > f->size) {
+			return -1;
+		}
+		blk = f->data + offset;
+		if (memcmp(blk, XB_IO_BLOCK_MAGIC, 4) || xb_get_le(blk + 4, 4) != rows) {
+			return -1;
+		}
+
+		col[0] = blk + XB_IO_BLOCK_HDRLEN;
+		for(i = 1; i < XB_IO_COLUMNS; i++) {
+			col[i] = col[i - 1] + XB_IO_ALIGN((size_t)rows * xb_io_widths[i - 1]);
+		}
+
+		for(r = 0; r < rows; r++) {
+			t = xb_io_col(col[0], r, 8);
+			if (t < from || t > to) {
+				continue;
+			}
+
+			s.src64 = xb_io_col(col[1], r, 8);
+			s.src16 = (uint16_t)xb_io_col(col[2], r, 2);
+			s.dmask = (uint16_t)xb_io_col(col[3], r, 2);
+			s.digital = (uint16_t)xb_io_col(col[4], r, 2);
+			s.amask = col[5][r];
+			for(i = 0; i < XB_IO_ANALOG_MAX; i++) {
+				s.analog[i] = (uint16_t)xb_io_col(col[6 + i], r, 2);
+			}
+
+			n++;
+			if (cb(t, &s, arg)) {
+				return n;
+			}
+		}
+	}
+
+	return n;
+}
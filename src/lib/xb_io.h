@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_IO_H
+#define XB_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xb_frame.h"
+
+/* analog channels: AD0-AD3 and supply voltage (bit 7) on ZigBee, A0-A5 on 802.15.4 */
+#define XB_IO_ANALOG_MAX			8
+#define XB_IO_SUPPLY_VOLTAGE			7
+/* 802.15.4 frames can carry several samples */
+#define XB_IO_SAMPLES_MAX			64
+
+struct xb_io_sample {
+	uint64_t src64;
+	uint16_t src16;
+	/* which digital lines are enabled, and their levels */
+	uint16_t dmask, digital;
+	/* which analog channels are enabled, and their readings */
+	uint8_t amask;
+	uint16_t analog[XB_IO_ANALOG_MAX];
+};
+
+int xb_io_parse(const struct xb_frame *, struct xb_io_sample *, int);
+
+/*
+ * Samples are logged column by column.  The log file is a header and a
+ * run of blocks appended one after the other; each block holds up to
+ * block_rows samples as one column per field.  Every column is 8-byte
+ * aligned and all integers are little endian, so on a little-endian
+ * host a mapped file's columns are plain arrays.  A separate index file
+ * (path + ".idx") has an entry for each block with its time range and
+ * offset, so a range scan only touches the blocks it needs.
+ *
+ *   file:   "XBIO" version block_rows reserved	(16 bytes)
+ *   block:  "XBIB" rows t_min t_max reserved	(32 bytes)
+ *           time[rows] (8)  src64[rows] (8)  src16[rows] (2)
+ *           dmask[rows] (2) digital[rows] (2) amask[rows] (1)
+ *           analog0[rows] (2) ... analog7[rows] (2)
+ *   index:  "XBII" version reserved		(16 bytes)
+ *           t_min t_max offset rows reserved	(32 bytes each)
+ *
+ * Times are the host's wall clock in microseconds.
+ */
+#define XB_IO_MAGIC				"XBIO"
+#define XB_IO_BLOCK_MAGIC			"XBIB"
+#define XB_IO_INDEX_MAGIC			"XBII"
+#define XB_IO_VERSION				2
+#define XB_IO_HDRLEN				16
+#define XB_IO_BLOCK_HDRLEN			32
+#define XB_IO_INDEX_ENTLEN			32
+#define XB_IO_BLOCK_ROWS			4096
+#define XB_IO_BLOCK_ROWS_MAX			(1 << 20)
+#define XB_IO_COLUMNS				(6 + XB_IO_ANALOG_MAX)
+
+struct xb_io_log {
+	int fd, idxfd;
+	unsigned int block_rows, rows;
+	off_t offset;
+	uint64_t t_min, t_max;
+
+	/* the block being filled */
+	uint64_t *time, *src64;
+	uint16_t *src16, *dmask, *digital;
+	uint8_t *amask;
+	uint16_t *analog[XB_IO_ANALOG_MAX];
+};
+
+struct xb_io_log *xb_io_log_open(const char *, unsigned int);
+int xb_io_log_add(struct xb_io_log *, uint64_t, const struct xb_io_sample *);
+int xb_io_log_frame(struct xb_io_log *, const struct xb_frame *);
+int xb_io_log_flush(struct xb_io_log *);
+int xb_io_log_close(struct xb_io_log *);
+
+/* a log mapped for reading */
+struct xb_io_file {
+	const uint8_t *data, *idx;
+	size_t size, idxsize;
+};
+
+typedef int (*xb_io_scan_cb)(uint64_t, const struct xb_io_sample *, void *);
+
+struct xb_io_file *xb_io_file_open(const char *);
+void xb_io_file_close(struct xb_io_file *);
+long xb_io_scan(struct xb_io_file *, uint64_t, uint64_t, xb_io_scan_cb, void *);
+
+uint64_t xb_wall_time_us(void);
+
+#endif
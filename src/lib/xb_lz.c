@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_lz.h"
+
+/*
+ * FNV-1a, so both ends can tell they hold the same dictionary
+ */
+uint32_t
+xb_lz_dict_id(const uint8_t *dict, size_t len) {
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h = (h ^ *dict++) * 16777619u;
+	}
+
+	return h;
+}
+
+static uint32_t
+xb_lz_hash(const uint8_t *p) {
+	uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+
+	return (v * 2654435761u) >> (32 - XB_LZ_HASH_BITS);
+}
+
+static int
+xb_lz_literals(const uint8_t *src, size_t n, uint8_t *out, size_t *op, size_t outmax) {
+	size_t run;
+
+	while (n > 0) {
+		run = n > XB_LZ_MAX_LITERALS ? XB_LZ_MAX_LITERALS : n;
+		if (*op + 1 + run > outmax) {
+			return -1;
+		}
+		out[(*op)++] = (uint8_t)(run - 1);
+		memcpy(out + *op, src, run);
+		*op += run;
+		src += run;
+		n -= run;
+	}
+
+	return 0;
+}
+
+/*
+ * compress in against dict; returns the compressed length, or 0 if it
+ * does not fit in outmax bytes
+ */
+size_t
+xb_lz_compress(const uint8_t *dict, size_t dlen, const uint8_t *in, size_t inlen,
+		uint8_t *out, size_t outmax) {
+	int32_t table[1 << XB_LZ_HASH_BITS];
+	uint8_t *buf;
+	size_t pos, end, lit, len, dist, op = 0, k;
+	uint32_t h;
+	int32_t cand;
+
+	if (dlen > XB_LZ_DICT_MAX) {
+		dict += dlen - XB_LZ_DICT_MAX;
+		dlen = XB_LZ_DICT_MAX;
+	}
+
+	/* matches are searched for in the dictionary followed by the input */
+	if ( (buf = (uint8_t *)malloc(dlen + inlen + 1)) == NULL) {
+		return 0;
+	}
+	memcpy(buf, dict, dlen);
+	memcpy(buf + dlen, in, inlen);
+
+	memset(table, 0xff, sizeof(table));
+	for(pos = 0; pos + XB_LZ_MIN_MATCH <= dlen; pos++) {
+		table[xb_lz_hash(buf + pos)] = (int32_t)pos;
+	}
+
+	end = dlen + inlen;
+	for(pos = lit = dlen; pos + XB_LZ_MIN_MATCH <= end; ) {
+		h = xb_lz_hash(buf + pos);
+		cand = table[h];
+		table[h] = (int32_t)pos;
+
+		if (cand < 0 || pos - (size_t)cand > XB_LZ_MAX_DIST ||
+				memcmp(buf + cand, buf + pos, XB_LZ_MIN_MATCH)) {
+			pos++;
+			continue;
+		}
+
+		for(len = XB_LZ_MIN_MATCH; pos + len < end && len < XB_LZ_MAX_MATCH &&
+				buf[cand + len] == buf[pos + len]; len++)
+			;
+		dist = pos - (size_t)cand;
+
+		if (xb_lz_literals(buf + lit, pos - lit, out, &op, outmax) < 0 ||
+				op + 3 > outmax) {
+			op = 0;
+			goto out;
+		}
+		out[op++] = (uint8_t)(0x80 | (len - XB_LZ_MIN_MATCH));
+		out[op++] = (uint8_t)(dist >> 8);
+		out[op++] = (uint8_t)dist;
+
+		for(k = 1; k < len && pos + k + XB_LZ_MIN_MATCH <= end; k++) {
+			table[xb_lz_hash(buf + pos + k)] = (int32_t)(pos + k);
+		}
+		pos += len;
+		lit = pos;
+	}
+
+	if (xb_lz_literals(buf + lit, end - lit, out, &op, outmax) < 0) {
+		op = 0;
+	}
+
+out:
+	free(buf);
+	return op;
+}
+
+/*
+ * returns the decompressed length, -1 on corrupt input or if it does not
+ * fit in outmax bytes
+ */
+int
+xb_lz_decompress(const uint8_t *dict, size_t dlen, const uint8_t *in, size_t inlen,
+		uint8_t *out, size_t outmax) {
+	uint8_t *buf, c;
+	size_t ip = 0, op, len, dist, end;
+	int ret = -1;
+
+	if (dlen > XB_LZ_DICT_MAX) {
+		dict += dlen - XB_LZ_DICT_MAX;
+		dlen = XB_LZ_DICT_MAX;
+	}
+
+	if ( (buf = (uint8_t *)malloc(dlen + outmax + 1)) == NULL) {
+		return -1;
+	}
+	memcpy(buf, dict, dlen);
+	op = dlen;
+	end = dlen + outmax;
+
+	while (ip < inlen) {
+		c = in[ip++];
+		if (c < 0x80) {
+			len = (size_t)c + 1;
+			if (ip + len > inlen || op + len > end) {
+				goto out;
+			}
+			memcpy(buf + op, in + ip, len);
+			ip += len;
+			op += len;
+			continue;
+		}
+
+		len = (size_t)(c & 0x7f) + XB_LZ_MIN_MATCH;
+		if (ip + 2 > inlen) {
+			goto out;
+		}
+		dist = ((size_t)in[ip] << 8) | in[ip + 1];
+		ip += 2;
+		if (!dist || dist > op || op + len > end) {
+			goto out;
+		}
+		/* may overlap itself, so byte by byte */
+		for(; len > 0; len--, op++) {
+			buf[op] = buf[op - dist];
+		}
+	}
+
+	memcpy(out, buf + dlen, op - dlen);
+	ret = (int)(op - dlen);
+
+out:
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_LZ_H
+#define XB_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * byte oriented LZ77: a control byte below 0x80 is followed by that many
+ * plus one literals; from 0x80 up it is a match of (c & 0x7f) + 3 bytes
+ * at the big-endian 16-bit distance that follows.  Distances may reach
+ * back into a dictionary both ends share.
+ */
+#define XB_LZ_MIN_MATCH				3
+#define XB_LZ_MAX_MATCH				(0x7f + XB_LZ_MIN_MATCH)
+#define XB_LZ_MAX_LITERALS			0x80
+#define XB_LZ_MAX_DIST				0xffff
+#define XB_LZ_HASH_BITS				12
+#define XB_LZ_DICT_MAX				4096
+
+uint32_t xb_lz_dict_id(const uint8_t *, size_t);
+size_t xb_lz_compress(const uint8_t *, size_t, const uint8_t *, size_t,
+		uint8_t *, size_t);
+int xb_lz_decompress(const uint8_t *, size_t, const uint8_t *, size_t,
+		uint8_t *, size_t);
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "xb_ctx.h"
+#include "xb_mgr.h"
+
+struct xb_mgr *
+xb_mgr_new(void) {
+	return (struct xb_mgr *)calloc(1, sizeof(struct xb_mgr));
+}
+
+/*
+ * stops any threads and closes every context added
+ */
+void
+xb_mgr_free(struct xb_mgr *mgr) {
+	int i;
+
+	xb_mgr_stop(mgr);
+
+	for(i = 0; i < mgr->nports; i++) {
+		xb_close(mgr->ports[i].xctx);
+	}
+	free(mgr->ports);
+	free(mgr);
+}
+
+/*
+ * take over xctx, handing its frames to handler; returns the port
+ * number for xb_mgr_stats().  Ports are added before running.
+ */
+int
+xb_mgr_add(struct xb_mgr *mgr, struct xb_ctx *xctx, xb_frame_handler handler, void *arg) {
+	struct xb_port *ports, *port;
+	int size;
+
+	if (mgr->shards) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (mgr->nports == mgr->size) {
+		size = mgr->size ? mgr->size * 2 : 8;
+		if ( (ports = (struct xb_port *)realloc(mgr->ports, size * sizeof(struct xb_port))) == NULL) {
+			return -1;
+		}
+		mgr->ports = ports;
+		mgr->size = size;
+	}
+
+	port = &mgr->ports[mgr->nports];
+	port->xctx = xctx;
+	atomic_init(&port->up, 1);
+	atomic_init(&port->bytes_in, 0);
+	atomic_init(&port->frames_in, 0);
+	atomic_init(&port->errors, 0);
+	atomic_init(&port->wakeups, 0);
+	atomic_init(&port->last_rx, 0);
+
+	xb_set_frame_handler(xctx, handler, arg);
+
+	return mgr->nports++;
+}
+
+/*
+ * read and dispatch whatever a port has; a port that fails is taken out
+ * of service
+ */
+static int
+xb_mgr_service(struct xb_port *port) {
+	struct xb_frame frame;
+	int n = 0, ret;
+
+	atomic_fetch_add_explicit(&port->wakeups, 1, memory_order_relaxed);
+
+	if ( (ret = xb_fill(port->xctx, 0)) < 0) {
+		atomic_fetch_add_explicit(&port->errors, 1, memory_order_relaxed);
+		atomic_store(&port->up, 0);
+		return -1;
+	}
+	atomic_fetch_add_explicit(&port->bytes_in, (unsigned long)ret, memory_order_relaxed);
+
+	while (xb_read_frame(port->xctx, &frame, 0) > 0) {
+		xb_dispatch_frame(port->xctx, &frame);
+		n++;
+	}
+	if (n) {
+		atomic_fetch_add_explicit(&port->frames_in, (unsigned long)n, memory_order_relaxed);
+		atomic_store_explicit(&port->last_rx, xb_time_us(), memory_order_relaxed);
+	}
+
+	return n;
+}
+
+/*
+ * a port's context has work queued from another thread
+ */
+static void
+xb_mgr_wake(struct xb_ctx *xctx, void *arg) {
+	struct xb_mgr_shard *sh = (struct xb_mgr_shard *)arg;
+	char c = 0;
+
+	if (write(sh->wake[1], &c, 1) < 0) {
+		/* full: the shard is already due to wake */
+	}
+}
+
+/*
+ * empty the wake pipe; -1 if the shard is to stop
+ */
+static int
+xb_mgr_woken(struct xb_mgr_shard *sh) {
+	char junk[64];
+
+	while (read(sh->wake[0], junk, sizeof(junk)) > 0)
+		;
+
+	return atomic_load(&sh->stop) ? -1 : 0;
+}
+
+static void
+xb_mgr_shard_close(struct xb_mgr_shard *sh) {
+	if (sh->epfd >= 0) {
+		close(sh->epfd);
+	}
+	close(sh->wake[0]);
+	close(sh->wake[1]);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int
+xb_mgr_shard_open(struct xb_mgr *mgr, struct xb_mgr_shard *sh) {
+	struct epoll_event ev;
+	int i;
+
+	if ( (sh->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->wake[0], &ev) < 0) {
+		return -1;
+	}
+	for(i = sh->index; i < mgr->nports; i += mgr->nshards) {
+		ev.data.ptr = &mgr->ports[i];
+		if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, mgr->ports[i].xctx->xbfd, &ev) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+xb_mgr_shard_poll(struct xb_mgr *mgr, struct xb_mgr_shard *sh, int timeout) {
+	struct epoll_event evs[XB_MGR_EVENTS];
+	struct xb_port *port;
+	int i, n, ret, frames = 0;
+
+	if ( (n = epoll_wait(sh->epfd, evs, XB_MGR_EVENTS, timeout)) < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for(i = 0; i < n; i++) {
+		if ( (port = (struct xb_port *)evs[i].data.ptr) == NULL) {
+			if (xb_mgr_woken(sh) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		if ( (ret = xb_mgr_service(port)) < 0) {
+			epoll_ctl(sh->epfd, EPOLL_CTL_DEL, port->xctx->xbfd, NULL);
+			continue;
+		}
+		frames += ret;
+	}
+
+	return frames;
+}
+#else
+static int
+xb_mgr_shard_open(struct xb_mgr *mgr, struct xb_mgr_shard *sh) {
+	return 0;
+}
+
+static int
+xb_mgr_shard_poll(struct xb_mgr *mgr, struct xb_mgr_shard *sh, int timeout) {
+	struct pollfd *pfds;
+	struct xb_port **map;
+	int i, n, ret, frames = 0;
+
+	n = 1 + (mgr->nports + mgr->nshards - 1) / mgr->nshards;
+	pfds = (struct pollfd *)calloc(n, sizeof(struct pollfd));
+	map = (struct xb_port **)calloc(n, sizeof(struct xb_port *));
+	if (!pfds || !map) {
+		frames = -1;
+		goto out;
+	}
+
+	pfds[0].fd = sh->wake[0];
+	pfds[0].events = POLLIN;
+	for(n = 1, i = sh->index; i < mgr->nports; i += mgr->nshards) {
+		if (atomic_load(&mgr->ports[i].up)) {
+			pfds[n].fd = mgr->ports[i].xctx->xbfd;
+			pfds[n].events = POLLIN;
+			map[n++] = &mgr->ports[i];
+		}
+	}
+
+	if ( (ret = poll(pfds, n, timeout)) < 0) {
+		frames = errno == EINTR ? 0 : -1;
+		goto out;
+	}
+	if (pfds[0].revents && xb_mgr_woken(sh) < 0) {
+		frames = -1;
+		goto out;
+	}
+
+	for(i = 1; i < n; i++) {
+		if (pfds[i].revents && (ret = xb_mgr_service(map[i])) > 0) {
+			frames += ret;
+		}
+	}
+
+out:
+	free(pfds);
+	free(map);
+	return frames;
+}
+#endif
+
+/*
+ * wait up to timeout ms for this shard's ports, waking early for their
+ * timers (xb_next_timer) or work queued by other threads; returns frames
+ * dispatched, or -1 once asked to stop
+ */
+static int
+xb_mgr_shard_wait(struct xb_mgr *mgr, struct xb_mgr_shard *sh, int timeout) {
+	struct xb_port *port;
+	uint64_t due, next = 0;
+	int i, ret;
+
+	for(i = sh->index; i < mgr->nports; i += mgr->nshards) {
+		port = &mgr->ports[i];
+		if (atomic_load(&port->up) && (due = xb_next_timer(port->xctx)) != 0 &&
+				(!next || due < next)) {
+			next = due;
+		}
+	}
+
+	if ( (ret = xb_mgr_shard_poll(mgr, sh, xb_timeout_until(timeout, next))) < 0) {
+		return -1;
+	}
+
+	for(i = sh->index; i < mgr->nports; i += mgr->nshards) {
+		port = &mgr->ports[i];
+		if (!atomic_load(&port->up)) {
+			continue;
+		}
+		if (xb_run_timers(port->xctx) < 0) {
+			atomic_fetch_add_explicit(&port->errors, 1, memory_order_relaxed);
+			atomic_store(&port->up, 0);
+		}
+	}
+
+	return ret;
+}
+
+static void
+xb_mgr_teardown(struct xb_mgr *mgr) {
+	int i;
+
+	for(i = 0; i < mgr->nports; i++) {
+		xb_set_wake(mgr->ports[i].xctx, NULL, NULL);
+	}
+	for(i = 0; i < mgr->nshards; i++) {
+		xb_mgr_shard_close(&mgr->shards[i]);
+	}
+	free(mgr->shards);
+	mgr->shards = NULL;
+	mgr->nshards = 0;
+}
+
+/*
+ * share the ports out round-robin between n shards
+ */
+static int
+xb_mgr_setup(struct xb_mgr *mgr, int n) {
+	struct xb_mgr_shard *sh;
+	int i;
+
+	if ( (mgr->shards = (struct xb_mgr_shard *)calloc(n, sizeof(struct xb_mgr_shard))) == NULL) {
+		return -1;
+	}
+	mgr->nshards = n;
+
+	for(i = 0; i < n; i++) {
+		sh = &mgr->shards[i];
+		sh->mgr = mgr;
+		sh->index = i;
+		sh->epfd = -1;
+		sh->wake[0] = sh->wake[1] = -1;
+		atomic_init(&sh->stop, 0);
+		if (pipe(sh->wake) < 0 ||
+				fcntl(sh->wake[0], F_SETFL, O_NONBLOCK) < 0 ||
+				fcntl(sh->wake[1], F_SETFL, O_NONBLOCK) < 0 ||
+				xb_mgr_shard_open(mgr, sh) < 0) {
+			xb_mgr_teardown(mgr);
+			return -1;
+		}
+	}
+	for(i = 0; i < mgr->nports; i++) {
+		xb_set_wake(mgr->ports[i].xctx, xb_mgr_wake, &mgr->shards[i % n]);
+	}
+
+	return 0;
+}
+
+/*
+ * serve every port from the calling thread for up to timeout ms (-1
+ * waits for the first events); returns the number of frames dispatched
+ */
+int
+xb_mgr_run(struct xb_mgr *mgr, int timeout) {
+	uint64_t deadline;
+	int ret, wait, frames = 0;
+
+	if (mgr->running) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!mgr->shards && xb_mgr_setup(mgr, 1) < 0) {
+		return -1;
+	}
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	do {
+		wait = xb_remaining(timeout, deadline);
+		if ( (ret = xb_mgr_shard_wait(mgr, &mgr->shards[0], wait)) < 0) {
+			return -1;
+		}
+		frames += ret;
+	} while (!frames && wait);
+
+	return frames;
+}
+
+static void *
+xb_mgr_main(void *arg) {
+	struct xb_mgr_shard *sh = (struct xb_mgr_shard *)arg;
+
+	while (xb_mgr_shard_wait(sh->mgr, sh, -1) >= 0)
+		;
+
+	return NULL;
+}
+
+/*
+ * serve the ports from nthreads threads (0: one per CPU) until
+ * xb_mgr_stop()
+ */
+int
+xb_mgr_start(struct xb_mgr *mgr, int nthreads) {
+	int i, ret;
+
+	if (mgr->running) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (nthreads <= 0) {
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads > mgr->nports) {
+		nthreads = mgr->nports;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	if (mgr->shards) {
+		xb_mgr_teardown(mgr);
+	}
+	if (xb_mgr_setup(mgr, nthreads) < 0) {
+		return -1;
+	}
+
+	for(i = 0; i < nthreads; i++) {
+		if ( (ret = pthread_create(&mgr->shards[i].thread, NULL, xb_mgr_main, &mgr->shards[i])) != 0) {
+			mgr->running = i;
+			xb_mgr_stop(mgr);
+			errno = ret;
+			return -1;
+		}
+	}
+	mgr->running = nthreads;
+
+	return 0;
+}
+
+void
+xb_mgr_stop(struct xb_mgr *mgr) {
+	char c = 0;
+	int i;
+
+	for(i = 0; i < mgr->running; i++) {
+		atomic_store(&mgr->shards[i].stop, 1);
+		if (write(mgr->shards[i].wake[1], &c, 1) < 0) {
+			/* the thread may be stuck, but joining is all we can do */
+		}
+	}
+	for(i = 0; i < mgr->running; i++) {
+		pthread_join(mgr->shards[i].thread, NULL);
+	}
+	mgr->running = 0;
+
+	if (mgr->shards) {
+		xb_mgr_teardown(mgr);
+	}
+}
+
+/*
+ * a snapshot of one port's counters
+ */
+int
+xb_mgr_stats(struct xb_mgr *mgr, int port, struct xb_port_stats *stats) {
+	struct xb_port *p;
+
+	if (port < 0 || port >= mgr->nports) {
+		errno = EINVAL;
+		return -1;
+	}
+	p = &mgr->ports[port];
+
+	stats->bytes_in = atomic_load_explicit(&p->bytes_in, memory_order_relaxed);
+	stats->frames_in = atomic_load_explicit(&p->frames_in, memory_order_relaxed);
+	stats->errors = atomic_load_explicit(&p->errors, memory_order_relaxed);
+	stats->wakeups = atomic_load_explicit(&p->wakeups, memory_order_relaxed);
+	stats->last_rx = atomic_load_explicit(&p->last_rx, memory_order_relaxed);
+	stats->up = atomic_load(&p->up);
+
+	return 0;
+}
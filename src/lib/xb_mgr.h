@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_MGR_H
+#define XB_MGR_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+/*
+ * many radios served from one event loop, or from a few with the ports
+ * shared out between threads.  Each port's frames go through its own
+ * context's xb_dispatch_frame(), so a handler only ever sees frames of
+ * its own radio, always from the same thread.
+ */
+#define XB_MGR_EVENTS				32
+
+struct xb_port_stats {
+	unsigned long bytes_in, frames_in, errors, wakeups;
+	uint64_t last_rx;
+	int up;
+};
+
+struct xb_port {
+	struct xb_ctx *xctx;
+	atomic_int up;
+	atomic_ulong bytes_in, frames_in, errors, wakeups;
+	atomic_uint_least64_t last_rx;
+};
+
+struct xb_mgr_shard {
+	struct xb_mgr *mgr;
+	pthread_t thread;
+	/* epoll instance, -1 when polling */
+	int epfd;
+	/* wakes a shard thread, to stop or for a port's new work */
+	int wake[2];
+	atomic_int stop;
+	int index;
+};
+
+struct xb_mgr {
+	struct xb_port *ports;
+	int nports, size;
+	struct xb_mgr_shard *shards;
+	int nshards, running;
+};
+
+struct xb_mgr *xb_mgr_new(void);
+void xb_mgr_free(struct xb_mgr *);
+int xb_mgr_add(struct xb_mgr *, struct xb_ctx *, xb_frame_handler, void *);
+int xb_mgr_run(struct xb_mgr *, int);
+int xb_mgr_start(struct xb_mgr *, int);
+void xb_mgr_stop(struct xb_mgr *);
+int xb_mgr_stats(struct xb_mgr *, int, struct xb_port_stats *);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_nd.h"
+#include "xb_tx.h"
+
+void
+xb_node_table_init(struct xb_node_table *tab) {
+	memset(tab, 0, sizeof(*tab));
+}
+
+void
+xb_node_table_free(struct xb_node_table *tab) {
+	free(tab->nodes);
+	memset(tab, 0, sizeof(*tab));
+}
+
+struct xb_node *
+xb_node_lookup(struct xb_node_table *tab, uint64_t addr64) {
+	unsigned int i;
+
+	for(i = 0; i < tab->count; i++) {
+		if (tab->nodes[i].addr64 == addr64) {
+			return &tab->nodes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * forget nodes that have missed the last missed discovery rounds;
+ * returns how many went
+ */
+unsigned int
+xb_node_prune(struct xb_node_table *tab, uint32_t missed) {
+	unsigned int i, removed = 0;
+
+	for(i = 0; i < tab->count; ) {
+		if (tab->generation - tab->nodes[i].generation >= missed) {
+			tab->nodes[i] = tab->nodes[--tab->count];
+			removed++;
+		}
+		else {
+			i++;
+		}
+	}
+
+	return removed;
+}
+
+/*
+ * decode one node record, the value of an ND response; 802.15.4 sends
+ * MY, SH, SL, DB, NI, the others MY, SH, SL, NI, parent, device type,
+ * status, profile, manufacturer and, depending on NO, DD and RSSI
+ */
+int
+xb_nd_parse(struct xb_ctx *xctx, const uint8_t *data, size_t len, struct xb_node *node) {
+	const uint8_t *ni, *end = data + len, *p;
+	size_t nilen;
+
+	memset(node, 0, sizeof(*node));
+	node->device_type = XB_NODE_UNKNOWN;
+	node->parent16 = XB_ADDR16_UNKNOWN;
+
+	if (len < 10) {
+		return -1;
+	}
+	node->addr16 = (uint16_t)xb_get_be(data, 2);
+	node->addr64 = xb_get_be(data + 2, 8);
+	p = data + 10;
+
+	if (xctx->fw_family == XB_FW_802_15_4) {
+		if (p >= end) {
+			return -1;
+		}
+		node->rssi = *p++;
+	}
+
+	for(ni = p; p < end && *p; p++)
+		;
+	nilen = (size_t)(p - ni);
+	if (nilen > XB_NI_MAX) {
+		nilen = XB_NI_MAX;
+	}
+	memcpy(node->ni, ni, nilen);
+	if (p < end) {
+		p++;
+	}
+
+	if (xctx->fw_family == XB_FW_802_15_4 || end - p < 8) {
+		return 0;
+	}
+
+	node->parent16 = (uint16_t)xb_get_be(p, 2);
+	node->device_type = p[2];
+	node->status = p[3];
+	node->profile = (uint16_t)xb_get_be(p + 4, 2);
+	node->manufacturer = (uint16_t)xb_get_be(p + 6, 2);
+	p += 8;
+
+	/* DD is 4 bytes, RSSI 1; either may be there */
+	if (end - p == 1 || end - p == 5) {
+		node->rssi = end[-1];
+	}
+
+	return 0;
+}
+
+/*
+ * fold a record into the table; returns XB_ND_NEW/XB_ND_CHANGED, or -1
+ * if the table could not grow
+ */
+static int
+xb_nd_merge(struct xb_node_table *tab, struct xb_node *rec, struct xb_node **out) {
+	struct xb_node *node, *nodes;
+	unsigned int max;
+	int flags = 0;
+
+	if ( (node = xb_node_lookup(tab, rec->addr64)) == NULL) {
+		if (tab->count == tab->max) {
+			max = tab->max ? tab->max * 2 : 32;
+			nodes = (struct xb_node *)realloc(tab->nodes, max * sizeof(struct xb_node));
+			if (!nodes) {
+				return -1;
+			}
+			tab->nodes = nodes;
+			tab->max = max;
+		}
+		node = &tab->nodes[tab->count++];
+		flags = XB_ND_NEW;
+	}
+	else if (node->addr16 != rec->addr16 || node->parent16 != rec->parent16 ||
+			node->device_type != rec->device_type || strcmp(node->ni, rec->ni)) {
+		flags = XB_ND_CHANGED;
+	}
+
+	*node = *rec;
+	node->generation = tab->generation;
+	node->seen = xb_time_us();
+	*out = node;
+
+	return flags;
+}
+
+/*
+ * run node discovery (for the node called ni, or all if NULL), handing
+ * each record to cb as it arrives and merging it into tab.  A timeout of
+ * 0 waits as long as the radio's NT says.  Returns the number of nodes
+ * that answered.
+ */
+int
+xb_nd_run(struct xb_ctx *xctx, struct xb_node_table *tab, const char *ni,
+		xb_node_cb cb, void *arg, int timeout) {
+	struct xb_buffer *xbuf;
+	struct xb_frame frame;
+	struct xb_node rec, *node;
+	uint64_t nt, deadline;
+	uint8_t frame_id;
+	int flags, found = 0, ret, wait;
+
+	if (xctx->api_mode != XB_API && xctx->api_mode != XB_API_ESC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!timeout) {
+		if (xb_at_query(xctx, "NT", &nt, XB_AT_TIMEOUT_MS) < 0) {
+			nt = XB_NT_DEFAULT;
+		}
+		timeout = (int)nt * XB_NT_UNIT_MS + XB_ND_SLACK_MS;
+	}
+
+	if ( (xbuf = xb_create_at_cmd(xctx, "ND", API_REQUEST_ACK)) == NULL) {
+		return -1;
+	}
+	if ( (ni && xb_buffer_put_data(xbuf, ni, (uint16_t)strlen(ni)) < 0) ||
+			xb_send(xctx, xbuf) < 0) {
+		xb_buffer_free(xbuf);
+		return -1;
+	}
+	frame_id = xb_buffer_get_frame_id(xbuf);
+	xb_buffer_free(xbuf);
+
+	tab->generation++;
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	while ( (wait = xb_remaining(timeout, deadline)) != 0) {
+		if ( (ret = xb_read_frame(xctx, &frame, wait)) < 0) {
+			return -1;
+		}
+		if (!ret) {
+			break;
+		}
+
+		/* 0x88, frame id, "ND", status, record */
+		if (frame.data[0] != XB_FRAME_TYPE_AT_CMD_RESPONSE || frame.len < 5 ||
+				frame.data[1] != frame_id) {
+			xb_dispatch_frame(xctx, &frame);
+			continue;
+		}
+
+		/* some firmware ends the round with an empty record */
+		if (frame.len == 5 || frame.data[4] != XB_AT_STATUS_OK) {
+			break;
+		}
+		if (xb_nd_parse(xctx, frame.data + 5, frame.len - 5, &rec) < 0) {
+			continue;
+		}
+		if ( (flags = xb_nd_merge(tab, &rec, &node)) < 0) {
+			return -1;
+		}
+		found++;
+
+		if (cb) {
+			cb(xctx, node, flags, arg);
+		}
+
+		/* a named node answers once */
+		if (ni) {
+			break;
+		}
+	}
+
+	return found;
+}
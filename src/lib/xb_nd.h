@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_ND_H
+#define XB_ND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+/* NT is in units of 100 ms; factory default 6 s */
+#define XB_NT_DEFAULT				0x3c
+#define XB_NT_UNIT_MS				100
+/* responses can trail the NT window a little */
+#define XB_ND_SLACK_MS				1000
+
+#define XB_NI_MAX				20
+
+/* device types in an ND record */
+#define XB_NODE_COORDINATOR			0
+#define XB_NODE_ROUTER				1
+#define XB_NODE_END_DEVICE			2
+#define XB_NODE_UNKNOWN				0xff
+
+/* what the node callback is told about a record */
+#define XB_ND_NEW				(1 << 0)
+#define XB_ND_CHANGED				(1 << 1)
+
+struct xb_node {
+	uint64_t addr64;
+	uint16_t addr16, parent16;
+	char ni[XB_NI_MAX + 1];
+	uint8_t device_type, status;
+	uint16_t profile, manufacturer;
+	/* -dBm of the last hop, 0 if not reported */
+	uint8_t rssi;
+
+	/* discovery round the node last answered in */
+	uint32_t generation;
+	uint64_t seen;
+};
+
+struct xb_node_table {
+	struct xb_node *nodes;
+	unsigned int count, max;
+	uint32_t generation;
+};
+
+typedef void (*xb_node_cb)(struct xb_ctx *, const struct xb_node *, int, void *);
+
+void xb_node_table_init(struct xb_node_table *);
+void xb_node_table_free(struct xb_node_table *);
+struct xb_node *xb_node_lookup(struct xb_node_table *, uint64_t);
+unsigned int xb_node_prune(struct xb_node_table *, uint32_t);
+
+int xb_nd_parse(struct xb_ctx *, const uint8_t *, size_t, struct xb_node *);
+int xb_nd_run(struct xb_ctx *, struct xb_node_table *, const char *,
+		xb_node_cb, void *, int);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "xb_ctx.h"
+#include "xb_probe.h"
+#include "xb_serial.h"
+
+/* most likely first: factory default, then the fast ones */
+static const uint32_t xb_autobaud_rates[] = {
+	9600, 115200, 57600, 38400, 19200, 230400, 4800, 2400, 1200,
+	460800, 921600,
+};
+
+static int
+xb_remaining_ms(uint64_t deadline) {
+	uint64_t now = xb_time_us();
+
+	return now >= deadline ? 0 : (int)((deadline - now + 999) / 1000);
+}
+
+static int
+xb_is_special(uint8_t b) {
+	return b == XB_FRAME_DELIM || b == XB_FRAME_ESCAPE ||
+		b == XB_FRAME_XON || b == XB_FRAME_XOFF;
+}
+
+/*
+ * send ATAP as an API frame; returns its frame ID.  A radio in
+ * transparent mode will pass the probe bytes on over the air.
+ */
+int
+xb_probe_api_start(struct xb_ctx *xctx) {
+	uint8_t frame_id;
+	int tries;
+
+	/*
+	 * the probe goes out unescaped, so pick a frame ID that makes it
+	 * identical in API modes 1 and 2: neither the ID nor the checksum
+	 * (0xff - (0x08 + 'A' + 'P' + ID)) may need escaping.  Nor may the
+	 * checksum of a mode 1 reply, which arrives unescaped at our
+	 * escaping decoder (0xff - (0x88 + 'A' + 'P' + 0 + 1 + ID)).
+	 */
+	for(tries = 0; tries < 256 && (!xctx->frame_id || xb_is_special(xctx->frame_id) ||
+			xb_is_special((uint8_t)(0xff - (0x99 + xctx->frame_id))) ||
+			xb_is_special((uint8_t)(0xff - (0x1a + xctx->frame_id))) ||
+			xb_frame_id_busy(xctx, xctx->frame_id)); tries++) {
+		xctx->frame_id++;
+	}
+
+	/* an escaping decoder reads either mode's reply */
+	xctx->api_mode = XB_API;
+	xctx->decoder.escaped = 1;
+
+	if (xb_send_at_cmd(xctx, "AP", &frame_id) < 0) {
+		return -1;
+	}
+
+	return frame_id;
+}
+
+/*
+ * check a frame for the ATAP reply; returns the radio's API mode (1 or
+ * 2) and switches xctx to it, or -1 if this wasn't the reply
+ */
+int
+xb_probe_api_result(struct xb_ctx *xctx, struct xb_frame *frame, uint8_t frame_id) {
+	uint8_t ap;
+
+	/* 0x88, frame id, "AP", status, value */
+	if (frame->data[0] != XB_FRAME_TYPE_AT_CMD_RESPONSE || frame->len != 6 ||
+			frame->data[1] != frame_id || frame->data[4] != XB_AT_STATUS_OK) {
+		return -1;
+	}
+
+	ap = frame->data[5];
+	if (ap != XB_API && ap != XB_API_ESC) {
+		return -1;
+	}
+	xb_set_api_mode(xctx, (enum xb_api_mode)ap);
+
+	return ap;
+}
+
+/*
+ * returns the radio's API mode (1 or 2), or -1 if it isn't in API mode
+ */
+int
+xb_probe_api(struct xb_ctx *xctx, int timeout) {
+	enum xb_api_mode old = xctx->api_mode;
+	struct xb_frame frame;
+	int frame_id, ret = -1;
+
+	if ( (frame_id = xb_probe_api_start(xctx)) >= 0 &&
+			xb_wait_for_frame(xctx, (uint8_t)frame_id, &frame, timeout) > 0) {
+		ret = xb_probe_api_result(xctx, &frame, (uint8_t)frame_id);
+	}
+
+	if (ret < 0) {
+		xb_set_api_mode(xctx, old);
+	}
+
+	return ret;
+}
+
+/*
+ * try to enter command mode; on success the radio is left in it
+ */
+int
+xb_probe_at(struct xb_ctx *xctx) {
+	enum xb_api_mode old = xctx->api_mode;
+
+	xb_set_api_mode(xctx, XB_AT);
+	if (xb_enter_command_mode(xctx) < 0) {
+		xb_set_api_mode(xctx, old);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * coarse, by the top nibble of VR
+ */
+enum xb_fw_family
+xb_fw_family_of(uint16_t vr) {
+	switch (vr >> 12) {
+	case 0x1:
+		return XB_FW_802_15_4;
+	case 0x2:
+	case 0x4:
+		return XB_FW_ZB;
+	case 0x8:
+	case 0x9:
+		return XB_FW_DIGIMESH;
+	}
+
+	return XB_FW_UNKNOWN;
+}
+
+/*
+ * read firmware and hardware versions
+ */
+int
+xb_identify(struct xb_ctx *xctx) {
+	struct xb_buffer *xbufs[2];
+	struct buffer *replies[2];
+	uint64_t vr, hv;
+	int ret = -1;
+
+	if (xctx->api_mode != XB_AT) {
+		if (xb_at_query(xctx, "VR", &vr, XB_PROBE_TIMEOUT_MS) < 0 ||
+				xb_at_query(xctx, "HV", &hv, XB_PROBE_TIMEOUT_MS) < 0) {
+			return -1;
+		}
+	}
+	else {
+		/* one "ATVR,HV" line */
+		if (xb_enter_command_mode(xctx) < 0) {
+			return -1;
+		}
+		xbufs[0] = xb_create_at_cmd(xctx, "VR", 0);
+		xbufs[1] = xb_create_at_cmd(xctx, "HV", 0);
+		if (xbufs[0] && xbufs[1] && xb_at_batch(xctx, xbufs, replies, 2) == 2) {
+			vr = strtoull(replies[0]->data, NULL, 16);
+			hv = strtoull(replies[1]->data, NULL, 16);
+			buffer_free(replies[0]);
+			buffer_free(replies[1]);
+			ret = 0;
+		}
+		if (xbufs[0]) {
+			xb_buffer_free(xbufs[0]);
+		}
+		if (xbufs[1]) {
+			xb_buffer_free(xbufs[1]);
+		}
+		if (ret < 0) {
+			return -1;
+		}
+	}
+
+	xctx->fw_version = (uint16_t)vr;
+	xctx->hw_version = (uint16_t)hv;
+	xctx->fw_family = xb_fw_family_of(xctx->fw_version);
+
+	return 0;
+}
+
+/*
+ * $XDG_CACHE_HOME/xbee-comm/<device, with '/' as '_'>
+ */
+static int
+xb_cache_path(struct xb_ctx *xctx, char *path, size_t max, int create) {
+	const char *base;
+	char *p;
+	int ret;
+
+	if ( (base = getenv("XDG_CACHE_HOME")) && *base) {
+		if (create) {
+			mkdir(base, 0700);
+		}
+		ret = snprintf(path, max, "%s/xbee-comm", base);
+	}
+	else if ( (base = getenv("HOME")) && *base) {
+		ret = snprintf(path, max, "%s/.cache", base);
+		if (ret > 0 && (size_t)ret < max && create) {
+			mkdir(path, 0700);
+		}
+		ret = snprintf(path, max, "%s/.cache/xbee-comm", base);
+	}
+	else {
+		return -1;
+	}
+	if (ret < 0 || (size_t)ret >= max) {
+		return -1;
+	}
+
+	if (create && mkdir(path, 0700) < 0 && errno != EEXIST) {
+		return -1;
+	}
+
+	p = path + ret;
+	ret = snprintf(p, max - ret, "/%s", xctx->device);
+	if (ret < 0 || (size_t)ret >= max - (p - path)) {
+		return -1;
+	}
+	for(p++; *p; p++) {
+		if (*p == '/') {
+			*p = '_';
+		}
+	}
+
+	return 0;
+}
+
+static int
+xb_cache_load(struct xb_ctx *xctx, int *mode, uint32_t *baud) {
+	char path[PATH_MAX];
+	FILE *fp;
+	unsigned int vr, hv;
+	int ret;
+
+	if (xb_cache_path(xctx, path, sizeof(path), 0) < 0) {
+		return -1;
+	}
+	if ( (fp = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	ret = fscanf(fp, "mode=%d baud=%u vr=%x hv=%x", mode, baud, &vr, &hv);
+	fclose(fp);
+
+	if (ret != 4 || *mode < XB_AT || *mode > XB_API_ESC) {
+		return -1;
+	}
+
+	xctx->fw_version = (uint16_t)vr;
+	xctx->hw_version = (uint16_t)hv;
+	xctx->fw_family = xb_fw_family_of(xctx->fw_version);
+
+	return 0;
+}
+
+static int
+xb_cache_store(struct xb_ctx *xctx) {
+	char path[PATH_MAX];
+	FILE *fp;
+
+	if (xb_cache_path(xctx, path, sizeof(path), 1) < 0) {
+		return -1;
+	}
+	if ( (fp = fopen(path, "w")) == NULL) {
+		return -1;
+	}
+	fprintf(fp, "mode=%d baud=%u vr=%04x hv=%04x\n", xctx->api_mode,
+			xctx->baud, xctx->fw_version, xctx->hw_version);
+
+	return fclose(fp);
+}
+
+/*
+ * API probe every port at the same rate, waiting only as long as the
+ * reply takes at that rate, then the next rate for those still silent
+ */
+static void
+xb_autobaud_api(struct xb_ctx **xctxs, int count, int *found) {
+	struct pollfd *pfds;
+	struct xb_frame frame;
+	uint64_t deadline;
+	unsigned int r;
+	int i, n, wait, *ids, *map;
+
+	pfds = (struct pollfd *)calloc(count, sizeof(struct pollfd));
+	ids = (int *)calloc(count, sizeof(int));
+	map = (int *)calloc(count, sizeof(int));
+	if (!pfds || !ids || !map) {
+		goto out;
+	}
+
+	for(r = 0; r < sizeof(xb_autobaud_rates) / sizeof(xb_autobaud_rates[0]); r++) {
+		if (xb_baud_to_speed(xb_autobaud_rates[r]) == B0) {
+			continue;
+		}
+
+		for(i = 0; i < count; i++) {
+			ids[i] = -1;
+			if (found[i]) {
+				continue;
+			}
+			xctxs[i]->baud = xb_autobaud_rates[r];
+			if (xb_serial_setup(xctxs[i]) < 0) {
+				continue;
+			}
+			ids[i] = xb_probe_api_start(xctxs[i]);
+		}
+
+		/* probe out, reply back (~20 bytes), plus radio/USB latency */
+		deadline = xb_time_us() + XB_AUTOBAUD_LATENCY_MS * 1000 +
+			20ULL * 10 * 1000000 / xb_autobaud_rates[r];
+
+		for(;;) {
+			for(n = i = 0; i < count; i++) {
+				if (ids[i] >= 0 && !found[i]) {
+					pfds[n].fd = xctxs[i]->xbfd;
+					pfds[n].events = POLLIN;
+					map[n++] = i;
+				}
+			}
+			if (!n || (wait = xb_remaining_ms(deadline)) == 0) {
+				break;
+			}
+			if (poll(pfds, n, wait) <= 0) {
+				continue;
+			}
+
+			for(n--; n >= 0; n--) {
+				i = map[n];
+				if (!(pfds[n].revents & POLLIN) || xb_fill(xctxs[i], 0) <= 0) {
+					continue;
+				}
+				while (!found[i] && xb_read_frame(xctxs[i], &frame, 0) > 0) {
+					if (xb_probe_api_result(xctxs[i], &frame, (uint8_t)ids[i]) > 0) {
+						found[i] = 1;
+					}
+				}
+			}
+		}
+	}
+
+out:
+	free(pfds);
+	free(ids);
+	free(map);
+}
+
+/*
+ * the same for command mode, which costs two guard times per rate
+ */
+static void
+xb_autobaud_at(struct xb_ctx **xctxs, int count, int *found) {
+	char line[16], seq[3];
+	struct pollfd *pfds;
+	uint64_t deadline;
+	unsigned int r;
+	int i, n, wait, *map;
+
+	pfds = (struct pollfd *)calloc(count, sizeof(struct pollfd));
+	map = (int *)calloc(count, sizeof(int));
+	if (!pfds || !map) {
+		goto out;
+	}
+
+	for(r = 0; r < sizeof(xb_autobaud_rates) / sizeof(xb_autobaud_rates[0]); r++) {
+		if (xb_baud_to_speed(xb_autobaud_rates[r]) == B0) {
+			continue;
+		}
+
+		for(n = i = 0; i < count; i++) {
+			if (found[i]) {
+				continue;
+			}
+			xctxs[i]->baud = xb_autobaud_rates[r];
+			xb_set_api_mode(xctxs[i], XB_AT);
+			if (xb_serial_setup(xctxs[i]) == 0) {
+				map[n++] = i;
+			}
+		}
+		if (!n) {
+			break;
+		}
+
+		/* our own probes count as line activity, so wait a full GT */
+		usleep(XB_GUARD_TIME_DEFAULT * 1000);
+		for(i = 0; i < n; i++) {
+			memset(seq, xctxs[map[i]]->command_char, sizeof(seq));
+			xb_output(xctxs[map[i]], seq, sizeof(seq));
+		}
+		deadline = xb_time_us() + (XB_GUARD_TIME_DEFAULT + XB_GUARD_SLACK_MS) * 1000;
+
+		while ( (wait = xb_remaining_ms(deadline)) > 0) {
+			for(i = 0; i < n; i++) {
+				pfds[i].fd = xctxs[map[i]]->xbfd;
+				pfds[i].events = found[map[i]] ? 0 : POLLIN;
+			}
+			if (poll(pfds, n, wait) <= 0) {
+				continue;
+			}
+
+			for(i = 0; i < n; i++) {
+				if (!(pfds[i].revents & POLLIN) || xb_fill(xctxs[map[i]], 0) <= 0) {
+					continue;
+				}
+				while (xb_read_line(xctxs[map[i]], line, sizeof(line), 0) > 0) {
+					if (!strcmp(line, "OK")) {
+						xctxs[map[i]]->in_command_mode = 1;
+						found[map[i]] = 1;
+					}
+				}
+			}
+		}
+	}
+
+out:
+	free(pfds);
+	free(map);
+}
+
+/*
+ * find the baud rate (and mode) of several radios at once; returns the
+ * number found.  Radios not found are left at their original rate.
+ */
+int
+xb_autobaud_many(struct xb_ctx **xctxs, int count, int flags) {
+	uint32_t *bauds;
+	enum xb_api_mode *modes;
+	int i, nfound = 0, *found;
+
+	found = (int *)calloc(count, sizeof(int));
+	bauds = (uint32_t *)calloc(count, sizeof(uint32_t));
+	modes = (enum xb_api_mode *)calloc(count, sizeof(enum xb_api_mode));
+	if (!found || !bauds || !modes) {
+		free(found);
+		free(bauds);
+		free(modes);
+		return -1;
+	}
+
+	for(i = 0; i < count; i++) {
+		bauds[i] = xctxs[i]->baud;
+		modes[i] = xctxs[i]->api_mode;
+	}
+
+	if (!(flags & XB_PROBE_NO_API)) {
+		xb_autobaud_api(xctxs, count, found);
+	}
+	if (!(flags & XB_PROBE_NO_AT)) {
+		xb_autobaud_at(xctxs, count, found);
+	}
+
+	for(i = 0; i < count; i++) {
+		if (found[i]) {
+			nfound++;
+			continue;
+		}
+		xctxs[i]->baud = bauds[i];
+		xb_set_api_mode(xctxs[i], modes[i]);
+		xb_serial_setup(xctxs[i]);
+	}
+
+	free(found);
+	free(bauds);
+	free(modes);
+
+	return nfound;
+}
+
+int
+xb_autobaud(struct xb_ctx *xctx, int flags) {
+	return xb_autobaud_many(&xctx, 1, flags) == 1 ? 0 : -1;
+}
+
+/*
+ * find out which mode the radio is in: a quick API probe first, then
+ * command mode, then (with XB_PROBE_AUTOBAUD) the other baud rates;
+ * with XB_PROBE_CACHE a previous result for this device is
+ * tried first and the cache is refreshed afterwards
+ */
+int
+xb_probe(struct xb_ctx *xctx, int flags) {
+	uint32_t baud = xctx->baud, cached_baud;
+	int mode;
+
+	if ((flags & XB_PROBE_CACHE) && !xb_cache_load(xctx, &mode, &cached_baud)) {
+		xctx->baud = cached_baud;
+		if (!xb_serial_setup(xctx)) {
+			if (mode == XB_AT) {
+				/*
+				 * nothing cheap to verify it with; probing
+				 * without XB_PROBE_CACHE starts over
+				 */
+				xb_set_api_mode(xctx, XB_AT);
+				return 0;
+			}
+			if (xb_probe_api(xctx, XB_PROBE_TIMEOUT_MS) == mode) {
+				return 0;
+			}
+		}
+		/* stale; start over */
+		xctx->baud = baud;
+	}
+
+	if (xb_serial_setup(xctx) < 0) {
+		return -1;
+	}
+
+	/* cheapest first: API here, API elsewhere, AT here, AT elsewhere */
+	if (xb_probe_api(xctx, XB_PROBE_TIMEOUT_MS) < 0 &&
+			(!(flags & XB_PROBE_AUTOBAUD) ||
+			 xb_autobaud(xctx, flags | XB_PROBE_NO_AT) < 0) &&
+			((flags & XB_PROBE_NO_AT) || xb_probe_at(xctx) < 0) &&
+			(!(flags & XB_PROBE_AUTOBAUD) || (flags & XB_PROBE_NO_AT) ||
+			 xb_autobaud(xctx, flags | XB_PROBE_NO_API) < 0)) {
+		return -1;
+	}
+
+	/* best effort; the mode is what matters */
+	xb_identify(xctx);
+	if (xctx->api_mode == XB_AT) {
+		xb_exit_command_mode(xctx);
+	}
+
+	if (flags & XB_PROBE_CACHE) {
+		xb_cache_store(xctx);
+	}
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_PROBE_H
+#define XB_PROBE_H
+
+#include "xb_ctx.h"
+
+/* an API radio answers ATAP within a few character times */
+#define XB_PROBE_TIMEOUT_MS			200
+
+/* per-rate allowance on top of the reply's time on the wire */
+#define XB_AUTOBAUD_LATENCY_MS			40
+
+/* xb_probe flags */
+#define XB_PROBE_CACHE				(1 << 0)
+#define XB_PROBE_NO_AT				(1 << 1)
+#define XB_PROBE_AUTOBAUD			(1 << 2)
+#define XB_PROBE_NO_API				(1 << 3)
+
+int xb_probe_api_start(struct xb_ctx *);
+int xb_probe_api_result(struct xb_ctx *, struct xb_frame *, uint8_t);
+int xb_probe_api(struct xb_ctx *, int);
+int xb_probe_at(struct xb_ctx *);
+int xb_identify(struct xb_ctx *);
+int xb_probe(struct xb_ctx *, int);
+
+int xb_autobaud(struct xb_ctx *, int);
+int xb_autobaud_many(struct xb_ctx **, int, int);
+
+enum xb_fw_family xb_fw_family_of(uint16_t);
+
+#endif
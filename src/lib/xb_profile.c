@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_profile.h"
+#include "xb_rat.h"
+#include "xb_tx.h"
+
+#define XB_PROFILE_REPLY_MAX			64
+
+/* one register read or write, whichever way it went to the radio */
+struct xb_profile_reply {
+	int status;		/* XB_AT_STATUS_*, -1 for no answer */
+	int text;		/* command mode prints values in hex */
+	uint8_t len;
+	uint8_t data[XB_PROFILE_REPLY_MAX];
+};
+
+struct xb_profile *
+xb_profile_new() {
+	return (struct xb_profile *)calloc(1, sizeof(struct xb_profile));
+}
+
+void
+xb_profile_free(struct xb_profile *prof) {
+	free(prof->entries);
+	free(prof);
+}
+
+static struct xb_profile_entry *
+xb_profile_new_entry(struct xb_profile *prof, char cmd[2]) {
+	struct xb_profile_entry *entries, *entry;
+	unsigned int max;
+
+	if (prof->count == prof->max) {
+		max = prof->max ? prof->max * 2 : 16;
+		entries = (struct xb_profile_entry *)realloc(prof->entries,
+				max * sizeof(struct xb_profile_entry));
+		if (!entries) {
+			return NULL;
+		}
+		prof->entries = entries;
+		prof->max = max;
+	}
+
+	entry = &prof->entries[prof->count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->cmd[0] = (char)toupper((unsigned char)cmd[0]);
+	entry->cmd[1] = (char)toupper((unsigned char)cmd[1]);
+
+	return entry;
+}
+
+int
+xb_profile_add(struct xb_profile *prof, char cmd[2], uint64_t value) {
+	struct xb_profile_entry *entry;
+
+	if ( (entry = xb_profile_new_entry(prof, cmd)) == NULL) {
+		return -1;
+	}
+	entry->value = value;
+
+	return 0;
+}
+
+int
+xb_profile_add_string(struct xb_profile *prof, char cmd[2], const char *str) {
+	struct xb_profile_entry *entry;
+
+	if (strlen(str) > XB_PROFILE_STR_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ( (entry = xb_profile_new_entry(prof, cmd)) == NULL) {
+		return -1;
+	}
+	entry->is_string = 1;
+	strcpy(entry->str, str);
+
+	return 0;
+}
+
+/*
+ * one register per line: the command and either a hex value or a
+ * double-quoted string, e.g. 'ID 3332' or 'NI "pump house"'; '#' starts
+ * a comment
+ */
+struct xb_profile *
+xb_profile_load(const char *path) {
+	struct xb_profile *prof;
+	char line[128], *p, *end, *q;
+	uint64_t value;
+	FILE *fp;
+	int ret;
+
+	if ( (fp = fopen(path, "r")) == NULL) {
+		return NULL;
+	}
+	if ( (prof = xb_profile_new()) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if ( (p = strchr(line, '#')) != NULL && !strchr(line, '"')) {
+			*p = '\0';
+		}
+		for(p = line; isspace((unsigned char)*p); p++)
+			;
+		if (!*p) {
+			continue;
+		}
+		if (!isalnum((unsigned char)p[0]) || !isalnum((unsigned char)p[1]) ||
+				!isspace((unsigned char)p[2])) {
+			goto bad;
+		}
+		for(q = p + 2; isspace((unsigned char)*q); q++)
+			;
+
+		if (*q == '"') {
+			if ( (end = strchr(q + 1, '"')) == NULL) {
+				goto bad;
+			}
+			*end = '\0';
+			ret = xb_profile_add_string(prof, p, q + 1);
+		}
+		else {
+			value = strtoull(q, &end, 16);
+			while (isspace((unsigned char)*end)) {
+				end++;
+			}
+			if (end == q || *end) {
+				goto bad;
+			}
+			ret = xb_profile_add(prof, p, value);
+		}
+		if (ret < 0) {
+			goto bad;
+		}
+	}
+
+	fclose(fp);
+	return prof;
+
+bad:
+	fclose(fp);
+	xb_profile_free(prof);
+	errno = EINVAL;
+	return NULL;
+}
+
+static int
+xb_profile_put_value(struct xb_buffer *xbuf, const struct xb_profile_entry *entry) {
+	if (entry->is_string) {
+		return xb_buffer_put_data(xbuf, entry->str, (uint16_t)strlen(entry->str));
+	}
+	if (entry->value <= 0xff) {
+		return xb_buffer_put_uint8(xbuf, (uint8_t)entry->value);
+	}
+	if (entry->value <= 0xffff) {
+		return xb_buffer_put_uint16(xbuf, (uint16_t)entry->value);
+	}
+	if (entry->value <= 0xffffffff) {
+		return xb_buffer_put_uint32(xbuf, (uint32_t)entry->value);
+	}
+	return xb_buffer_put_uint64(xbuf, entry->value);
+}
+
+/*
+ * the value as remote AT parameter bytes, big-endian without leading
+ * zeroes
+ */
+static uint8_t
+xb_profile_encode(const struct xb_profile_entry *entry, uint8_t *out) {
+	uint8_t len;
+	int i;
+
+	if (entry->is_string) {
+		len = (uint8_t)strlen(entry->str);
+		memcpy(out, entry->str, len);
+		return len;
+	}
+
+	for(len = 1; len < 8 && (entry->value >> (len * 8)); len++)
+		;
+	for(i = 0; i < len; i++) {
+		out[i] = (uint8_t)(entry->value >> ((len - 1 - i) * 8));
+	}
+
+	return len;
+}
+
+/*
+ * turn a read back into an entry like want; -1 if it makes no sense
+ */
+static int
+xb_profile_decode(const struct xb_profile_entry *want, const uint8_t *data,
+		uint8_t len, int text, struct xb_profile_entry *was) {
+	char hex[XB_PROFILE_REPLY_MAX + 1], *end;
+	int i;
+
+	memset(was, 0, sizeof(*was));
+	was->cmd[0] = want->cmd[0];
+	was->cmd[1] = want->cmd[1];
+	was->is_string = want->is_string;
+
+	if (want->is_string) {
+		if (len > XB_PROFILE_STR_MAX) {
+			len = XB_PROFILE_STR_MAX;
+		}
+		memcpy(was->str, data, len);
+		return 0;
+	}
+
+	if (text) {
+		memcpy(hex, data, len);
+		hex[len] = '\0';
+		was->value = strtoull(hex, &end, 16);
+		return (end == hex || *end) ? -1 : 0;
+	}
+
+	if (len > 8) {
+		return -1;
+	}
+	for(i = 0; i < len; i++) {
+		was->value = (was->value << 8) | data[i];
+	}
+
+	return 0;
+}
+
+static int
+xb_profile_differs(const struct xb_profile_entry *want, const struct xb_profile_entry *was) {
+	if (want->is_string) {
+		return strcmp(want->str, was->str) != 0;
+	}
+	return want->value != was->value;
+}
+
+static void
+xb_profile_reply_set(struct xb_profile_reply *reply, int status, const void *data,
+		size_t len, int text) {
+	reply->status = status;
+	reply->text = text;
+	if (len > XB_PROFILE_REPLY_MAX) {
+		len = XB_PROFILE_REPLY_MAX;
+	}
+	memcpy(reply->data, data, len);
+	reply->len = (uint8_t)len;
+}
+
+/*
+ * command mode: the radio answers a chained line in order
+ */
+static int
+xb_profile_run_at(struct xb_ctx *xctx, struct xb_buffer **xbufs, int count,
+		struct xb_profile_reply *replies) {
+	struct buffer **bufs;
+	int i, ret;
+
+	if (xb_enter_command_mode(xctx) < 0) {
+		return -1;
+	}
+	if ( (bufs = (struct buffer **)calloc(count, sizeof(struct buffer *))) == NULL) {
+		return -1;
+	}
+
+	ret = xb_at_batch(xctx, xbufs, bufs, count);
+	for(i = 0; i < count; i++) {
+		if (!bufs[i]) {
+			continue;
+		}
+		xb_profile_reply_set(&replies[i],
+				strcmp(bufs[i]->data, "ERROR") ? XB_AT_STATUS_OK : XB_AT_STATUS_ERROR,
+				bufs[i]->data, bufs[i]->writepos, 1);
+		buffer_free(bufs[i]);
+	}
+	free(bufs);
+
+	return ret;
+}
+
+/*
+ * API mode: keep up to XB_PROFILE_PIPELINE commands in flight
+ */
+static int
+xb_profile_run_api(struct xb_ctx *xctx, struct xb_buffer **xbufs, int count,
+		struct xb_profile_reply *replies) {
+	struct xb_frame frame;
+	uint64_t deadline;
+	int i, first, last, pending, got = 0, ret, wait;
+
+	for(first = 0; first < count; first = last) {
+		last = first + XB_PROFILE_PIPELINE;
+		if (last > count) {
+			last = count;
+		}
+
+		for(i = first; i < last; i++) {
+			if (xb_send(xctx, xbufs[i]) < 0) {
+				return -1;
+			}
+		}
+
+		pending = last - first;
+		deadline = xb_time_us() + (uint64_t)XB_AT_TIMEOUT_MS * 1000;
+		while (pending && (wait = xb_remaining(XB_AT_TIMEOUT_MS, deadline)) != 0) {
+			if ( (ret = xb_read_frame(xctx, &frame, wait)) < 0) {
+				return -1;
+			}
+			if (!ret) {
+				break;
+			}
+
+			/* 0x88, frame id, command, status, value */
+			for(i = first; i < last; i++) {
+				if (replies[i].status < 0 &&
+						xb_buffer_get_frame_id(xbufs[i]) == frame.data[1]) {
+					break;
+				}
+			}
+			if (frame.data[0] != XB_FRAME_TYPE_AT_CMD_RESPONSE || frame.len < 5 ||
+					i == last) {
+				xb_dispatch_frame(xctx, &frame);
+				continue;
+			}
+
+			xb_profile_reply_set(&replies[i], frame.data[4], frame.data + 5,
+					frame.len - 5, 0);
+			pending--;
+			got++;
+		}
+	}
+
+	return got;
+}
+
+static int
+xb_profile_run_local(struct xb_ctx *xctx, struct xb_buffer **xbufs, int count,
+		struct xb_profile_reply *replies) {
+	int i;
+
+	for(i = 0; i < count; i++) {
+		replies[i].status = -1;
+	}
+
+	if (xctx->api_mode == XB_AT) {
+		return xb_profile_run_at(xctx, xbufs, count, replies);
+	}
+	return xb_profile_run_api(xctx, xbufs, count, replies);
+}
+
+static void
+xb_profile_free_bufs(struct xb_buffer **xbufs, int count) {
+	int i;
+
+	for(i = 0; i < count; i++) {
+		if (xbufs[i]) {
+			xb_buffer_free(xbufs[i]);
+		}
+	}
+	free(xbufs);
+}
+
+/*
+ * bring the local radio in line with prof: read every register, write
+ * the ones that differ and only then WR and AC.  Returns the number of
+ * registers changed.
+ */
+int
+xb_profile_apply(struct xb_ctx *xctx, struct xb_profile *prof, xb_profile_cb cb, void *arg) {
+	struct xb_profile_entry *was;
+	struct xb_profile_reply *replies;
+	struct xb_buffer **xbufs;
+	int *idx, count, i, n, changed = -1, ok;
+
+	count = (int)prof->count;
+	was = (struct xb_profile_entry *)calloc(count + 1, sizeof(*was));
+	replies = (struct xb_profile_reply *)calloc(count + 2, sizeof(*replies));
+	xbufs = (struct xb_buffer **)calloc(count + 2, sizeof(*xbufs));
+	idx = (int *)calloc(count + 1, sizeof(int));
+	if (!was || !replies || !xbufs || !idx) {
+		goto out;
+	}
+
+	for(i = 0; i < count; i++) {
+		if ( (xbufs[i] = xb_create_at_cmd(xctx, prof->entries[i].cmd, API_REQUEST_ACK)) == NULL) {
+			goto out;
+		}
+	}
+	if (xb_profile_run_local(xctx, xbufs, count, replies) < 0) {
+		goto out;
+	}
+
+	/* what has to change; unreadable registers are written regardless */
+	for(i = n = 0; i < count; i++) {
+		ok = replies[i].status == XB_AT_STATUS_OK &&
+			xb_profile_decode(&prof->entries[i], replies[i].data, replies[i].len,
+					replies[i].text, &was[i]) == 0;
+		if (!ok) {
+			was[i].cmd[0] = '\0';
+		}
+		if (!ok || xb_profile_differs(&prof->entries[i], &was[i])) {
+			idx[n++] = i;
+		}
+	}
+
+	for(i = 0; i < count; i++) {
+		xb_buffer_free(xbufs[i]);
+		xbufs[i] = NULL;
+	}
+
+	if (!n) {
+		changed = 0;
+		goto out;
+	}
+
+	/* queue the writes, then WR and AC once */
+	for(i = 0; i < n; i++) {
+		if ( (xbufs[i] = xb_create_at_cmd(xctx, prof->entries[idx[i]].cmd, API_REQUEST_ACK)) == NULL ||
+				xb_profile_put_value(xbufs[i], &prof->entries[idx[i]]) < 0) {
+			goto out;
+		}
+		if (xctx->api_mode != XB_AT &&
+				xb_buffer_set_uint8(xbufs[i], 0, XB_FRAME_TYPE_AT_CMD_QUEUE) < 0) {
+			goto out;
+		}
+	}
+	if ( (xbufs[n] = xb_create_at_cmd(xctx, "WR", API_REQUEST_ACK)) == NULL ||
+			(xbufs[n + 1] = xb_create_at_cmd(xctx, "AC", API_REQUEST_ACK)) == NULL) {
+		goto out;
+	}
+	/* separately, as command mode abandons a line after an ERROR */
+	if (xb_profile_run_local(xctx, xbufs, n, replies) < 0 ||
+			xb_profile_run_local(xctx, xbufs + n, 2, replies + n) < 0) {
+		goto out;
+	}
+
+	for(i = changed = 0; i < n; i++) {
+		ok = replies[i].status == XB_AT_STATUS_OK;
+		if (ok) {
+			changed++;
+		}
+		if (cb) {
+			cb(xctx, XB_ADDR64_UNKNOWN, &prof->entries[idx[i]],
+					was[idx[i]].cmd[0] ? &was[idx[i]] : NULL, ok ? 0 : -1, arg);
+		}
+	}
+	if (replies[n].status != XB_AT_STATUS_OK || replies[n + 1].status != XB_AT_STATUS_OK) {
+		changed = -1;
+	}
+
+out:
+	if (xbufs) {
+		xb_profile_free_bufs(xbufs, count + 2);
+	}
+	free(idx);
+	free(replies);
+	free(was);
+	return changed;
+}
+
+/*
+ * the same for a list of remote nodes at once, reads and then writes
+ * pipelined across all of them; returns the total number of registers
+ * changed, or -1 if any node failed its WR or AC (its writes are then
+ * reported as failed too)
+ */
+int
+xb_profile_apply_remote(struct xb_ctx *xctx, struct xb_profile *prof, const uint64_t *dests,
+		unsigned int ndests, xb_profile_cb cb, void *arg) {
+	struct xb_profile_entry *want, *was = NULL;
+	struct xb_rat_req *req;
+	struct xb_rat *rat;
+	uint8_t param[XB_RAT_PARAM_MAX];
+	unsigned int d, e, i, count = prof->count;
+	int changed = -1, ok, *failed = NULL, any_failed = 0;
+
+	if ( (rat = xb_rat_new(xctx, 0, 0)) == NULL) {
+		return -1;
+	}
+	if ( (was = (struct xb_profile_entry *)calloc(ndests * count + 1, sizeof(*was))) == NULL ||
+			(failed = (int *)calloc(ndests + 1, sizeof(int))) == NULL) {
+		goto out;
+	}
+
+	for(d = 0; d < ndests; d++) {
+		for(e = 0; e < count; e++) {
+			if (xb_rat_add(rat, dests[d], XB_ADDR16_UNKNOWN, prof->entries[e].cmd,
+					NULL, 0, 0, NULL) < 0) {
+				goto out;
+			}
+		}
+	}
+	if (xb_rat_run(rat, -1) < 0) {
+		goto out;
+	}
+
+	for(i = 0; i < rat->count; i++) {
+		req = &rat->reqs[i];
+		want = &prof->entries[i % count];
+		if (req->status != XB_AT_STATUS_OK ||
+				xb_profile_decode(want, req->value, req->value_len, 0, &was[i]) < 0) {
+			was[i].cmd[0] = '\0';
+		}
+	}
+
+	/* a fresh engine for the writes; cookies point back at the reads */
+	xb_rat_free(rat);
+	if ( (rat = xb_rat_new(xctx, 0, 0)) == NULL) {
+		goto out;
+	}
+	for(d = 0; d < ndests; d++) {
+		ok = 0;
+		for(e = 0; e < count; e++) {
+			i = d * count + e;
+			want = &prof->entries[e];
+			if (was[i].cmd[0] && !xb_profile_differs(want, &was[i])) {
+				continue;
+			}
+			if (xb_rat_add(rat, dests[d], XB_ADDR16_UNKNOWN, want->cmd, param,
+					xb_profile_encode(want, param), 0, &was[i]) < 0) {
+				goto out;
+			}
+			ok = 1;
+		}
+		if (ok && (xb_rat_add(rat, dests[d], XB_ADDR16_UNKNOWN, "WR", NULL, 0, 0, NULL) < 0 ||
+				xb_rat_add(rat, dests[d], XB_ADDR16_UNKNOWN, "AC", NULL, 0, 0, NULL) < 0)) {
+			goto out;
+		}
+	}
+	if (xb_rat_run(rat, -1) < 0) {
+		goto out;
+	}
+
+	/* nothing sticks on a node that did not take WR and AC */
+	for(i = 0; i < rat->count; i++) {
+		req = &rat->reqs[i];
+		if (req->cookie || req->status == XB_AT_STATUS_OK) {
+			continue;
+		}
+		for(d = 0; d < ndests && dests[d] != req->dest64; d++)
+			;
+		if (d < ndests) {
+			failed[d] = 1;
+			any_failed = 1;
+		}
+	}
+
+	for(i = 0, changed = 0; i < rat->count; i++) {
+		req = &rat->reqs[i];
+		if (!req->cookie) {
+			continue;
+		}
+		d = (unsigned int)(((struct xb_profile_entry *)req->cookie - was) / count);
+		e = (unsigned int)(((struct xb_profile_entry *)req->cookie - was) % count);
+		ok = req->status == XB_AT_STATUS_OK && !failed[d];
+		if (ok) {
+			changed++;
+		}
+		if (cb) {
+			cb(xctx, req->dest64, &prof->entries[e],
+					((struct xb_profile_entry *)req->cookie)->cmd[0] ? req->cookie : NULL,
+					ok ? 0 : -1, arg);
+		}
+	}
+	if (any_failed) {
+		changed = -1;
+	}
+
+out:
+	free(failed);
+	free(was);
+	if (rat) {
+		xb_rat_free(rat);
+	}
+	return changed;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_PROFILE_H
+#define XB_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+#define XB_PROFILE_STR_MAX			32
+/* reads and writes in flight at once on the local radio */
+#define XB_PROFILE_PIPELINE			16
+
+/* a register and the value it should have, or had */
+struct xb_profile_entry {
+	char cmd[2];
+	int is_string;
+	uint64_t value;
+	char str[XB_PROFILE_STR_MAX + 1];
+};
+
+struct xb_profile {
+	struct xb_profile_entry *entries;
+	unsigned int count, max;
+};
+
+/*
+ * told about every register that differed on a node (XB_ADDR64_UNKNOWN
+ * for the local radio): what it was, NULL if it could not be read, and
+ * whether writing it worked
+ */
+typedef void (*xb_profile_cb)(struct xb_ctx *, uint64_t,
+		const struct xb_profile_entry *, const struct xb_profile_entry *,
+		int, void *);
+
+struct xb_profile *xb_profile_new();
+void xb_profile_free(struct xb_profile *);
+int xb_profile_add(struct xb_profile *, char[2], uint64_t);
+int xb_profile_add_string(struct xb_profile *, char[2], const char *);
+struct xb_profile *xb_profile_load(const char *);
+
+int xb_profile_apply(struct xb_ctx *, struct xb_profile *, xb_profile_cb, void *);
+int xb_profile_apply_remote(struct xb_ctx *, struct xb_profile *, const uint64_t *,
+		unsigned int, xb_profile_cb, void *);
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_addr.h"
+#include "xb_ctx.h"
+#include "xb_rat.h"
+#include "xb_tx.h"
+
+/*
+ * run up to per_node commands at once on any one node and max_inflight
+ * overall; 0 picks the defaults
+ */
+struct xb_rat *
+xb_rat_new(struct xb_ctx *xctx, unsigned int per_node, unsigned int max_inflight) {
+	struct xb_rat *rat;
+
+	rat = (struct xb_rat *)calloc(1, sizeof(struct xb_rat));
+	if (!rat) {
+		return NULL;
+	}
+
+	rat->xctx = xctx;
+	rat->per_node = per_node ? per_node : XB_RAT_PER_NODE_DEFAULT;
+	rat->max_inflight = max_inflight ? max_inflight : XB_RAT_INFLIGHT_DEFAULT;
+	/* frame ID 0 asks for no response */
+	if (rat->max_inflight > 255) {
+		rat->max_inflight = 255;
+	}
+	rat->retries = XB_RAT_RETRIES;
+	rat->timeout = XB_RAT_TIMEOUT_MS;
+	memset(rat->by_id, 0xff, sizeof(rat->by_id));
+
+	return rat;
+}
+
+void
+xb_rat_free(struct xb_rat *rat) {
+	free(rat->reqs);
+	free(rat->nodes);
+	free(rat);
+}
+
+void
+xb_rat_set_cb(struct xb_rat *rat, xb_rat_cb cb, void *arg) {
+	rat->cb = cb;
+	rat->cb_arg = arg;
+}
+
+/*
+ * a 0x17 remote AT command request; the frame ID is filled in when it is
+ * sent
+ */
+struct xb_buffer *
+xb_create_remote_at_cmd(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		char at_cmd[2], const uint8_t *param, uint8_t len, uint8_t options) {
+	struct xb_buffer *xbuf;
+	int ret;
+
+	if (dest16 == XB_ADDR16_UNKNOWN && xctx->addr) {
+		dest16 = xb_addr_lookup(xctx, dest64);
+	}
+
+	xbuf = xb_buffer_new();
+	if (!xbuf) {
+		return NULL;
+	}
+
+	ret = xb_buffer_put_uint8(xbuf, XB_FRAME_TYPE_REMOTE_AT_CMD);
+	ret |= xb_buffer_put_uint8(xbuf, 0);
+	ret |= xb_buffer_put_uint64(xbuf, dest64);
+	ret |= xb_buffer_put_uint16(xbuf, dest16);
+	ret |= xb_buffer_put_uint8(xbuf, options);
+	ret |= xb_buffer_put_at_cmd(xbuf, at_cmd);
+	if (len) {
+		ret |= xb_buffer_put_data(xbuf, (const char *)param, len);
+	}
+
+	if (ret < 0) {
+		xb_buffer_free(xbuf);
+		return NULL;
+	}
+
+	return xbuf;
+}
+
+static int
+xb_rat_node(struct xb_rat *rat, uint64_t dest64) {
+	struct xb_rat_node *nodes;
+	unsigned int i, max;
+
+	for(i = 0; i < rat->nnodes; i++) {
+		if (rat->nodes[i].dest64 == dest64) {
+			return (int)i;
+		}
+	}
+
+	if (rat->nnodes == rat->maxnodes) {
+		max = rat->maxnodes ? rat->maxnodes * 2 : 64;
+		nodes = (struct xb_rat_node *)realloc(rat->nodes, max * sizeof(*nodes));
+		if (!nodes) {
+			return -1;
+		}
+		rat->nodes = nodes;
+		rat->maxnodes = max;
+	}
+
+	rat->nodes[rat->nnodes].dest64 = dest64;
+	rat->nodes[rat->nnodes].inflight = 0;
+
+	return (int)rat->nnodes++;
+}
+
+/*
+ * queue a command; commands for the same node run in the order they
+ * were added.  Returns the request's index in rat->reqs.
+ */
+int
+xb_rat_add(struct xb_rat *rat, uint64_t dest64, uint16_t dest16, char at_cmd[2],
+		const uint8_t *param, uint8_t len, uint8_t options, void *cookie) {
+	struct xb_rat_req *req, *reqs;
+	unsigned int max;
+	int node;
+
+	if (len > XB_RAT_PARAM_MAX || (node = xb_rat_node(rat, dest64)) < 0) {
+		return -1;
+	}
+
+	if (rat->count == rat->max) {
+		max = rat->max ? rat->max * 2 : 64;
+		reqs = (struct xb_rat_req *)realloc(rat->reqs, max * sizeof(*reqs));
+		if (!reqs) {
+			return -1;
+		}
+		rat->reqs = reqs;
+		rat->max = max;
+	}
+
+	req = &rat->reqs[rat->count];
+	memset(req, 0, sizeof(*req));
+	req->dest64 = dest64;
+	req->dest16 = dest16;
+	req->cmd[0] = at_cmd[0];
+	req->cmd[1] = at_cmd[1];
+	req->options = options;
+	memcpy(req->param, param, len);
+	req->param_len = len;
+	req->cookie = cookie;
+	req->node = (unsigned int)node;
+
+	return (int)rat->count++;
+}
+
+static int
+xb_rat_send(struct xb_rat *rat, struct xb_rat_req *req) {
+	struct xb_ctx *xctx = rat->xctx;
+	struct xb_buffer *xbuf;
+	uint8_t frame_id;
+	int i, ret;
+
+	/* skip IDs still waiting on an earlier command */
+	for(i = 0; i < 255; i++) {
+		frame_id = xb_next_frame_id(xctx);
+		if (rat->by_id[frame_id] < 0) {
+			break;
+		}
+	}
+
+	xbuf = xb_create_remote_at_cmd(xctx, req->dest64, req->dest16, req->cmd,
+			req->param, req->param_len, req->options);
+	if (!xbuf) {
+		return -1;
+	}
+	xb_buffer_set_frame_id(xbuf, frame_id);
+	ret = xb_buffer_set_uint8(xbuf, 1, frame_id);
+	if (ret >= 0) {
+		ret = xb_send(xctx, xbuf);
+	}
+	xb_buffer_free(xbuf);
+	if (ret < 0) {
+		return -1;
+	}
+
+	req->state = XB_RAT_SENT;
+	req->frame_id = frame_id;
+	req->sent = xb_time_us();
+	req->attempts++;
+	rat->by_id[frame_id] = (int)(req - rat->reqs);
+	rat->nodes[req->node].inflight++;
+	rat->inflight++;
+
+	return 0;
+}
+
+/*
+ * take a request out of flight, either for good or to go again
+ */
+static void
+xb_rat_finish(struct xb_rat *rat, struct xb_rat_req *req, uint8_t status) {
+	unsigned int idx = (unsigned int)(req - rat->reqs);
+
+	rat->by_id[req->frame_id] = -1;
+	rat->nodes[req->node].inflight--;
+	rat->inflight--;
+
+	if ((status == XB_RAT_STATUS_TX_FAILURE || status == XB_RAT_STATUS_TIMEOUT) &&
+			req->attempts <= (int)rat->retries) {
+		req->state = XB_RAT_PENDING;
+		if (idx < rat->first_pending) {
+			rat->first_pending = idx;
+		}
+		return;
+	}
+
+	req->state = XB_RAT_DONE;
+	req->status = status;
+	rat->done++;
+
+	if (rat->cb) {
+		rat->cb(rat, req, rat->cb_arg);
+	}
+}
+
+/*
+ * send whatever the concurrency limits allow, oldest first
+ */
+static int
+xb_rat_fill(struct xb_rat *rat) {
+	struct xb_rat_req *req;
+	unsigned int i;
+	int pending = 0;
+
+	for(i = rat->first_pending; i < rat->count && rat->inflight < rat->max_inflight; i++) {
+		req = &rat->reqs[i];
+		if (req->state != XB_RAT_PENDING) {
+			if (!pending && req->state == XB_RAT_DONE) {
+				rat->first_pending = i + 1;
+			}
+			continue;
+		}
+		pending = 1;
+
+		if (rat->nodes[req->node].inflight >= rat->per_node) {
+			continue;
+		}
+		if (xb_rat_send(rat, req) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+xb_rat_response(struct xb_rat *rat, struct xb_frame *frame) {
+	struct xb_rat_req *req;
+	uint64_t src64;
+	uint16_t len;
+	int idx, i;
+
+	/* 0x97, frame id, source 64, source 16, command, status, value */
+	if (frame->len < 15 || (idx = rat->by_id[frame->data[1]]) < 0) {
+		return;
+	}
+	req = &rat->reqs[idx];
+
+	for(src64 = 0, i = 2; i < 10; i++) {
+		src64 = (src64 << 8) | frame->data[i];
+	}
+	if (src64 != req->dest64 || frame->data[12] != (uint8_t)req->cmd[0] ||
+			frame->data[13] != (uint8_t)req->cmd[1]) {
+		return;
+	}
+
+	len = (uint16_t)(frame->len - 15);
+	if (len > XB_RAT_VALUE_MAX) {
+		len = XB_RAT_VALUE_MAX;
+	}
+	memcpy(req->value, frame->data + 15, len);
+	req->value_len = (uint8_t)len;
+
+	xb_rat_finish(rat, req, frame->data[14]);
+}
+
+/*
+ * retry or give up on commands nobody answered; returns ms until the
+ * next one is due, -1 if nothing is in flight
+ */
+static int
+xb_rat_expire(struct xb_rat *rat) {
+	struct xb_rat_req *req;
+	uint64_t now, due, next = 0;
+	int i;
+
+	now = xb_time_us();
+	for(i = 0; i < 256; i++) {
+		if (rat->by_id[i] < 0) {
+			continue;
+		}
+		req = &rat->reqs[rat->by_id[i]];
+		due = req->sent + (uint64_t)rat->timeout * 1000;
+		if (now >= due) {
+			xb_rat_finish(rat, req, XB_RAT_STATUS_TIMEOUT);
+		}
+		else if (!next || due < next) {
+			next = due;
+		}
+	}
+
+	return next ? (int)((next - now + 999) / 1000) : -1;
+}
+
+/*
+ * work through the queued commands, handling other frames meanwhile;
+ * returns the number finished, whatever their status
+ */
+int
+xb_rat_run(struct xb_rat *rat, int timeout) {
+	struct xb_ctx *xctx = rat->xctx;
+	struct xb_frame frame;
+	uint64_t deadline;
+	int ret, wait, due;
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	for(;;) {
+		due = xb_rat_expire(rat);
+		if (xb_rat_fill(rat) < 0) {
+			return -1;
+		}
+		if (rat->done == rat->count || (wait = xb_remaining(timeout, deadline)) == 0) {
+			return (int)rat->done;
+		}
+		if (due < 0) {
+			due = (int)rat->timeout;
+		}
+		if (wait < 0 || wait > due) {
+			wait = due;
+		}
+
+		if ( (ret = xb_read_frame(xctx, &frame, wait)) < 0) {
+			return -1;
+		}
+		if (!ret) {
+			continue;
+		}
+
+		if (frame.data[0] == XB_FRAME_TYPE_REMOTE_AT_RESPONSE) {
+			xb_rat_response(rat, &frame);
+		}
+		else {
+			xb_dispatch_frame(xctx, &frame);
+		}
+	}
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_RAT_H
+#define XB_RAT_H
+
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+/* remote AT command options */
+#define XB_RAT_OPT_APPLY			0x02
+
+/* remote AT statuses beyond the local ones */
+#define XB_RAT_STATUS_TX_FAILURE		0x04
+/* ours: no answer after every retry */
+#define XB_RAT_STATUS_TIMEOUT			0xff
+
+#define XB_RAT_PARAM_MAX			32
+#define XB_RAT_VALUE_MAX			64
+
+/*
+ * remote nodes work through commands one at a time and the local radio
+ * only buffers so many frames
+ */
+#define XB_RAT_PER_NODE_DEFAULT			1
+#define XB_RAT_INFLIGHT_DEFAULT			32
+#define XB_RAT_TIMEOUT_MS			5000
+#define XB_RAT_RETRIES				2
+
+enum xb_rat_state {
+	XB_RAT_PENDING = 0,
+	XB_RAT_SENT,
+	XB_RAT_DONE,
+};
+
+struct xb_rat_req {
+	uint64_t dest64;
+	uint16_t dest16;
+	char cmd[2];
+	uint8_t options;
+	uint8_t param[XB_RAT_PARAM_MAX];
+	uint8_t param_len;
+	void *cookie;
+
+	enum xb_rat_state state;
+	int attempts;
+	uint8_t frame_id;
+	unsigned int node;
+	uint64_t sent;
+
+	/* the outcome */
+	uint8_t status;
+	uint8_t value[XB_RAT_VALUE_MAX];
+	uint8_t value_len;
+};
+
+struct xb_rat_node {
+	uint64_t dest64;
+	unsigned int inflight;
+};
+
+struct xb_rat;
+typedef void (*xb_rat_cb)(struct xb_rat *, struct xb_rat_req *, void *);
+
+struct xb_rat {
+	struct xb_ctx *xctx;
+	unsigned int per_node, max_inflight, inflight, retries;
+	uint32_t timeout;
+
+	struct xb_rat_req *reqs;
+	unsigned int count, max, done, first_pending;
+
+	struct xb_rat_node *nodes;
+	unsigned int nnodes, maxnodes;
+
+	/* request index by frame ID, -1 if none */
+	int by_id[256];
+
+	xb_rat_cb cb;
+	void *cb_arg;
+};
+
+struct xb_rat *xb_rat_new(struct xb_ctx *, unsigned int, unsigned int);
+void xb_rat_free(struct xb_rat *);
+void xb_rat_set_cb(struct xb_rat *, xb_rat_cb, void *);
+
+struct xb_buffer *xb_create_remote_at_cmd(struct xb_ctx *, uint64_t, uint16_t,
+		char[2], const uint8_t *, uint8_t, uint8_t);
+
+int xb_rat_add(struct xb_rat *, uint64_t, uint16_t, char[2],
+		const uint8_t *, uint8_t, uint8_t, void *);
+int xb_rat_run(struct xb_rat *, int);
+
+#endif
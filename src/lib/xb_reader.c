@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xb_capture.h"
+#include "xb_ctx.h"
+#include "xb_reader.h"
+#include "xb_stats.h"
+#include "xb_trace.h"
+
+static int
+xb_reader_pipe(int fds[2]) {
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+			fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+xb_reader_drain(int fd) {
+	char junk[64];
+
+	while (read(fd, junk, sizeof(junk)) > 0)
+		;
+}
+
+/*
+ * producer side; only the reader thread calls these
+ */
+static int
+xb_reader_full(struct xb_reader *rd) {
+	return atomic_load_explicit(&rd->head, memory_order_relaxed) -
+			atomic_load(&rd->tail) > rd->mask;
+}
+
+static int
+xb_reader_put(struct xb_reader *rd, const struct xb_frame *frame) {
+	size_t head;
+
+	if (xb_reader_full(rd)) {
+		return 0;
+	}
+
+	head = atomic_load_explicit(&rd->head, memory_order_relaxed);
+	rd->frames[head & rd->mask].len = frame->len;
+	memcpy(rd->frames[head & rd->mask].data, frame->data, frame->len);
+	atomic_store_explicit(&rd->head, head + 1, memory_order_release);
+
+	return 1;
+}
+
+/*
+ * decode what is left of the last read; returns the number of frames
+ * queued, or -1 with the rest kept back if the queue filled up
+ */
+static int
+xb_reader_decode(struct xb_reader *rd) {
+	size_t used;
+	int done, n = 0;
+
+	if (rd->held) {
+		if (!xb_reader_put(rd, &rd->decoder.frame)) {
+			return -1;
+		}
+		rd->held = 0;
+		n++;
+	}
+	while (rd->off < rd->len) {
+		used = xb_decoder_feed(&rd->decoder, rd->buf + rd->off, rd->len - rd->off, &done);
+		rd->off += used;
+		if (done) {
+			if (!xb_reader_put(rd, &rd->decoder.frame)) {
+				rd->held = 1;
+				return -1;
+			}
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * consumer side
+ */
+static int
+xb_reader_pop(struct xb_reader *rd, struct xb_frame *frame) {
+	struct xb_frame *slot;
+	size_t head, tail;
+	char c = 0;
+
+	tail = atomic_load_explicit(&rd->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&rd->head, memory_order_acquire);
+	if (tail == head) {
+		return 0;
+	}
+
+	slot = &rd->frames[tail & rd->mask];
+	frame->len = slot->len;
+	memcpy(frame->data, slot->data, slot->len);
+	/* pairs with the producer's store of blocked and load of tail */
+	atomic_store(&rd->tail, tail + 1);
+	if (atomic_load(&rd->blocked) && write(rd->space[1], &c, 1) < 0) {
+		/* a full pipe has already woken it */
+	}
+
+	return 1;
+}
+
+/*
+ * the context may have read bytes it has not decoded yet; they become
+ * the thread's first read (rxbuf is never bigger than XB_READER_BUF)
+ */
+static void
+xb_reader_take_buffered(struct xb_reader *rd, struct xb_ctx *xctx) {
+	struct buffer *rx = xctx->rxbuf;
+	size_t len = rx->writepos - rx->readpos;
+
+	rd->decoder = xctx->decoder;
+	if (len > sizeof(rd->buf)) {
+		len = sizeof(rd->buf);
+	}
+	memcpy(rd->buf, rx->data + rx->readpos, len);
+	rd->off = 0;
+	rd->len = len;
+	rx->readpos += len;
+}
+
+static void *
+xb_reader_main(void *arg) {
+	struct xb_reader *rd = (struct xb_reader *)arg;
+	struct pollfd pfds[2];
+	ssize_t ret;
+	int n;
+	char c = 0;
+
+	pfds[0].events = POLLIN;
+	pfds[1].fd = rd->stop[0];
+	pfds[1].events = POLLIN;
+
+	for(;;) {
+		/* a full pipe already means "look at the queue" */
+		if ( (n = xb_reader_decode(rd)) != 0 &&
+				write(rd->wake[1], &c, 1) < 0 && errno != EAGAIN) {
+			break;
+		}
+
+		/*
+		 * with the queue full leave the radio's bytes in the tty until
+		 * the consumer makes room; the flag goes up before the last look
+		 * so a pop in between is not missed
+		 */
+		if (n < 0) {
+			atomic_store(&rd->blocked, 1);
+			if (!xb_reader_full(rd)) {
+				atomic_store(&rd->blocked, 0);
+				continue;
+			}
+			atomic_fetch_add_explicit(&rd->stalls, 1, memory_order_relaxed);
+			pfds[0].fd = rd->space[0];
+		} else {
+			pfds[0].fd = rd->xbfd;
+		}
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pfds[1].revents) {
+			return NULL;
+		}
+		if (n < 0) {
+			xb_reader_drain(rd->space[0]);
+			atomic_store(&rd->blocked, 0);
+			continue;
+		}
+		if (!pfds[0].revents) {
+			continue;
+		}
+
+		if ( (ret = read(rd->xbfd, rd->buf, sizeof(rd->buf))) <= 0) {
+			if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			if (ret == 0) {
+				errno = EIO;
+			}
+			XB_TRACE_FAIL(rd->decoder.trace_id, XB_EV_IO_ERROR, errno, 0);
+			break;
+		}
+
+		if (rd->capture) {
+			xb_capture_write(rd->capture, XB_CAPTURE_RX, rd->buf, (size_t)ret);
+		}
+		if (rd->stats) {
+			xb_stats_add(rd->stats->rx_bytes, (unsigned long)ret);
+		}
+		XB_TRACE_FRAME(rd->decoder.trace_id, XB_EV_READ, ret, 0);
+
+		rd->off = 0;
+		rd->len = (size_t)ret;
+	}
+
+	atomic_store(&rd->error, errno ? errno : EIO);
+	if (write(rd->wake[1], &c, 1) < 0) {
+		/* nothing left to tell anyone */
+	}
+
+	return NULL;
+}
+
+/*
+ * have a thread read and decode everything the radio sends, queueing up
+ * to nframes (rounded up to a power of two) until the application asks
+ * for them; API modes only
+ */
+int
+xb_reader_start(struct xb_ctx *xctx, size_t nframes) {
+	struct xb_reader *rd;
+	size_t n;
+	int ret;
+
+	if (xctx->reader) {
+		return 0;
+	}
+	if (xctx->api_mode != XB_API && xctx->api_mode != XB_API_ESC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for(n = 1; n < (nframes ? nframes : XB_READER_FRAMES_DEFAULT); n <<= 1)
+		;
+
+	if ( (rd = (struct xb_reader *)aligned_alloc(XB_CACHE_LINE, sizeof(struct xb_reader))) == NULL) {
+		return -1;
+	}
+	memset(rd, 0, sizeof(*rd));
+	if ( (rd->frames = (struct xb_frame *)malloc(n * sizeof(struct xb_frame))) == NULL) {
+		free(rd);
+		return -1;
+	}
+	rd->mask = n - 1;
+	rd->xbfd = xctx->xbfd;
+	rd->capture = xctx->capture;
+	rd->stats = xctx->stats;
+	atomic_init(&rd->head, 0);
+	atomic_init(&rd->tail, 0);
+	atomic_init(&rd->stalls, 0);
+	atomic_init(&rd->blocked, 0);
+	atomic_init(&rd->error, 0);
+
+	if (xb_reader_pipe(rd->wake) < 0) {
+		goto error;
+	}
+	if (xb_reader_pipe(rd->stop) < 0) {
+		close(rd->wake[0]);
+		close(rd->wake[1]);
+		goto error;
+	}
+	if (xb_reader_pipe(rd->space) < 0) {
+		close(rd->wake[0]);
+		close(rd->wake[1]);
+		close(rd->stop[0]);
+		close(rd->stop[1]);
+		goto error;
+	}
+
+	xb_reader_take_buffered(rd, xctx);
+
+	if ( (ret = pthread_create(&rd->thread, NULL, xb_reader_main, rd)) != 0) {
+		close(rd->wake[0]);
+		close(rd->wake[1]);
+		close(rd->stop[0]);
+		close(rd->stop[1]);
+		close(rd->space[0]);
+		close(rd->space[1]);
+		errno = ret;
+		goto error;
+	}
+
+	xctx->reader = rd;
+
+	return 0;
+
+error:
+	free(rd->frames);
+	free(rd);
+	return -1;
+}
+
+/*
+ * stop the thread; frames it queued that nobody took are discarded
+ */
+void
+xb_reader_stop(struct xb_ctx *xctx) {
+	struct xb_reader *rd = xctx->reader;
+	char c = 0;
+
+	if (!rd) {
+		return;
+	}
+
+	if (write(rd->stop[1], &c, 1) < 0) {
+		/* the pipe is empty, so this cannot fail */
+	}
+	pthread_join(rd->thread, NULL);
+
+	close(rd->wake[0]);
+	close(rd->wake[1]);
+	close(rd->stop[0]);
+	close(rd->stop[1]);
+	close(rd->space[0]);
+	close(rd->space[1]);
+	free(rd->frames);
+	free(rd);
+	xctx->reader = NULL;
+}
+
+/*
+ * readable whenever the queue may have frames, for the application's
+ * own poll loop; -1 without a reader thread
+ */
+int
+xb_reader_fd(struct xb_ctx *xctx) {
+	return xctx->reader ? xctx->reader->wake[0] : -1;
+}
+
+/*
+ * consumer side: take the next frame, waiting at most timeout ms;
+ * returns 1 with a frame, 0 on timeout, -1 once the thread has died
+ * and the queue is empty
+ */
+int
+xb_reader_get(struct xb_ctx *xctx, struct xb_frame *frame, int timeout) {
+	struct xb_reader *rd = xctx->reader;
+	struct pollfd pfd;
+	uint64_t deadline;
+	int ret, wait;
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	pfd.fd = rd->wake[0];
+	pfd.events = POLLIN;
+
+	for(;;) {
+		if (xb_reader_pop(rd, frame)) {
+			return 1;
+		}
+		/* clear the wakeup before looking again, so none is missed */
+		xb_reader_drain(rd->wake[0]);
+		if (xb_reader_pop(rd, frame)) {
+			return 1;
+		}
+
+		if ( (ret = atomic_load(&rd->error)) != 0) {
+			errno = ret;
+			return -1;
+		}
+		if ( (wait = xb_remaining(timeout, deadline)) == 0) {
+			return 0;
+		}
+
+		do {
+			ret = poll(&pfd, 1, wait);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			return -1;
+		}
+	}
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_READER_H
+#define XB_READER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+#include "xb_frame.h"
+
+/*
+ * a thread that keeps the serial port drained while the application is
+ * busy; it decodes frames into a single-producer/single-consumer queue
+ * that xb_read_frame() then takes them from. When the queue is full the
+ * thread stops reading until the application catches up, so the tty
+ * buffer and RTS/CTS hold the radio back instead of frames being lost
+ */
+#define XB_READER_FRAMES_DEFAULT		1024
+#define XB_READER_BUF				1024
+
+/* keep the two ends of the queue out of each other's cache line */
+#define XB_CACHE_LINE				64
+
+struct xb_reader {
+	pthread_t thread;
+	struct xb_decoder decoder;
+	int xbfd;
+	struct xb_capture *capture;
+	struct xb_stats *stats;
+	/* producer to consumer wakeup, stop request and "room again" */
+	int wake[2], stop[2], space[2];
+
+	/* bytes read but not decoded yet, and a decoded frame not queued */
+	uint8_t buf[XB_READER_BUF];
+	size_t off, len;
+	int held;
+
+	struct xb_frame *frames;
+	size_t mask;
+
+	_Alignas(XB_CACHE_LINE) atomic_size_t head;
+	_Alignas(XB_CACHE_LINE) atomic_size_t tail;
+
+	/* times the queue filled up, whether the thread is waiting for
+	 * room, and why it gave up (0 if not) */
+	atomic_ulong stalls;
+	atomic_int blocked;
+	atomic_int error;
+};
+
+int xb_reader_start(struct xb_ctx *, size_t);
+void xb_reader_stop(struct xb_ctx *);
+int xb_reader_fd(struct xb_ctx *);
+int xb_reader_get(struct xb_ctx *, struct xb_frame *, int);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xb_ctx.h"
+#include "xb_ring.h"
+
+static size_t
+xb_ring_size(unsigned int nslots) {
+	return sizeof(struct xb_ring_hdr) + (size_t)nslots * sizeof(struct xb_ring_slot);
+}
+
+static void
+xb_ring_free(struct xb_ring *ring) {
+	munmap(ring->hdr, ring->size);
+	free(ring->name);
+	free(ring);
+}
+
+/*
+ * publish every frame xctx decodes in the shared memory object name
+ * ("/something"); nslots is rounded up to a power of two
+ */
+int
+xb_ring_create(struct xb_ctx *xctx, const char *name, unsigned int nslots) {
+	struct xb_ring *ring, *old;
+	unsigned int n;
+	int fd;
+
+	for(n = 1; n < (nslots ? nslots : XB_RING_SLOTS_DEFAULT); n <<= 1)
+		;
+
+	if ( (ring = (struct xb_ring *)calloc(1, sizeof(struct xb_ring))) == NULL) {
+		return -1;
+	}
+	if ( (ring->name = strdup(name)) == NULL) {
+		goto error;
+	}
+	ring->size = xb_ring_size(n);
+
+	/*
+	 * never resize an object readers may still have mapped (they would
+	 * fault past its new end): unlink it and start a fresh one, the old
+	 * mapping stays valid until they let go of it
+	 */
+	shm_unlink(name);
+	if ( (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+		goto error;
+	}
+	if (ftruncate(fd, (off_t)ring->size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		goto error;
+	}
+	ring->hdr = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->hdr == MAP_FAILED) {
+		shm_unlink(name);
+		goto error;
+	}
+
+	/* readers check the magic last */
+	ring->hdr->version = XB_RING_VERSION;
+	ring->hdr->nslots = n;
+	ring->hdr->slot_size = sizeof(struct xb_ring_slot);
+	atomic_store(&ring->hdr->head, 0);
+	atomic_thread_fence(memory_order_release);
+	memcpy(ring->hdr->magic, XB_RING_MAGIC, 4);
+
+	/* a previous ring under the same name was unlinked above already */
+	if ( (old = xctx->ring) != NULL) {
+		if (strcmp(old->name, name) != 0) {
+			shm_unlink(old->name);
+		}
+		xb_ring_free(old);
+	}
+	xctx->ring = ring;
+
+	return 0;
+
+error:
+	free(ring->name);
+	free(ring);
+	return -1;
+}
+
+void
+xb_ring_destroy(struct xb_ctx *xctx) {
+	struct xb_ring *ring = xctx->ring;
+
+	if (!ring) {
+		return;
+	}
+
+	shm_unlink(ring->name);
+	xb_ring_free(ring);
+	xctx->ring = NULL;
+}
+
+void
+xb_ring_put(struct xb_ring *ring, const struct xb_frame *frame) {
+	struct xb_ring_hdr *hdr = ring->hdr;
+	struct xb_ring_slot *slot;
+	uint64_t seq;
+
+	seq = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	slot = &hdr->slots[seq & (hdr->nslots - 1)];
+
+	atomic_store_explicit(&slot->seq, seq * 2 + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->time_us = xb_time_us();
+	slot->len = frame->len;
+	memcpy(slot->data, frame->data, frame->len);
+
+	atomic_store_explicit(&slot->seq, seq * 2 + 2, memory_order_release);
+	atomic_store_explicit(&hdr->head, seq + 1, memory_order_release);
+}
+
+/*
+ * attach to a ring as a reader, starting with the next frame published
+ */
+struct xb_ring *
+xb_ring_open(const char *name) {
+	struct xb_ring *ring;
+	struct stat st;
+	int fd;
+
+	if ( (fd = shm_open(name, O_RDONLY, 0)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct xb_ring_hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	if ( (ring = (struct xb_ring *)calloc(1, sizeof(struct xb_ring))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	ring->size = (size_t)st.st_size;
+	ring->hdr = mmap(NULL, ring->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->hdr == MAP_FAILED) {
+		free(ring);
+		return NULL;
+	}
+
+	if (memcmp(ring->hdr->magic, XB_RING_MAGIC, 4) ||
+			ring->hdr->version != XB_RING_VERSION ||
+			ring->hdr->slot_size != sizeof(struct xb_ring_slot) ||
+			ring->size < xb_ring_size(ring->hdr->nslots)) {
+		xb_ring_close(ring);
+		return NULL;
+	}
+
+	ring->next = atomic_load_explicit(&ring->hdr->head, memory_order_acquire);
+
+	return ring;
+}
+
+/*
+ * copy out the next frame; returns 1 with a frame, 0 if there is none
+ * yet.  Frames the producer overwrote before we got to them are added
+ * to *lost.
+ */
+int
+xb_ring_read(struct xb_ring *ring, struct xb_frame *frame, uint64_t *time_us, uint64_t *lost) {
+	struct xb_ring_hdr *hdr = ring->hdr;
+	struct xb_ring_slot *slot;
+	uint64_t head, s1, s2;
+
+	for(;;) {
+		head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+		if (ring->next >= head) {
+			return 0;
+		}
+		if (head - ring->next > hdr->nslots) {
+			*lost += head - ring->next - hdr->nslots;
+			ring->next = head - hdr->nslots;
+		}
+
+		slot = &hdr->slots[ring->next & (hdr->nslots - 1)];
+		s1 = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (s1 == ring->next * 2 + 2) {
+			frame->len = slot->len;
+			if (frame->len > XB_FRAME_MAX) {
+				frame->len = XB_FRAME_MAX;
+			}
+			memcpy(frame->data, slot->data, frame->len);
+			if (time_us) {
+				*time_us = slot->time_us;
+			}
+			atomic_thread_fence(memory_order_acquire);
+			s2 = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+			if (s1 == s2) {
+				ring->next++;
+				return 1;
+			}
+		}
+
+		/* lapped while we looked */
+		(*lost)++;
+		ring->next++;
+	}
+}
+
+void
+xb_ring_close(struct xb_ring *ring) {
+	munmap(ring->hdr, ring->size);
+	free(ring);
+}
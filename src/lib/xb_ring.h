@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_RING_H
+#define XB_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+#include "xb_frame.h"
+
+/*
+ * received frames published once into shared memory: one producer (the
+ * decoder in xb_read_frame) and any number of readers that never hold
+ * it up.  Each slot carries a sequence word that is odd while the slot
+ * is being written, so readers can tell when they have been lapped.
+ */
+#define XB_RING_MAGIC				"XBRG"
+#define XB_RING_VERSION				1
+#define XB_RING_SLOTS_DEFAULT			1024
+
+struct xb_ring_slot {
+	atomic_uint_least64_t seq;
+	uint64_t time_us;
+	uint16_t len;
+	uint8_t data[XB_FRAME_MAX];
+};
+
+struct xb_ring_hdr {
+	char magic[4];
+	uint32_t version;
+	uint32_t nslots, slot_size;
+	/* sequence number of the next frame to be written */
+	atomic_uint_least64_t head;
+	struct xb_ring_slot slots[];
+};
+
+struct xb_ring {
+	struct xb_ring_hdr *hdr;
+	size_t size;
+	char *name;
+	/* readers: the next frame wanted */
+	uint64_t next;
+};
+
+int xb_ring_create(struct xb_ctx *, const char *, unsigned int);
+void xb_ring_destroy(struct xb_ctx *);
+void xb_ring_put(struct xb_ring *, const struct xb_frame *);
+
+struct xb_ring *xb_ring_open(const char *);
+int xb_ring_read(struct xb_ring *, struct xb_frame *, uint64_t *, uint64_t *);
+void xb_ring_close(struct xb_ring *);
+
+#endif
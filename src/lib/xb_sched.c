@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_sched.h"
+#include "xb_tx.h"
+
+int
+xb_sched_init(struct xb_ctx *xctx) {
+	struct xb_sched *sched;
+
+	sched = (struct xb_sched *)calloc(1, sizeof(struct xb_sched));
+	if (!sched) {
+		return -1;
+	}
+	if (pthread_mutex_init(&sched->lock, NULL) != 0) {
+		free(sched);
+		return -1;
+	}
+
+	sched->bound[XB_CLASS_CONTROL] = XB_SCHED_BOUND_CONTROL;
+	sched->bound[XB_CLASS_ALARM] = XB_SCHED_BOUND_ALARM;
+	sched->bound[XB_CLASS_NORMAL] = XB_SCHED_BOUND_NORMAL;
+	sched->bound[XB_CLASS_BULK] = XB_SCHED_BOUND_BULK;
+
+	xb_sched_free(xctx);
+	xctx->sched = sched;
+
+	return 0;
+}
+
+void
+xb_sched_free(struct xb_ctx *xctx) {
+	struct xb_sched *sched = xctx->sched;
+	struct xb_sched_item *item, *next;
+	int c;
+
+	if (!sched) {
+		return;
+	}
+
+	for(c = 0; c < XB_CLASS_COUNT; c++) {
+		for(item = sched->head[c]; item; item = next) {
+			next = item->next;
+			xb_buffer_free(item->xbuf);
+			free(item);
+		}
+	}
+
+	pthread_mutex_destroy(&sched->lock);
+	free(sched->rates);
+	free(sched);
+	xctx->sched = NULL;
+}
+
+void
+xb_sched_set_bound(struct xb_ctx *xctx, enum xb_tx_class class, uint32_t bound) {
+	if (xctx->sched && class < XB_CLASS_COUNT) {
+		pthread_mutex_lock(&xctx->sched->lock);
+		xctx->sched->bound[class] = bound;
+		pthread_mutex_unlock(&xctx->sched->lock);
+	}
+}
+
+static struct xb_sched_rate *
+xb_sched_find_rate(struct xb_sched *sched, uint64_t dest64) {
+	unsigned int i;
+
+	for(i = 0; i < sched->nrates; i++) {
+		if (sched->rates[i].dest64 == dest64) {
+			return &sched->rates[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * limit dest64 to rate frames/s with bursts of up to burst frames; a rate
+ * of 0 removes the limit
+ */
+int
+xb_sched_set_rate(struct xb_ctx *xctx, uint64_t dest64, double rate, double burst) {
+	struct xb_sched *sched = xctx->sched;
+	struct xb_sched_rate *r, *rates;
+	int ret = 0;
+
+	if (!sched) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&sched->lock);
+	if ( (r = xb_sched_find_rate(sched, dest64)) == NULL) {
+		if (rate <= 0) {
+			goto out;
+		}
+		rates = (struct xb_sched_rate *)realloc(sched->rates,
+				(sched->nrates + 1) * sizeof(struct xb_sched_rate));
+		if (!rates) {
+			ret = -1;
+			goto out;
+		}
+		sched->rates = rates;
+		r = &sched->rates[sched->nrates++];
+		r->dest64 = dest64;
+	}
+	else if (rate <= 0) {
+		*r = sched->rates[--sched->nrates];
+		goto out;
+	}
+
+	r->rate = rate;
+	r->burst = burst < 1 ? 1 : burst;
+	r->tokens = r->burst;
+	r->last = xb_time_us();
+
+out:
+	pthread_mutex_unlock(&sched->lock);
+	return ret;
+}
+
+/*
+ * microseconds until dest64 may send again, 0 if it may now
+ */
+static uint64_t
+xb_sched_rate_wait(struct xb_sched *sched, uint64_t dest64, uint64_t now) {
+	struct xb_sched_rate *r;
+
+	if ( (r = xb_sched_find_rate(sched, dest64)) == NULL) {
+		return 0;
+	}
+
+	r->tokens += r->rate * (double)(now - r->last) / 1000000.0;
+	if (r->tokens > r->burst) {
+		r->tokens = r->burst;
+	}
+	r->last = now;
+
+	if (r->tokens >= 1) {
+		return 0;
+	}
+
+	return (uint64_t)((1 - r->tokens) / r->rate * 1000000.0) + 1;
+}
+
+static void
+xb_sched_take_token(struct xb_sched *sched, uint64_t dest64) {
+	struct xb_sched_rate *r;
+
+	if ( (r = xb_sched_find_rate(sched, dest64)) != NULL) {
+		r->tokens -= 1;
+	}
+}
+
+/*
+ * queue a prepared request (frame ID as its second value) for sending;
+ * the scheduler owns xbuf from here on.  bound is the latency bound in
+ * ms, 0 for the class default.  Safe from any thread.
+ */
+int
+xb_sched_enqueue(struct xb_ctx *xctx, struct xb_buffer *xbuf, uint64_t dest64,
+		uint16_t dest16, enum xb_tx_class class, uint32_t bound) {
+	struct xb_sched *sched = xctx->sched;
+	struct xb_sched_item *item;
+
+	if (!sched || class >= XB_CLASS_COUNT) {
+		return -1;
+	}
+
+	item = (struct xb_sched_item *)malloc(sizeof(struct xb_sched_item));
+	if (!item) {
+		return -1;
+	}
+
+	item->next = NULL;
+	item->xbuf = xbuf;
+	item->dest64 = dest64;
+	item->dest16 = dest16;
+
+	pthread_mutex_lock(&sched->lock);
+	item->deadline = xb_time_us() +
+		(uint64_t)(bound ? bound : sched->bound[class]) * 1000;
+	if (sched->tail[class]) {
+		sched->tail[class]->next = item;
+	}
+	else {
+		sched->head[class] = item;
+	}
+	sched->tail[class] = item;
+	sched->pending[class]++;
+	pthread_mutex_unlock(&sched->lock);
+
+	xb_wake(xctx);
+
+	return 0;
+}
+
+int
+xb_sched_tx(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		const char *data, uint16_t len, enum xb_tx_class class) {
+	struct xb_buffer *xbuf;
+
+	/* refused now rather than failing at the head of the queue later */
+	if (len > XB_TX_PAYLOAD_MAX || (xctx->max_payload && len > xctx->max_payload)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	xbuf = xb_create_tx_request(xctx, dest64, dest16, data, len, 0);
+	if (!xbuf) {
+		return -1;
+	}
+
+	if (xb_sched_enqueue(xctx, xbuf, dest64, dest16, class, 0) < 0) {
+		xb_buffer_free(xbuf);
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned int
+xb_sched_pending(struct xb_ctx *xctx) {
+	unsigned int n = 0;
+	int c;
+
+	if (xctx->sched) {
+		pthread_mutex_lock(&xctx->sched->lock);
+		for(c = 0; c < XB_CLASS_COUNT; c++) {
+			n += xctx->sched->pending[c];
+		}
+		pthread_mutex_unlock(&xctx->sched->lock);
+	}
+
+	return n;
+}
+
+/*
+ * pick what goes next: anything past its deadline, most overdue first;
+ * otherwise the most urgent class.  Within a class, items for a rate
+ * limited destination are passed over rather than blocking the rest.
+ * *wait gets the time until a rate limited item becomes sendable.
+ */
+static struct xb_sched_item *
+xb_sched_pick(struct xb_sched *sched, uint64_t now, int *class_out,
+		struct xb_sched_item **prev_out, uint64_t *wait) {
+	struct xb_sched_item *item, *prev, *best = NULL, *best_prev = NULL;
+	uint64_t w;
+	int c, best_class = -1;
+
+	*wait = 0;
+
+	for(c = 0; c < XB_CLASS_COUNT; c++) {
+		for(prev = NULL, item = sched->head[c]; item; prev = item, item = item->next) {
+			if ( (w = xb_sched_rate_wait(sched, item->dest64, now)) != 0) {
+				if (!*wait || w < *wait) {
+					*wait = w;
+				}
+				continue;
+			}
+
+			if (!best || (item->deadline <= now &&
+					(best->deadline > now || item->deadline < best->deadline))) {
+				best = item;
+				best_prev = prev;
+				best_class = c;
+			}
+			/* the first sendable item is the oldest in its class */
+			break;
+		}
+	}
+
+	if (best) {
+		*class_out = best_class;
+		*prev_out = best_prev;
+	}
+
+	return best;
+}
+
+static void
+xb_sched_unlink(struct xb_sched *sched, int class, struct xb_sched_item *prev,
+		struct xb_sched_item *item) {
+	if (prev) {
+		prev->next = item->next;
+	}
+	else {
+		sched->head[class] = item->next;
+	}
+	if (sched->tail[class] == item) {
+		sched->tail[class] = prev;
+	}
+	sched->pending[class]--;
+}
+
+/*
+ * put an item that could not be sent back at the front of its class
+ */
+static void
+xb_sched_requeue(struct xb_sched *sched, int class, struct xb_sched_item *item) {
+	item->next = sched->head[class];
+	sched->head[class] = item;
+	if (!sched->tail[class]) {
+		sched->tail[class] = item;
+	}
+	sched->pending[class]++;
+}
+
+static int
+xb_sched_room(struct xb_ctx *xctx) {
+	if (!xctx->txwin) {
+		return 1;
+	}
+
+	xb_tx_expire(xctx);
+
+	return xctx->txwin->inflight < xctx->txwin->cwnd;
+}
+
+/*
+ * when xb_sched_run() could next send something: now if a frame may go
+ * and the window has room, when a rate limit allows one otherwise, 0 if
+ * nothing is queued or the window is full (a status frees it)
+ */
+uint64_t
+xb_sched_next_due(struct xb_ctx *xctx) {
+	struct xb_sched *sched = xctx->sched;
+	struct xb_sched_item *item, *prev;
+	uint64_t now, rate_wait, due = 0;
+	int class;
+
+	if (!sched || !xb_sched_pending(xctx) || !xb_sched_room(xctx)) {
+		return 0;
+	}
+
+	now = xb_time_us();
+	pthread_mutex_lock(&sched->lock);
+	if ( (item = xb_sched_pick(sched, now, &class, &prev, &rate_wait)) != NULL) {
+		due = now;
+	}
+	else if (rate_wait) {
+		due = now + rate_wait;
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	return due;
+}
+
+/*
+ * feed queued frames into the transmit window until the queues are
+ * empty or timeout ms pass, handling incoming frames meanwhile; returns
+ * the number of frames sent.  A frame that fails to send for any reason
+ * but EAGAIN is dropped and counted.  The lock is not held while
+ * sending, so frame handlers may enqueue more.
+ */
+int
+xb_sched_run(struct xb_ctx *xctx, int timeout) {
+	struct xb_sched *sched = xctx->sched;
+	struct xb_sched_item *item, *prev;
+	struct xb_frame frame;
+	uint64_t deadline, rate_wait, now, dest64;
+	int class, ret, sent = 0, wait;
+
+	if (!sched) {
+		return -1;
+	}
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	for(;;) {
+		rate_wait = 0;
+		while (xb_sched_room(xctx)) {
+			now = xb_time_us();
+			pthread_mutex_lock(&sched->lock);
+			if ( (item = xb_sched_pick(sched, now, &class, &prev, &rate_wait)) != NULL) {
+				xb_sched_unlink(sched, class, prev, item);
+			}
+			pthread_mutex_unlock(&sched->lock);
+			if (!item) {
+				break;
+			}
+
+			dest64 = item->dest64;
+			ret = xb_tx_send_buffer(xctx, item->xbuf, dest64,
+					item->dest16, XB_TX_NONBLOCK);
+			pthread_mutex_lock(&sched->lock);
+			if (ret < 0 && errno == EAGAIN) {
+				/* keep it for the next run */
+				xb_sched_requeue(sched, class, item);
+				pthread_mutex_unlock(&sched->lock);
+				return sent;
+			}
+			/* anything else would fail again and block the class */
+			if (ret < 0) {
+				sched->dropped++;
+			}
+			else {
+				xb_sched_take_token(sched, dest64);
+				sent++;
+			}
+			pthread_mutex_unlock(&sched->lock);
+
+			xb_buffer_free(item->xbuf);
+			free(item);
+		}
+
+		if (!xb_sched_pending(xctx) || (wait = xb_remaining(timeout, deadline)) == 0) {
+			return sent;
+		}
+
+		/* window full: wait for a status; rate limited: for a token */
+		if (rate_wait && (wait < 0 || (uint64_t)wait * 1000 > rate_wait)) {
+			wait = (int)((rate_wait + 999) / 1000);
+		}
+		/* ... or until the oldest slot expires, if its status is lost */
+		if (xctx->txwin && (wait < 0 || (uint32_t)wait > xctx->txwin->timeout)) {
+			wait = (int)xctx->txwin->timeout;
+		}
+		if ( (ret = xb_read_frame(xctx, &frame, wait)) < 0) {
+			return -1;
+		}
+		if (ret) {
+			xb_dispatch_frame(xctx, &frame);
+		}
+	}
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_SCHED_H
+#define XB_SCHED_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+/* lower is more urgent */
+enum xb_tx_class {
+	XB_CLASS_CONTROL = 0,
+	XB_CLASS_ALARM,
+	XB_CLASS_NORMAL,
+	XB_CLASS_BULK,
+	XB_CLASS_COUNT
+};
+
+/* default latency bound per class, in ms */
+#define XB_SCHED_BOUND_CONTROL			50
+#define XB_SCHED_BOUND_ALARM			100
+#define XB_SCHED_BOUND_NORMAL			1000
+#define XB_SCHED_BOUND_BULK			10000
+
+struct xb_sched_item {
+	struct xb_sched_item *next;
+
+	struct xb_buffer *xbuf;
+	uint64_t dest64;
+	uint16_t dest16;
+	uint64_t deadline;
+};
+
+/* token bucket for one destination */
+struct xb_sched_rate {
+	uint64_t dest64;
+	double rate, burst, tokens;
+	uint64_t last;
+};
+
+/*
+ * any thread may enqueue; the queues and rates are under lock.
+ * xb_sched_run() reads frames, so only the thread that owns the context
+ * calls it; enqueueing wakes that thread through xb_set_wake().
+ */
+struct xb_sched {
+	pthread_mutex_t lock;
+	struct xb_sched_item *head[XB_CLASS_COUNT], *tail[XB_CLASS_COUNT];
+	unsigned int pending[XB_CLASS_COUNT];
+	uint32_t bound[XB_CLASS_COUNT];
+
+	struct xb_sched_rate *rates;
+	unsigned int nrates;
+
+	/* frames given up on because sending them failed */
+	unsigned long dropped;
+};
+
+int xb_sched_init(struct xb_ctx *);
+void xb_sched_free(struct xb_ctx *);
+
+void xb_sched_set_bound(struct xb_ctx *, enum xb_tx_class, uint32_t);
+int xb_sched_set_rate(struct xb_ctx *, uint64_t, double, double);
+
+int xb_sched_enqueue(struct xb_ctx *, struct xb_buffer *, uint64_t, uint16_t,
+		enum xb_tx_class, uint32_t);
+int xb_sched_tx(struct xb_ctx *, uint64_t, uint16_t, const char *, uint16_t,
+		enum xb_tx_class);
+unsigned int xb_sched_pending(struct xb_ctx *);
+
+int xb_sched_run(struct xb_ctx *, int);
+uint64_t xb_sched_next_due(struct xb_ctx *);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "xb_ctx.h"
+#include "xb_serial.h"
+
+static const struct {
+	uint32_t baud;
+	speed_t speed;
+} xb_speeds[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+};
+
+/*
+ * termios speed for a baud rate, B0 if the host can't do it
+ */
+speed_t
+xb_baud_to_speed(uint32_t baud) {
+	unsigned int i;
+
+	for(i = 0; i < sizeof(xb_speeds) / sizeof(xb_speeds[0]); i++) {
+		if (xb_speeds[i].baud == baud) {
+			return xb_speeds[i].speed;
+		}
+	}
+
+	return B0;
+}
+
+/*
+ * put the port in raw mode with the line settings from xctx
+ */
+int
+xb_serial_setup(struct xb_ctx *xctx) {
+	struct termios serial;
+	speed_t speed;
+
+	if ( (speed = xb_baud_to_speed(xctx->baud)) == B0) {
+		return -1;
+	}
+
+	if (tcgetattr(xctx->xbfd, &serial)) {
+		return -1;
+	}
+
+	serial.c_iflag = 0;
+	serial.c_oflag = 0;
+	serial.c_lflag = 0;
+	serial.c_cflag = CS8 | CLOCAL | CREAD;
+	if (xctx->parity == 'E') {
+		serial.c_cflag |= PARENB;
+	}
+	else if (xctx->parity == 'O') {
+		serial.c_cflag |= PARENB | PARODD;
+	}
+	if (xctx->stop_bits == 2) {
+		serial.c_cflag |= CSTOPB;
+	}
+	if (xctx->flow_control == XB_FLOW_RTSCTS) {
+#ifdef CRTSCTS
+		serial.c_cflag |= CRTSCTS;
+#else
+		return -1;
+#endif
+	}
+	/* blocking reads; timeouts are done with poll() */
+	serial.c_cc[VMIN] = 1;
+	serial.c_cc[VTIME] = 0;
+	cfsetispeed(&serial, speed);
+	cfsetospeed(&serial, speed);
+
+	if (tcsetattr(xctx->xbfd, TCSANOW, &serial)) {
+		return -1;
+	}
+
+	/* whatever was buffered at the old settings is garbage now */
+	tcflush(xctx->xbfd, TCIOFLUSH);
+	xctx->rxbuf->readpos = xctx->rxbuf->writepos = 0;
+
+	return 0;
+}
+
+/*
+ * change the host side line settings; parity is 'N', 'E' or 'O'
+ */
+int
+xb_set_serial(struct xb_ctx *xctx, uint32_t baud, char parity, int stop_bits) {
+	uint32_t old_baud = xctx->baud;
+	char old_parity = xctx->parity;
+	uint8_t old_stop_bits = xctx->stop_bits;
+
+	if ((parity != 'N' && parity != 'E' && parity != 'O') ||
+			(stop_bits != 1 && stop_bits != 2)) {
+		return -1;
+	}
+
+	xctx->baud = baud;
+	xctx->parity = parity;
+	xctx->stop_bits = (uint8_t)stop_bits;
+
+	if (xb_serial_setup(xctx) < 0) {
+		xctx->baud = old_baud;
+		xctx->parity = old_parity;
+		xctx->stop_bits = old_stop_bits;
+		xb_serial_setup(xctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * BD register value for a baud rate
+ */
+uint32_t
+xb_baud_to_bd(uint32_t baud) {
+	static const uint32_t bd_rates[XB_BD_MAX_INDEX + 1] = {
+		1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+	};
+	uint32_t bd;
+
+	for(bd = 0; bd <= XB_BD_MAX_INDEX; bd++) {
+		if (bd_rates[bd] == baud) {
+			return bd;
+		}
+	}
+
+	return baud;
+}
+
+/*
+ * move only the host side of the link
+ */
+static int
+xb_host_link(struct xb_ctx *xctx, uint32_t baud, int flow) {
+	xctx->baud = baud;
+	xctx->flow_control = flow;
+
+	return xb_serial_setup(xctx);
+}
+
+/*
+ * can we still talk to the radio?
+ */
+static int
+xb_link_alive(struct xb_ctx *xctx) {
+	uint64_t value;
+
+	if (xctx->api_mode == XB_AT) {
+		xctx->in_command_mode = 0;
+		return xb_enter_command_mode(xctx);
+	}
+
+	return xb_at_query(xctx, "AP", &value, XB_LINK_VERIFY_MS);
+}
+
+/*
+ * program BD, D6 (RTS) and D7 (CTS) and make them take effect
+ */
+static int
+xb_radio_link(struct xb_ctx *xctx, uint32_t bd, uint64_t d6, uint64_t d7) {
+	struct xb_buffer *xbufs[4];
+	struct buffer *replies[4];
+	int i, n, ret = 0;
+
+	if (xctx->api_mode != XB_AT) {
+		if (xb_at_set(xctx, "D6", d6, 1, XB_AT_TIMEOUT_MS) < 0 ||
+				xb_at_set(xctx, "D7", d7, 1, XB_AT_TIMEOUT_MS) < 0 ||
+				xb_at_set(xctx, "BD", bd, 4, XB_AT_TIMEOUT_MS) < 0) {
+			return -1;
+		}
+		/* the AC reply still comes at the old rate */
+		return xb_at_set(xctx, "AC", 0, 0, XB_AT_TIMEOUT_MS) < 0 ? -1 : 0;
+	}
+
+	/* one "ATD6x,D7x,BDx,CN" line; CN applies it all */
+	if (xb_enter_command_mode(xctx) < 0) {
+		return -1;
+	}
+	xbufs[0] = xb_create_at_cmd(xctx, "D6", 0);
+	xbufs[1] = xb_create_at_cmd(xctx, "D7", 0);
+	xbufs[2] = xb_create_at_cmd(xctx, "BD", 0);
+	xbufs[3] = xb_create_at_cmd(xctx, "CN", 0);
+	for(i = 0; i < 4; i++) {
+		if (!xbufs[i]) {
+			ret = -1;
+		}
+	}
+	if (!ret && (xb_buffer_put_uint8(xbufs[0], (uint8_t)d6) < 0 ||
+			xb_buffer_put_uint8(xbufs[1], (uint8_t)d7) < 0 ||
+			xb_buffer_put_uint32(xbufs[2], bd) < 0)) {
+		ret = -1;
+	}
+
+	if (!ret) {
+		n = xb_at_batch(xctx, xbufs, replies, 4);
+		ret = n == 4 ? 0 : -1;
+		for(i = 0; i < 4 && i < n; i++) {
+			if (strcmp(replies[i]->data, "OK")) {
+				ret = -1;
+			}
+			buffer_free(replies[i]);
+		}
+		xctx->in_command_mode = 0;
+	}
+
+	for(i = 0; i < 4; i++) {
+		if (xbufs[i]) {
+			xb_buffer_free(xbufs[i]);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * switch radio and host to a new baud rate and flow control together,
+ * verifying the result; on failure both are put back as they were
+ */
+int
+xb_set_link(struct xb_ctx *xctx, uint32_t baud, int flow) {
+	uint32_t old_baud = xctx->baud;
+	int old_flow = xctx->flow_control;
+	uint64_t old_bd, old_d6, old_d7;
+
+	if (xb_baud_to_speed(baud) == B0) {
+		return -1;
+	}
+
+	if (xb_at_query(xctx, "BD", &old_bd, XB_AT_TIMEOUT_MS) < 0 ||
+			xb_at_query(xctx, "D6", &old_d6, XB_AT_TIMEOUT_MS) < 0 ||
+			xb_at_query(xctx, "D7", &old_d7, XB_AT_TIMEOUT_MS) < 0) {
+		return -1;
+	}
+
+	/* D6/D7 = 1 enable RTS/CTS flow control on the radio */
+	if (xb_radio_link(xctx, xb_baud_to_bd(baud),
+				flow == XB_FLOW_RTSCTS ? 1 : 0,
+				flow == XB_FLOW_RTSCTS ? 1 : old_d7) < 0) {
+		/* the radio may still be at the old rate, but D6/D7 go in
+		 * before BD and may have taken; put them back */
+		if (xb_link_alive(xctx) == 0) {
+			xb_radio_link(xctx, (uint32_t)old_bd, old_d6, old_d7);
+			return -1;
+		}
+	}
+	else {
+		tcdrain(xctx->xbfd);
+		if (xb_host_link(xctx, baud, flow) == 0 && xb_link_alive(xctx) == 0) {
+			return 0;
+		}
+	}
+
+	/* roll back: find the radio, then restore what it had */
+	if (xb_host_link(xctx, old_baud, old_flow) == 0 && xb_link_alive(xctx) == 0) {
+		/* it never switched rate; undo D6/D7 in case those stuck */
+		xb_radio_link(xctx, (uint32_t)old_bd, old_d6, old_d7);
+		xb_host_link(xctx, old_baud, old_flow);
+		return -1;
+	}
+	/* at the new rate, but without working flow control? */
+	if (xb_host_link(xctx, baud, XB_FLOW_NONE) == 0 && xb_link_alive(xctx) == 0) {
+		xb_radio_link(xctx, (uint32_t)old_bd, old_d6, old_d7);
+	}
+	xb_host_link(xctx, old_baud, old_flow);
+
+	return -1;
+}
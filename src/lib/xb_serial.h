@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_SERIAL_H
+#define XB_SERIAL_H
+
+#include <stdint.h>
+#include <termios.h>
+
+#include "xb_ctx.h"
+
+/* 9600 8-N-1 is the factory setting for the XBee in API/AT mode */
+#define XB_BAUD_DEFAULT				9600
+#define XB_PARITY_DEFAULT			'N'
+#define XB_STOP_BITS_DEFAULT			1
+
+/* flow_control */
+#define XB_FLOW_NONE				0
+#define XB_FLOW_RTSCTS				1
+
+/* BD 0-7 select 1200-115200; above that the radio takes the rate itself */
+#define XB_BD_MAX_INDEX				7
+
+/* how long a link change gets to prove itself */
+#define XB_LINK_VERIFY_MS			250
+
+speed_t xb_baud_to_speed(uint32_t);
+int xb_serial_setup(struct xb_ctx *);
+int xb_set_serial(struct xb_ctx *, uint32_t, char, int);
+
+uint32_t xb_baud_to_bd(uint32_t);
+int xb_set_link(struct xb_ctx *, uint32_t, int);
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_sleepy.h"
+#include "xb_tx.h"
+
+int
+xb_sleepy_init(struct xb_ctx *xctx, unsigned int nodes, size_t max_bytes, uint32_t max_age) {
+	struct xb_sleepy *sl;
+
+	sl = (struct xb_sleepy *)calloc(1, sizeof(struct xb_sleepy));
+	if (!sl) {
+		return -1;
+	}
+
+	sl->size = nodes ? nodes : XB_SLEEPY_NODES_DEFAULT;
+	sl->nodes = (struct xb_sleepy_node *)calloc(sl->size, sizeof(struct xb_sleepy_node));
+	if (!sl->nodes) {
+		free(sl);
+		return -1;
+	}
+	sl->max_bytes = max_bytes ? max_bytes : XB_SLEEPY_BYTES_DEFAULT;
+	sl->max_age = max_age ? max_age : XB_SLEEPY_MAX_AGE_MS;
+
+	xb_sleepy_free(xctx);
+	xctx->sleepy = sl;
+
+	return 0;
+}
+
+static void
+xb_sleepy_pop(struct xb_sleepy *sl, struct xb_sleepy_node *node) {
+	struct xb_sleepy_msg *msg = node->head;
+
+	node->head = msg->next;
+	if (!node->head) {
+		node->tail = NULL;
+	}
+	node->count--;
+	sl->bytes -= msg->len;
+	free(msg);
+}
+
+void
+xb_sleepy_free(struct xb_ctx *xctx) {
+	struct xb_sleepy *sl = xctx->sleepy;
+	unsigned int i;
+
+	if (!sl) {
+		return;
+	}
+
+	for(i = 0; i < sl->size; i++) {
+		while (sl->nodes[i].head) {
+			xb_sleepy_pop(sl, &sl->nodes[i]);
+		}
+	}
+	free(sl->nodes);
+	free(sl);
+	xctx->sleepy = NULL;
+}
+
+static struct xb_sleepy_node *
+xb_sleepy_find(struct xb_sleepy *sl, uint64_t addr64) {
+	unsigned int i;
+
+	for(i = 0; i < sl->size; i++) {
+		if (sl->nodes[i].used && sl->nodes[i].addr64 == addr64) {
+			return &sl->nodes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * find or make room for a node; nodes with messages waiting are never
+ * evicted
+ */
+static struct xb_sleepy_node *
+xb_sleepy_node(struct xb_sleepy *sl, uint64_t addr64) {
+	struct xb_sleepy_node *node, *victim = NULL;
+	unsigned int i;
+
+	if ( (node = xb_sleepy_find(sl, addr64)) != NULL) {
+		return node;
+	}
+
+	for(i = 0; i < sl->size; i++) {
+		node = &sl->nodes[i];
+		if (!node->used) {
+			victim = node;
+			break;
+		}
+		if (!node->head && (!victim || node->used < victim->used)) {
+			victim = node;
+		}
+	}
+	if (!victim) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	memset(victim, 0, sizeof(*victim));
+	victim->addr64 = addr64;
+	victim->addr16 = XB_ADDR16_UNKNOWN;
+	victim->used = xb_time_us();
+
+	return victim;
+}
+
+/*
+ * how long addr64 stays awake once heard from; 0 says it does not sleep
+ */
+int
+xb_sleepy_set(struct xb_ctx *xctx, uint64_t addr64, uint32_t awake_ms) {
+	struct xb_sleepy_node *node;
+
+	if (!xctx->sleepy) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ( (node = xb_sleepy_node(xctx->sleepy, addr64)) == NULL) {
+		return -1;
+	}
+	node->awake_ms = awake_ms;
+
+	return 0;
+}
+
+/*
+ * take what node discovery says; only end devices sleep
+ */
+void
+xb_sleepy_learn(struct xb_ctx *xctx, const struct xb_node *n) {
+	struct xb_sleepy_node *node;
+
+	if (!xctx->sleepy) {
+		return;
+	}
+	if (n->device_type == XB_NODE_END_DEVICE) {
+		if ( (node = xb_sleepy_node(xctx->sleepy, n->addr64)) != NULL) {
+			if (!node->awake_ms) {
+				node->awake_ms = XB_SLEEPY_AWAKE_MS;
+			}
+			node->addr16 = n->addr16;
+		}
+	}
+	else if ( (node = xb_sleepy_find(xctx->sleepy, n->addr64)) != NULL) {
+		node->awake_ms = 0;
+	}
+}
+
+static int
+xb_sleepy_awake(struct xb_sleepy_node *node, uint64_t now) {
+	return !node->awake_ms || now < node->awake_until;
+}
+
+/*
+ * send what a node has waiting while the window has room; never reads,
+ * so it is safe from inside the receive path
+ */
+static void
+xb_sleepy_flush(struct xb_ctx *xctx, struct xb_sleepy_node *node) {
+	struct xb_sleepy *sl = xctx->sleepy;
+	struct xb_tx_window *win = xctx->txwin;
+	struct xb_sleepy_msg *msg;
+
+	while ( (msg = node->head) != NULL) {
+		if (win && win->inflight >= win->cwnd) {
+			return;
+		}
+		if (xb_tx_send(xctx, node->addr64, node->addr16, msg->data, msg->len, XB_TX_NONBLOCK) < 0) {
+			return;
+		}
+		sl->sent++;
+		xb_sleepy_pop(sl, node);
+	}
+}
+
+/*
+ * drop messages held longer than max_age; run from the receive path and
+ * the context's timers (xb_run_timers)
+ */
+void
+xb_sleepy_expire(struct xb_ctx *xctx) {
+	struct xb_sleepy *sl = xctx->sleepy;
+	struct xb_sleepy_node *node;
+	uint64_t now;
+	unsigned int i;
+
+	if (!sl || !sl->bytes) {
+		return;
+	}
+
+	now = xb_time_us();
+
+	for(i = 0; i < sl->size; i++) {
+		node = &sl->nodes[i];
+		while (node->head && now - node->head->queued >= sl->max_age * 1000ULL) {
+			xb_sleepy_pop(sl, node);
+			sl->expired++;
+		}
+	}
+}
+
+/*
+ * when the oldest held message runs out of time, 0 if none is held
+ */
+uint64_t
+xb_sleepy_next_expiry(struct xb_ctx *xctx) {
+	struct xb_sleepy *sl = xctx->sleepy;
+	uint64_t due, next = 0;
+	unsigned int i;
+
+	if (!sl || !sl->bytes) {
+		return 0;
+	}
+
+	for(i = 0; i < sl->size; i++) {
+		if (sl->nodes[i].head) {
+			due = sl->nodes[i].head->queued + sl->max_age * 1000ULL;
+			if (!next || due < next) {
+				next = due;
+			}
+		}
+	}
+
+	return next;
+}
+
+/*
+ * send now if the node is awake or does not sleep, otherwise hold the
+ * message until it is heard from; returns 1 if sent, 0 if held.  Without
+ * xb_sleepy_init() nothing is held.
+ */
+int
+xb_sleepy_send(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16, const char *data, uint16_t len) {
+	struct xb_sleepy *sl = xctx->sleepy;
+	struct xb_sleepy_node *node;
+	struct xb_sleepy_msg *msg;
+	uint64_t now;
+	size_t evict;
+
+	now = xb_time_us();
+	node = sl ? xb_sleepy_find(sl, dest64) : NULL;
+
+	if (!node || (xb_sleepy_awake(node, now) && !node->head)) {
+		if (xb_tx_send(xctx, dest64, dest16, data, len, 0) < 0) {
+			return -1;
+		}
+		return 1;
+	}
+
+	xb_sleepy_expire(xctx);
+
+	/* a full queue gives up its oldest message, but only for one that fits */
+	evict = node->count >= XB_SLEEPY_MSGS_MAX ? node->head->len : 0;
+	if (sl->bytes - evict + len > sl->max_bytes) {
+		sl->dropped++;
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if ( (msg = (struct xb_sleepy_msg *)malloc(sizeof(struct xb_sleepy_msg) + len)) == NULL) {
+		return -1;
+	}
+	if (node->count >= XB_SLEEPY_MSGS_MAX) {
+		xb_sleepy_pop(sl, node);
+		sl->dropped++;
+	}
+	msg->next = NULL;
+	msg->queued = now;
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	if (node->tail) {
+		node->tail->next = msg;
+	}
+	else {
+		node->head = msg;
+	}
+	node->tail = msg;
+	node->count++;
+	sl->bytes += len;
+	sl->queued++;
+	if (dest16 != XB_ADDR16_UNKNOWN) {
+		node->addr16 = dest16;
+	}
+
+	/* awake, but behind messages the window held up */
+	if (xb_sleepy_awake(node, now)) {
+		xb_sleepy_flush(xctx, node);
+	}
+
+	return 0;
+}
+
+unsigned int
+xb_sleepy_pending(struct xb_ctx *xctx, uint64_t addr64) {
+	struct xb_sleepy_node *node;
+
+	if (!xctx->sleepy) {
+		return 0;
+	}
+	node = xb_sleepy_find(xctx->sleepy, addr64);
+
+	return node ? node->count : 0;
+}
+
+/*
+ * anything a node sends shows it is awake; flush its queue in a burst
+ */
+void
+xb_sleepy_observe(struct xb_ctx *xctx, struct xb_frame *frame) {
+	struct xb_sleepy *sl = xctx->sleepy;
+	struct xb_sleepy_node *node;
+	struct xb_rx rx;
+	uint64_t src64, now;
+	uint16_t src16 = XB_ADDR16_UNKNOWN;
+	unsigned int i;
+	int end_device = 0;
+
+	if (!sl) {
+		return;
+	}
+	xb_sleepy_expire(xctx);
+
+	if (xb_frame_rx(frame, &rx) == 0) {
+		src64 = rx.src64;
+		src16 = rx.src16;
+		end_device = frame->data[0] == XB_FRAME_TYPE_RX && (rx.options & XB_RX_OPT_END_DEVICE);
+	}
+	else if ((frame->data[0] == XB_FRAME_TYPE_IO_SAMPLE ||
+			frame->data[0] == XB_FRAME_TYPE_SENSOR_READ ||
+			frame->data[0] == XB_FRAME_TYPE_NODE_IDENT) && frame->len >= 11) {
+		src64 = xb_get_be(frame->data + 1, 8);
+		src16 = (uint16_t)xb_get_be(frame->data + 9, 2);
+	}
+	else if (frame->data[0] == XB_FRAME_TYPE_REMOTE_AT_RESPONSE && frame->len >= 12) {
+		src64 = xb_get_be(frame->data + 2, 8);
+		src16 = (uint16_t)xb_get_be(frame->data + 10, 2);
+	}
+	else {
+		src64 = XB_ADDR64_UNKNOWN;
+	}
+
+	now = xb_time_us();
+
+	if (src64 != XB_ADDR64_UNKNOWN) {
+		node = end_device ? xb_sleepy_node(sl, src64) : xb_sleepy_find(sl, src64);
+		if (node) {
+			if (end_device && !node->awake_ms) {
+				node->awake_ms = XB_SLEEPY_AWAKE_MS;
+			}
+			if (src16 != XB_ADDR16_UNKNOWN) {
+				node->addr16 = src16;
+			}
+			node->awake_until = now + node->awake_ms * 1000ULL;
+			node->used = now;
+			xb_sleepy_flush(xctx, node);
+		}
+		return;
+	}
+
+	/* the window has room again for nodes it held up while awake */
+	if (frame->data[0] == XB_FRAME_TYPE_TX_STATUS ||
+			frame->data[0] == XB_FRAME_TYPE_TX_STATUS_LEGACY) {
+		for(i = 0; i < sl->size; i++) {
+			node = &sl->nodes[i];
+			if (node->head && xb_sleepy_awake(node, now)) {
+				xb_sleepy_flush(xctx, node);
+			}
+		}
+	}
+}
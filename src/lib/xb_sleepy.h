@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_SLEEPY_H
+#define XB_SLEEPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+#include "xb_nd.h"
+
+/*
+ * messages for end devices that sleep are held here rather than left to
+ * fail or clog the parent, and go out together as soon as the node is
+ * heard from
+ */
+#define XB_SLEEPY_NODES_DEFAULT			64
+#define XB_SLEEPY_BYTES_DEFAULT			16384
+#define XB_SLEEPY_MAX_AGE_MS			600000
+/* per node; the oldest message goes to make room */
+#define XB_SLEEPY_MSGS_MAX			16
+/* how long a node stays awake after we hear from it, unless told (ST) */
+#define XB_SLEEPY_AWAKE_MS			1000
+
+/* ZigBee receive option: the sender is an end device */
+#define XB_RX_OPT_END_DEVICE			0x40
+
+struct xb_sleepy_msg {
+	struct xb_sleepy_msg *next;
+	uint64_t queued;
+	uint16_t len;
+	char data[];
+};
+
+struct xb_sleepy_node {
+	uint64_t addr64;
+	uint16_t addr16;
+	/* 0 for a node that does not sleep */
+	uint32_t awake_ms;
+	uint64_t awake_until, used;
+	struct xb_sleepy_msg *head, *tail;
+	unsigned int count;
+};
+
+struct xb_sleepy {
+	struct xb_sleepy_node *nodes;
+	unsigned int size;
+	size_t bytes, max_bytes;
+	uint32_t max_age;
+	unsigned long queued, sent, expired, dropped;
+};
+
+int xb_sleepy_init(struct xb_ctx *, unsigned int, size_t, uint32_t);
+void xb_sleepy_free(struct xb_ctx *);
+
+int xb_sleepy_set(struct xb_ctx *, uint64_t, uint32_t);
+void xb_sleepy_learn(struct xb_ctx *, const struct xb_node *);
+
+int xb_sleepy_send(struct xb_ctx *, uint64_t, uint16_t, const char *, uint16_t);
+unsigned int xb_sleepy_pending(struct xb_ctx *, uint64_t);
+void xb_sleepy_expire(struct xb_ctx *);
+uint64_t xb_sleepy_next_expiry(struct xb_ctx *);
+
+void xb_sleepy_observe(struct xb_ctx *, struct xb_frame *);
+
+#endif
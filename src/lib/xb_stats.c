@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_ctx.h"
+#include "xb_reader.h"
+#include "xb_sched.h"
+#include "xb_stats.h"
+#include "xb_tx.h"
+
+static const char *xb_lat_names[XB_LAT_CLASSES] = { "local AT", "transmit", "remote AT" };
+
+/*
+ * start counting; before starting a reader thread, so that it counts
+ * what it reads
+ */
+int
+xb_stats_init(struct xb_ctx *xctx) {
+	struct xb_stats *st;
+
+	if (xctx->stats) {
+		return 0;
+	}
+	if ( (st = (struct xb_stats *)calloc(1, sizeof(struct xb_stats))) == NULL) {
+		return -1;
+	}
+	xctx->stats = st;
+
+	return 0;
+}
+
+void
+xb_stats_free(struct xb_ctx *xctx) {
+	free(xctx->stats);
+	xctx->stats = NULL;
+}
+
+/*
+ * a request written to the radio: frame data from the API identifier
+ * on, and how many escape bytes it took
+ */
+void
+xb_stats_tx(struct xb_ctx *xctx, const uint8_t *data, size_t len, size_t escapes) {
+	struct xb_stats *st = xctx->stats;
+
+	xb_stats_add(st->tx_frames[data[0]], 1);
+	xb_stats_add(st->tx_frame_bytes[data[0]], len);
+	if (escapes) {
+		xb_stats_add(st->tx_escapes, escapes);
+	}
+
+	switch (data[0]) {
+	case XB_FRAME_TYPE_TX64_REQUEST:
+	case XB_FRAME_TYPE_TX16_REQUEST:
+	case XB_FRAME_TYPE_AT_CMD:
+	case XB_FRAME_TYPE_AT_CMD_QUEUE:
+	case XB_FRAME_TYPE_TX_REQUEST:
+	case XB_FRAME_TYPE_EXPLICIT_TX:
+	case XB_FRAME_TYPE_REMOTE_AT_CMD:
+		if (len >= 2 && data[1]) {
+			atomic_store_explicit(&st->sent[data[1]], xb_time_us(), memory_order_relaxed);
+		}
+		break;
+	}
+}
+
+static void
+xb_latency_add(struct xb_latency *lat, uint64_t us) {
+	int b;
+
+	for(b = 0; b < XB_LAT_BUCKETS - 1 && (us >> (b + 1)); b++)
+		;
+
+	lat->count++;
+	lat->buckets[b]++;
+	lat->sum_us += us;
+	if (us > lat->max_us) {
+		lat->max_us = us;
+	}
+}
+
+/*
+ * a frame from the radio; completes the latency of the request it
+ * answers
+ */
+void
+xb_stats_rx(struct xb_ctx *xctx, const struct xb_frame *frame) {
+	struct xb_stats *st = xctx->stats;
+	uint64_t sent;
+	int class, frame_id;
+
+	xb_stats_add(st->rx_frames[frame->data[0]], 1);
+	xb_stats_add(st->rx_frame_bytes[frame->data[0]], frame->len);
+
+	switch (frame->data[0]) {
+	case XB_FRAME_TYPE_AT_CMD_RESPONSE:
+		class = XB_LAT_AT;
+		break;
+	case XB_FRAME_TYPE_TX_STATUS_LEGACY:
+	case XB_FRAME_TYPE_TX_STATUS:
+		class = XB_LAT_TX;
+		break;
+	case XB_FRAME_TYPE_REMOTE_AT_RESPONSE:
+		class = XB_LAT_REMOTE_AT;
+		break;
+	default:
+		return;
+	}
+
+	if ( (frame_id = xb_frame_id(frame)) <= 0) {
+		return;
+	}
+	/* a queued (0x09) AT command answers more than once; count the first */
+	if ( (sent = atomic_exchange_explicit(&st->sent[frame_id], 0, memory_order_relaxed)) != 0) {
+		xb_latency_add(&st->latency[class], xb_time_us() - sent);
+	}
+}
+
+void
+xb_stats_snapshot(struct xb_ctx *xctx, struct xb_stats_snapshot *snap) {
+	struct xb_stats *st = xctx->stats;
+	struct xb_decoder *dec = &xctx->decoder;
+	int i;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->time_us = xb_time_us();
+
+	if (xctx->reader) {
+		dec = &xctx->reader->decoder;
+		snap->reader_depth = (unsigned int)(atomic_load(&xctx->reader->head) -
+				atomic_load(&xctx->reader->tail));
+		snap->reader_stalls = atomic_load(&xctx->reader->stalls);
+	}
+	snap->rx_escapes = atomic_load_explicit(&dec->escapes, memory_order_relaxed);
+	snap->csum_errors = atomic_load_explicit(&dec->csum_errors, memory_order_relaxed);
+	snap->resyncs = atomic_load_explicit(&dec->resyncs, memory_order_relaxed);
+	snap->discarded = atomic_load_explicit(&dec->discarded, memory_order_relaxed);
+
+	if (xctx->txwin) {
+		snap->tx_inflight = xctx->txwin->inflight;
+	}
+	if (xctx->sched) {
+		snap->sched_pending = xb_sched_pending(xctx);
+	}
+	if (xctx->txbuf) {
+		snap->txbuf_bytes = xctx->txbuf->writepos;
+	}
+
+	if (!st) {
+		return;
+	}
+
+	snap->rx_bytes = atomic_load_explicit(&st->rx_bytes, memory_order_relaxed);
+	snap->tx_bytes = atomic_load_explicit(&st->tx_bytes, memory_order_relaxed);
+	snap->tx_escapes = atomic_load_explicit(&st->tx_escapes, memory_order_relaxed);
+	for(i = 0; i < 256; i++) {
+		snap->rx_frames[i] = atomic_load_explicit(&st->rx_frames[i], memory_order_relaxed);
+		snap->tx_frames[i] = atomic_load_explicit(&st->tx_frames[i], memory_order_relaxed);
+		snap->rx_frame_bytes[i] = atomic_load_explicit(&st->rx_frame_bytes[i], memory_order_relaxed);
+		snap->tx_frame_bytes[i] = atomic_load_explicit(&st->tx_frame_bytes[i], memory_order_relaxed);
+	}
+	memcpy(snap->latency, st->latency, sizeof(snap->latency));
+}
+
+/*
+ * upper bound of the bucket holding the given fraction of samples
+ */
+static uint64_t
+xb_latency_pct(const struct xb_latency *lat, double pct) {
+	unsigned long want, seen = 0;
+	int b;
+
+	want = (unsigned long)(lat->count * pct);
+	for(b = 0; b < XB_LAT_BUCKETS; b++) {
+		seen += lat->buckets[b];
+		if (seen > want) {
+			break;
+		}
+	}
+
+	return 2ULL << (b < XB_LAT_BUCKETS ? b : XB_LAT_BUCKETS - 1);
+}
+
+void
+xb_stats_print(const struct xb_stats_snapshot *snap, FILE *fp) {
+	const struct xb_latency *lat;
+	int i;
+
+	fprintf(fp, "rx %lu bytes (%lu escapes), tx %lu bytes (%lu escapes)\n",
+			snap->rx_bytes, snap->rx_escapes, snap->tx_bytes, snap->tx_escapes);
+	fprintf(fp, "decoder: %lu checksum errors, %lu resyncs, %lu bytes discarded\n",
+			snap->csum_errors, snap->resyncs, snap->discarded);
+	fprintf(fp, "queues: reader %u (%lu stalls), window %u, scheduler %u, coalesce %zu bytes\n",
+			snap->reader_depth, snap->reader_stalls, snap->tx_inflight,
+			snap->sched_pending, snap->txbuf_bytes);
+
+	for(i = 0; i < 256; i++) {
+		if (snap->rx_frames[i]) {
+			fprintf(fp, "  rx 0x%02x: %lu frames, %lu bytes\n", i,
+					snap->rx_frames[i], snap->rx_frame_bytes[i]);
+		}
+		if (snap->tx_frames[i]) {
+			fprintf(fp, "  tx 0x%02x: %lu frames, %lu bytes\n", i,
+					snap->tx_frames[i], snap->tx_frame_bytes[i]);
+		}
+	}
+
+	for(i = 0; i < XB_LAT_CLASSES; i++) {
+		lat = &snap->latency[i];
+		if (!lat->count) {
+			continue;
+		}
+		fprintf(fp, "  %s latency: %lu, mean %llu us, p50 < %llu us, p99 < %llu us, max %llu us\n",
+				xb_lat_names[i], lat->count,
+				(unsigned long long)(lat->sum_us / lat->count),
+				(unsigned long long)xb_latency_pct(lat, 0.5),
+				(unsigned long long)xb_latency_pct(lat, 0.99),
+				(unsigned long long)lat->max_us);
+	}
+}
+
+/*
+ * print a snapshot to fp every interval_ms while frames are being read;
+ * NULL stops it
+ */
+void
+xb_stats_set_dump(struct xb_ctx *xctx, FILE *fp, uint32_t interval_ms) {
+	struct xb_stats *st = xctx->stats;
+
+	st->dump_fp = fp;
+	st->dump_ms = interval_ms;
+	st->next_dump = xb_time_us() + interval_ms * 1000ULL;
+}
+
+void
+xb_stats_tick(struct xb_ctx *xctx) {
+	struct xb_stats *st = xctx->stats;
+	struct xb_stats_snapshot *snap;
+	uint64_t now;
+
+	now = xb_time_us();
+	if (now < st->next_dump) {
+		return;
+	}
+	st->next_dump = now + st->dump_ms * 1000ULL;
+
+	/* too big for the stack of whoever is reading */
+	if ( (snap = (struct xb_stats_snapshot *)malloc(sizeof(*snap))) == NULL) {
+		return;
+	}
+	xb_stats_snapshot(xctx, snap);
+	xb_stats_print(snap, st->dump_fp);
+	fflush(st->dump_fp);
+	free(snap);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_STATS_H
+#define XB_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "xb_ctx.h"
+
+/*
+ * request to response latency, from the write of a frame with an ID to
+ * the frame that completes it, by what kind of request it was: local AT
+ * (serial line and radio), transmit (the network), remote AT (both)
+ */
+#define XB_LAT_AT				0
+#define XB_LAT_TX				1
+#define XB_LAT_REMOTE_AT			2
+#define XB_LAT_CLASSES				3
+/* bucket n counts latencies in [2^n, 2^(n+1)) microseconds */
+#define XB_LAT_BUCKETS				25
+
+struct xb_latency {
+	unsigned long count, buckets[XB_LAT_BUCKETS];
+	uint64_t sum_us, max_us;
+};
+
+/* live counters; updated from the send and receive paths */
+struct xb_stats {
+	atomic_ulong rx_bytes, tx_bytes, tx_escapes;
+	atomic_ulong rx_frames[256], tx_frames[256];
+	atomic_ulong rx_frame_bytes[256], tx_frame_bytes[256];
+
+	/* when each frame ID was written */
+	atomic_uint_least64_t sent[256];
+	/* only the receiving thread touches these */
+	struct xb_latency latency[XB_LAT_CLASSES];
+
+	FILE *dump_fp;
+	uint32_t dump_ms;
+	uint64_t next_dump;
+};
+
+struct xb_stats_snapshot {
+	uint64_t time_us;
+	unsigned long rx_bytes, tx_bytes, rx_escapes, tx_escapes;
+	/* from the frame decoder */
+	unsigned long csum_errors, resyncs, discarded;
+	unsigned long rx_frames[256], tx_frames[256];
+	unsigned long rx_frame_bytes[256], tx_frame_bytes[256];
+	struct xb_latency latency[XB_LAT_CLASSES];
+
+	/* queue depths right now */
+	unsigned int reader_depth, tx_inflight, sched_pending;
+	unsigned long reader_stalls;
+	size_t txbuf_bytes;
+};
+
+int xb_stats_init(struct xb_ctx *);
+void xb_stats_free(struct xb_ctx *);
+void xb_stats_snapshot(struct xb_ctx *, struct xb_stats_snapshot *);
+void xb_stats_print(const struct xb_stats_snapshot *, FILE *);
+void xb_stats_set_dump(struct xb_ctx *, FILE *, uint32_t);
+void xb_stats_tick(struct xb_ctx *);
+
+void xb_stats_tx(struct xb_ctx *, const uint8_t *, size_t, size_t);
+void xb_stats_rx(struct xb_ctx *, const struct xb_frame *);
+
+#define xb_stats_add(c, n)	atomic_fetch_add_explicit(&(c), (n), memory_order_relaxed)
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "xb_trace.h"
+
+/* seq is 2n+1 while record n is being written, 2n+2 once it is done */
+struct xb_trace_rec {
+	atomic_uint_least64_t seq;
+	uint64_t time_us;
+	uint16_t event, id;
+	uint32_t a, b;
+};
+
+static atomic_uint_least16_t xb_trace_ids;
+
+#if XB_TRACE_LEVEL > 0
+static struct xb_trace_rec xb_trace_ring[XB_TRACE_SLOTS];
+static atomic_uint_least64_t xb_trace_head;
+static FILE *xb_trace_error_fp;
+
+/*
+ * the same clock as xb_time_us(), kept here so the trace needs nothing
+ * else from the library (the frame decoder tests link it alone)
+ */
+static uint64_t
+xb_trace_time_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+#endif
+
+/*
+ * a tag for the records of one context
+ */
+uint16_t
+xb_trace_new_id(void) {
+	return (uint16_t)(atomic_fetch_add(&xb_trace_ids, 1) + 1);
+}
+
+void
+xb_trace(uint16_t id, enum xb_trace_event event, uint32_t a, uint32_t b) {
+#if XB_TRACE_LEVEL > 0
+	struct xb_trace_rec *rec;
+	uint64_t n;
+
+	n = atomic_fetch_add_explicit(&xb_trace_head, 1, memory_order_relaxed);
+	rec = &xb_trace_ring[n & (XB_TRACE_SLOTS - 1)];
+
+	atomic_store_explicit(&rec->seq, n * 2 + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	rec->time_us = xb_trace_time_us();
+	rec->event = (uint16_t)event;
+	rec->id = id;
+	rec->a = a;
+	rec->b = b;
+
+	atomic_store_explicit(&rec->seq, n * 2 + 2, memory_order_release);
+#else
+	(void)id;
+	(void)event;
+	(void)a;
+	(void)b;
+#endif
+}
+
+void
+xb_trace_fail(uint16_t id, enum xb_trace_event event, uint32_t a, uint32_t b) {
+	xb_trace(id, event, a, b);
+#if XB_TRACE_LEVEL > 0
+	if (xb_trace_error_fp) {
+		xb_trace_dump(xb_trace_error_fp);
+	}
+#endif
+}
+
+/*
+ * dump the ring to fp whenever an I/O error is traced; NULL stops it
+ */
+void
+xb_trace_dump_on_error(FILE *fp) {
+#if XB_TRACE_LEVEL > 0
+	xb_trace_error_fp = fp;
+#else
+	(void)fp;
+#endif
+}
+
+#if XB_TRACE_LEVEL > 0
+static void
+xb_trace_print(FILE *fp, const struct xb_trace_rec *rec) {
+	fprintf(fp, "%llu.%06llu %5u ", (unsigned long long)(rec->time_us / 1000000),
+			(unsigned long long)(rec->time_us % 1000000), rec->id);
+
+	switch (rec->event) {
+	case XB_EV_IO_ERROR:
+		fprintf(fp, "%s error: %s\n", rec->b ? "write" : "read", strerror((int)rec->a));
+		break;
+	case XB_EV_CSUM:
+		fprintf(fp, "checksum error in 0x%02x frame (sum 0x%02x)\n", rec->a, rec->b);
+		break;
+	case XB_EV_RESYNC:
+		fprintf(fp, "resync in state %u (length %u)\n", rec->a, rec->b);
+		break;
+	case XB_EV_RX_FRAME:
+	case XB_EV_TX_FRAME:
+		fprintf(fp, "%s frame 0x%02x %02x, %u bytes\n",
+				rec->event == XB_EV_RX_FRAME ? "rx" : "tx",
+				rec->a & 0xff, (rec->a >> 8) & 0xff, rec->b);
+		break;
+	case XB_EV_READ:
+		fprintf(fp, "read %u bytes\n", rec->a);
+		break;
+	case XB_EV_WRITE:
+		fprintf(fp, "wrote %u bytes\n", rec->a);
+		break;
+	case XB_EV_DECODER:
+		fprintf(fp, "decoder %u -> %u\n", rec->a, rec->b);
+		break;
+	default:
+		fprintf(fp, "event %u: 0x%x 0x%x\n", rec->event, rec->a, rec->b);
+		break;
+	}
+}
+#endif
+
+/*
+ * print what the ring holds, oldest first; records being written while
+ * we look are skipped.  Returns how many were printed.
+ */
+int
+xb_trace_dump(FILE *fp) {
+#if XB_TRACE_LEVEL > 0
+	struct xb_trace_rec *slot, rec;
+	uint64_t head, n, s1, s2;
+	int count = 0;
+
+	head = atomic_load_explicit(&xb_trace_head, memory_order_acquire);
+	n = head > XB_TRACE_SLOTS ? head - XB_TRACE_SLOTS : 0;
+
+	for(; n < head; n++) {
+		slot = &xb_trace_ring[n & (XB_TRACE_SLOTS - 1)];
+		s1 = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (s1 != n * 2 + 2) {
+			continue;
+		}
+		rec.time_us = slot->time_us;
+		rec.event = slot->event;
+		rec.id = slot->id;
+		rec.a = slot->a;
+		rec.b = slot->b;
+		atomic_thread_fence(memory_order_acquire);
+		s2 = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+		if (s1 != s2) {
+			continue;
+		}
+
+		xb_trace_print(fp, &rec);
+		count++;
+	}
+	fflush(fp);
+
+	return count;
+#else
+	(void)fp;
+
+	return 0;
+#endif
+}
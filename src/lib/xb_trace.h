@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_TRACE_H
+#define XB_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * in-memory tracing.  configure --enable-trace=LEVEL picks which of the
+ * XB_TRACE_* macros below record anything; the others compile to
+ * nothing, arguments included, so arguments must not have side effects.
+ * Records go into one lock-free ring shared by every context and
+ * thread, read back with xb_trace_dump().
+ */
+#define XB_TRACE_LVL_ERRORS			1	/* I/O failures, checksum errors, resyncs */
+#define XB_TRACE_LVL_FRAMES			2	/* frames, reads and writes */
+#define XB_TRACE_LVL_DECODER			3	/* every decoder state change */
+
+#ifndef XB_TRACE_LEVEL
+#define XB_TRACE_LEVEL				0
+#endif
+
+/* a power of two */
+#define XB_TRACE_SLOTS				4096
+
+enum xb_trace_event {
+	XB_EV_IO_ERROR = 1,	/* errno, 0 reading or 1 writing */
+	XB_EV_CSUM,		/* API identifier, the sum that came out */
+	XB_EV_RESYNC,		/* decoder state, frame length so far */
+	XB_EV_RX_FRAME,		/* API identifier | next byte << 8, length */
+	XB_EV_TX_FRAME,		/* the same */
+	XB_EV_READ,		/* bytes */
+	XB_EV_WRITE,		/* bytes */
+	XB_EV_DECODER,		/* old state, new state */
+};
+
+#if XB_TRACE_LEVEL >= XB_TRACE_LVL_ERRORS
+#define XB_TRACE_ERR(id, ev, a, b)	xb_trace((id), (ev), (uint32_t)(a), (uint32_t)(b))
+/* ... and dump the ring if asked to (xb_trace_dump_on_error) */
+#define XB_TRACE_FAIL(id, ev, a, b)	xb_trace_fail((id), (ev), (uint32_t)(a), (uint32_t)(b))
+#else
+#define XB_TRACE_ERR(id, ev, a, b)	do { } while (0)
+#define XB_TRACE_FAIL(id, ev, a, b)	do { } while (0)
+#endif
+
+#if XB_TRACE_LEVEL >= XB_TRACE_LVL_FRAMES
+#define XB_TRACE_FRAME(id, ev, a, b)	xb_trace((id), (ev), (uint32_t)(a), (uint32_t)(b))
+#else
+#define XB_TRACE_FRAME(id, ev, a, b)	do { } while (0)
+#endif
+
+#if XB_TRACE_LEVEL >= XB_TRACE_LVL_DECODER
+#define XB_TRACE_DEC(id, ev, a, b)	xb_trace((id), (ev), (uint32_t)(a), (uint32_t)(b))
+#else
+#define XB_TRACE_DEC(id, ev, a, b)	do { } while (0)
+#endif
+
+uint16_t xb_trace_new_id(void);
+void xb_trace(uint16_t, enum xb_trace_event, uint32_t, uint32_t);
+void xb_trace_fail(uint16_t, enum xb_trace_event, uint32_t, uint32_t);
+int xb_trace_dump(FILE *);
+void xb_trace_dump_on_error(FILE *);
+
+#endif
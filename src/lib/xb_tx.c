@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_addr.h"
+#include "xb_ctx.h"
+#include "xb_tx.h"
+
+int
+xb_tx_window_init(struct xb_ctx *xctx, unsigned int max) {
+	struct xb_tx_window *win;
+
+	if (!max || max > XB_TX_WINDOW_MAX) {
+		return -1;
+	}
+
+	win = (struct xb_tx_window *)calloc(1, sizeof(struct xb_tx_window));
+	if (!win) {
+		return -1;
+	}
+
+	win->max = max;
+	win->cwnd = max < XB_TX_WINDOW_START ? max : XB_TX_WINDOW_START;
+	win->timeout = XB_TX_TIMEOUT_MS;
+
+	xb_tx_window_free(xctx);
+	xctx->txwin = win;
+
+	return 0;
+}
+
+void
+xb_tx_window_free(struct xb_ctx *xctx) {
+	free(xctx->txwin);
+	xctx->txwin = NULL;
+}
+
+void
+xb_tx_set_status_cb(struct xb_ctx *xctx, xb_tx_status_cb cb, void *arg) {
+	if (xctx->txwin) {
+		xctx->txwin->status_cb = cb;
+		xctx->txwin->status_arg = arg;
+	}
+}
+
+/*
+ * a 0x10 transmit request, or 0x00/0x01 on 802.15.4 firmware; the frame
+ * ID is filled in when it is sent
+ */
+struct xb_buffer *
+xb_create_tx_request(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		const char *data, uint16_t len, uint8_t options) {
+	struct xb_buffer *xbuf;
+	int ret;
+
+	if (dest16 == XB_ADDR16_UNKNOWN && xctx->addr) {
+		dest16 = xb_addr_lookup(xctx, dest64);
+	}
+
+	xbuf = xb_buffer_new();
+	if (!xbuf) {
+		return NULL;
+	}
+
+	if (xctx->fw_family == XB_FW_802_15_4) {
+		if (dest16 != XB_ADDR16_UNKNOWN) {
+			ret = xb_buffer_put_uint8(xbuf, XB_FRAME_TYPE_TX16_REQUEST);
+			ret |= xb_buffer_put_uint8(xbuf, 0);
+			ret |= xb_buffer_put_uint16(xbuf, dest16);
+		}
+		else {
+			ret = xb_buffer_put_uint8(xbuf, XB_FRAME_TYPE_TX64_REQUEST);
+			ret |= xb_buffer_put_uint8(xbuf, 0);
+			ret |= xb_buffer_put_uint64(xbuf, dest64);
+		}
+	}
+	else {
+		ret = xb_buffer_put_uint8(xbuf, XB_FRAME_TYPE_TX_REQUEST);
+		ret |= xb_buffer_put_uint8(xbuf, 0);
+		ret |= xb_buffer_put_uint64(xbuf, dest64);
+		ret |= xb_buffer_put_uint16(xbuf, dest16);
+		/* broadcast radius: maximum hops */
+		ret |= xb_buffer_put_uint8(xbuf, 0);
+	}
+	ret |= xb_buffer_put_uint8(xbuf, options);
+	ret |= xb_buffer_put_data(xbuf, data, len);
+
+	if (ret < 0) {
+		xb_buffer_free(xbuf);
+		return NULL;
+	}
+
+	return xbuf;
+}
+
+int
+xb_tx_in_flight(struct xb_ctx *xctx, uint8_t frame_id) {
+	return xctx->txwin && xctx->txwin->slots[frame_id].in_use;
+}
+
+static void
+xb_tx_release(struct xb_ctx *xctx, uint8_t frame_id, uint8_t status) {
+	struct xb_tx_window *win = xctx->txwin;
+
+	win->slots[frame_id].in_use = 0;
+	win->inflight--;
+
+	if (status == XB_TX_STATUS_SUCCESS) {
+		/* additive increase, once per window's worth of deliveries */
+		if (++win->acked >= win->cwnd) {
+			win->acked = 0;
+			if (win->cwnd < win->max) {
+				win->cwnd++;
+			}
+		}
+	}
+	else {
+		/* multiplicative decrease */
+		win->acked = 0;
+		win->cwnd = win->cwnd > 1 ? win->cwnd / 2 : 1;
+	}
+
+	if (win->status_cb) {
+		win->status_cb(xctx, frame_id, status, win->status_arg);
+	}
+}
+
+/*
+ * give up on frames whose status never came
+ */
+void
+xb_tx_expire(struct xb_ctx *xctx) {
+	struct xb_tx_window *win = xctx->txwin;
+	uint64_t now;
+	unsigned int i;
+
+	if (!win || !win->inflight) {
+		return;
+	}
+
+	now = xb_time_us();
+	for(i = 1; i < 256; i++) {
+		if (win->slots[i].in_use &&
+				now - win->slots[i].sent > (uint64_t)win->timeout * 1000) {
+			xb_tx_release(xctx, (uint8_t)i, XB_TX_STATUS_EXPIRED);
+		}
+	}
+}
+
+/*
+ * when the oldest unanswered frame will be given up on, 0 if none is
+ */
+uint64_t
+xb_tx_next_expiry(struct xb_ctx *xctx) {
+	struct xb_tx_window *win = xctx->txwin;
+	uint64_t due, next = 0;
+	unsigned int i;
+
+	if (!win || !win->inflight) {
+		return 0;
+	}
+
+	for(i = 1; i < 256; i++) {
+		if (win->slots[i].in_use) {
+			due = win->slots[i].sent + (uint64_t)win->timeout * 1000 + 1;
+			if (!next || due < next) {
+				next = due;
+			}
+		}
+	}
+
+	return next;
+}
+
+/*
+ * called for every frame received; releases the slot of a TX status
+ */
+void
+xb_tx_observe(struct xb_ctx *xctx, struct xb_frame *frame) {
+	struct xb_tx_window *win = xctx->txwin;
+	uint8_t frame_id, status;
+
+	switch (frame->data[0]) {
+	case XB_FRAME_TYPE_TX_STATUS:
+		/* 0x8b, frame id, 16-bit dest, retries, delivery, discovery */
+		if (frame->len < 7) {
+			return;
+		}
+		frame_id = frame->data[1];
+		status = frame->data[5];
+		if (win->slots[frame_id].in_use) {
+			/* the radio tells us where it actually went */
+			win->slots[frame_id].dest16 =
+				(uint16_t)((frame->data[2] << 8) | frame->data[3]);
+		}
+		break;
+	case XB_FRAME_TYPE_TX_STATUS_LEGACY:
+		/* 0x89, frame id, status */
+		if (frame->len < 3) {
+			return;
+		}
+		frame_id = frame->data[1];
+		status = frame->data[2];
+		break;
+	default:
+		return;
+	}
+
+	if (frame_id && win->slots[frame_id].in_use) {
+		xb_tx_release(xctx, frame_id, status);
+	}
+}
+
+/*
+ * wait until the window has room, handling whatever arrives meanwhile;
+ * returns 0 with a free slot, -1 on timeout or error
+ */
+int
+xb_tx_wait_slot(struct xb_ctx *xctx, int timeout) {
+	struct xb_tx_window *win = xctx->txwin;
+	struct xb_frame frame;
+	uint64_t deadline;
+	int ret, wait;
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	for(;;) {
+		xb_tx_expire(xctx);
+		if (win->inflight < win->cwnd) {
+			return 0;
+		}
+
+		/* wake up in time to expire the oldest slot */
+		wait = xb_remaining(timeout, deadline);
+		if (wait < 0 || (uint32_t)wait > win->timeout) {
+			wait = (int)win->timeout;
+		}
+
+		if ( (ret = xb_read_frame(xctx, &frame, wait)) < 0) {
+			return -1;
+		}
+		if (ret) {
+			xb_dispatch_frame(xctx, &frame);
+		}
+		else if (timeout >= 0 && xb_remaining(timeout, deadline) == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+}
+
+/*
+ * send a prepared request frame (its second byte is the frame ID) through
+ * the window; returns the frame ID used
+ */
+int
+xb_tx_send_buffer(struct xb_ctx *xctx, struct xb_buffer *xbuf,
+		uint64_t dest64, uint16_t dest16, int flags) {
+	struct xb_tx_window *win = xctx->txwin;
+	uint8_t frame_id;
+
+	if (win && xb_tx_wait_slot(xctx, (flags & XB_TX_NONBLOCK) ? 0 : -1) < 0) {
+		return -1;
+	}
+
+	frame_id = xb_next_frame_id(xctx);
+	xb_buffer_set_frame_id(xbuf, frame_id);
+	if (xb_buffer_set_uint8(xbuf, 1, frame_id) < 0 || xb_send(xctx, xbuf) < 0) {
+		return -1;
+	}
+
+	if (win) {
+		win->slots[frame_id].in_use = 1;
+		win->slots[frame_id].dest64 = dest64;
+		win->slots[frame_id].dest16 = dest16;
+		win->slots[frame_id].sent = xb_time_us();
+		win->inflight++;
+	}
+
+	return frame_id;
+}
+
+int
+xb_tx_send(struct xb_ctx *xctx, uint64_t dest64, uint16_t dest16,
+		const char *data, uint16_t len, int flags) {
+	struct xb_buffer *xbuf;
+	int ret;
+
+	xbuf = xb_create_tx_request(xctx, dest64, dest16, data, len, 0);
+	if (!xbuf) {
+		return -1;
+	}
+
+	ret = xb_tx_send_buffer(xctx, xbuf, dest64, dest16, flags);
+	xb_buffer_free(xbuf);
+
+	return ret;
+}
+
+/*
+ * wait for every frame in flight to be accounted for
+ */
+int
+xb_tx_drain(struct xb_ctx *xctx, int timeout) {
+	struct xb_tx_window *win = xctx->txwin;
+	struct xb_frame frame;
+	uint64_t deadline;
+	int ret, wait;
+
+	if (!win) {
+		return 0;
+	}
+
+	deadline = xb_time_us() + (uint64_t)timeout * 1000;
+
+	while (win->inflight) {
+		wait = xb_remaining(timeout, deadline);
+		if (wait == 0) {
+			return -1;
+		}
+		if (wait < 0 || (uint32_t)wait > win->timeout) {
+			wait = (int)win->timeout;
+		}
+
+		if ( (ret = xb_read_frame(xctx, &frame, wait)) < 0) {
+			return -1;
+		}
+		if (ret) {
+			xb_dispatch_frame(xctx, &frame);
+		}
+		xb_tx_expire(xctx);
+	}
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2011  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XB_TX_H
+#define XB_TX_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "xb_ctx.h"
+
+#define XB_ADDR64_COORDINATOR			0x0000000000000000ULL
+#define XB_ADDR64_BROADCAST			0x000000000000ffffULL
+#define XB_ADDR16_UNKNOWN			0xfffe
+/* ours: the sender only gave its 16-bit address */
+#define XB_ADDR64_UNKNOWN			0xffffffffffffffffULL
+
+/* 802.15.4 firmware has its own TX request frames */
+#define XB_FRAME_TYPE_TX64_REQUEST		0x00
+#define XB_FRAME_TYPE_TX16_REQUEST		0x01
+
+/* the 0x10 request header, and the most data one can carry in a frame */
+#define XB_TX_HDR_LEN				14
+#define XB_TX_PAYLOAD_MAX			(XB_FRAME_MAX - 4 - XB_TX_HDR_LEN)
+
+/* TX request options field */
+#define XB_TX_OPT_DISABLE_ACK			0x01
+#define XB_TX_OPT_EXTENDED_TIMEOUT		0x40
+
+/* delivery status from a TX status frame */
+#define XB_TX_STATUS_SUCCESS			0x00
+#define XB_TX_STATUS_PAYLOAD_TOO_LARGE		0x74
+/* ours: the radio never reported back */
+#define XB_TX_STATUS_EXPIRED			0xff
+
+/*
+ * frames in flight: the window opens by one per window's worth of
+ * deliveries and halves on a failure, between 1 and max
+ */
+#define XB_TX_WINDOW_MAX			128
+#define XB_TX_WINDOW_DEFAULT			8
+#define XB_TX_WINDOW_START			4
+/* longest a ZigBee unicast can take with retries and route discovery */
+#define XB_TX_TIMEOUT_MS			10000
+
+/* xb_tx_send flags */
+#define XB_TX_NONBLOCK				(1 << 0)
+
+typedef void (*xb_tx_status_cb)(struct xb_ctx *, uint8_t, uint8_t, void *);
+
+/*
+ * the window belongs to the thread that reads the context's frames:
+ * sending through it, xb_tx_wait_slot() and xb_tx_drain() read frames
+ * and touch the slots without a lock.  Other threads queue their frames
+ * with xb_sched_enqueue() or xb_sched_tx() instead.  Only in_use may be
+ * looked at from anywhere (xb_next_frame_id() does).
+ */
+struct xb_tx_slot {
+	atomic_int in_use;
+	uint64_t dest64;
+	uint16_t dest16;
+	uint64_t sent;
+};
+
+struct xb_tx_window {
+	unsigned int max, cwnd, inflight, acked;
+	uint32_t timeout;
+
+	/* indexed by frame ID */
+	struct xb_tx_slot slots[256];
+
+	xb_tx_status_cb status_cb;
+	void *status_arg;
+};
+
+int xb_tx_window_init(struct xb_ctx *, unsigned int);
+void xb_tx_window_free(struct xb_ctx *);
+void xb_tx_set_status_cb(struct xb_ctx *, xb_tx_status_cb, void *);
+
+struct xb_buffer *xb_create_tx_request(struct xb_ctx *, uint64_t, uint16_t,
+		const char *, uint16_t, uint8_t);
+
+int xb_tx_in_flight(struct xb_ctx *, uint8_t);
+int xb_tx_wait_slot(struct xb_ctx *, int);
+int xb_tx_send_buffer(struct xb_ctx *, struct xb_buffer *, uint64_t, uint16_t, int);
+int xb_tx_send(struct xb_ctx *, uint64_t, uint16_t, const char *, uint16_t, int);
+int xb_tx_drain(struct xb_ctx *, int);
+
+void xb_tx_expire(struct xb_ctx *);
+uint64_t xb_tx_next_expiry(struct xb_ctx *);
+void xb_tx_observe(struct xb_ctx *, struct xb_frame *);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * test_frame: the API frame decoder and frame parsers
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "xb_ctx.h"
+#include "xb_frame.h"
+#include "xb_tx.h"
+
+static int failures;
+
+#define check(cond, what) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, what, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/*
+ * delimiter, length, data, checksum; escaped for API mode 2
+ */
+static struct buffer *
+packet(const uint8_t *data, uint16_t len, int escaped) {
+	struct buffer *buf, *esc;
+	uint8_t csum = 0;
+	uint16_t i;
+
+	buf = buffer_new(len + 4);
+	buf->data[buf->writepos++] = (char)XB_FRAME_DELIM;
+	buf->data[buf->writepos++] = (char)(len >> 8);
+	buf->data[buf->writepos++] = (char)len;
+	for(i = 0; i < len; i++) {
+		buf->data[buf->writepos++] = (char)data[i];
+		csum += data[i];
+	}
+	buf->data[buf->writepos++] = (char)(0xff - csum);
+
+	if (!escaped) {
+		return buf;
+	}
+	esc = xb_frame_escape(buf);
+	buffer_free(buf);
+
+	return esc;
+}
+
+/*
+ * feed len bytes in chunks of step; returns the number of frames, the
+ * last of which is left in dec->frame
+ */
+static int
+feed(struct xb_decoder *dec, const char *data, size_t len, size_t step) {
+	size_t off, n, used;
+	int done, frames = 0;
+
+	for(off = 0; off < len; off += n) {
+		n = len - off < step ? len - off : step;
+		for(used = 0; used < n; ) {
+			used += xb_decoder_feed(dec, (const uint8_t *)data + off + used, n - used, &done);
+			frames += done;
+		}
+	}
+
+	return frames;
+}
+
+static void
+round_trip(int escaped) {
+	/* every byte that needs escaping, in the data and the length */
+	static const uint8_t data[] = { 0x90, 0x7e, 0x7d, 0x11, 0x13, 0x00, 0xff, 0x7e };
+	struct xb_decoder dec;
+	struct buffer *buf;
+	size_t step;
+
+	buf = packet(data, sizeof(data), escaped);
+	for(step = 1; step <= buf->writepos; step++) {
+		xb_decoder_init(&dec, escaped);
+		check(feed(&dec, buf->data, buf->writepos, step) == 1, "round trip");
+		check(dec.frame.len == sizeof(data) && !memcmp(dec.frame.data, data, sizeof(data)),
+				"round trip");
+	}
+	check(escaped || dec.escapes == 0, "escapes");
+	check(!escaped || dec.escapes > 0, "escapes");
+	buffer_free(buf);
+}
+
+static void
+bad_input(void) {
+	static const uint8_t data[] = { 0x88, 0x01, 'N', 'P', 0x00 };
+	struct xb_decoder dec;
+	struct buffer *good, *bad;
+	char stream[64];
+	size_t n;
+
+	good = packet(data, sizeof(data), 1);
+	bad = packet(data, sizeof(data), 1);
+	bad->data[bad->writepos - 1] ^= 0x01;
+
+	/* a bad checksum is dropped and the next frame still decodes */
+	xb_decoder_init(&dec, 1);
+	memcpy(stream, bad->data, bad->writepos);
+	memcpy(stream + bad->writepos, good->data, good->writepos);
+	check(feed(&dec, stream, bad->writepos + good->writepos, 1) == 1, "checksum");
+	check(dec.csum_errors == 1, "checksum");
+
+	/* noise before a frame, and a frame cut short by the next one */
+	xb_decoder_init(&dec, 1);
+	n = 0;
+	memcpy(stream + n, "junk", 4);
+	n += 4;
+	memcpy(stream + n, good->data, 4);
+	n += 4;
+	memcpy(stream + n, good->data, good->writepos);
+	n += good->writepos;
+	check(feed(&dec, stream, n, 3) == 1, "resync");
+	check(dec.frame.len == sizeof(data) && !memcmp(dec.frame.data, data, sizeof(data)),
+			"resync");
+	check(dec.discarded == 4 && dec.resyncs == 1, "resync");
+
+	/* lengths of 0 or past XB_FRAME_MAX are not frames */
+	xb_decoder_init(&dec, 0);
+	memcpy(stream, "\x7e\x00\x00\x7e\xff\xff", 6);
+	memcpy(stream + 6, good->data, good->writepos);
+	check(feed(&dec, stream, 6 + good->writepos, 1) == 1, "length");
+	check(dec.resyncs == 2, "length");
+
+	buffer_free(good);
+	buffer_free(bad);
+}
+
+static void
+parsers(void) {
+	/* 0x90 from 0013a20040000001/0x1234, options 0x01, "hi" */
+	static const uint8_t rx90[] = { 0x90, 0x00, 0x13, 0xa2, 0x00, 0x40, 0x00, 0x00, 0x01,
+		0x12, 0x34, 0x01, 'h', 'i' };
+	/* 0x81 (RX16) from 0x5678, RSSI, options, "x" */
+	static const uint8_t rx81[] = { 0x81, 0x56, 0x78, 0x28, 0x00, 'x' };
+	struct xb_frame frame;
+	struct xb_rx rx;
+
+	frame.len = sizeof(rx90);
+	memcpy(frame.data, rx90, sizeof(rx90));
+	check(xb_frame_rx(&frame, &rx) == 0, "rx");
+	check(rx.src64 == 0x0013a20040000001ULL && rx.src16 == 0x1234, "rx");
+	check(rx.options == 0x01 && rx.len == 2 && !memcmp(rx.data, "hi", 2), "rx");
+	check(xb_frame_id(&frame) < 0, "rx id");
+
+	frame.len = sizeof(rx81);
+	memcpy(frame.data, rx81, sizeof(rx81));
+	check(xb_frame_rx(&frame, &rx) == 0, "rx16");
+	check(rx.src64 == XB_ADDR64_UNKNOWN && rx.src16 == 0x5678, "rx16");
+	check(rx.len == 1 && rx.data[0] == 'x', "rx16");
+
+	/* too short to carry its header */
+	frame.len = 4;
+	check(xb_frame_rx(&frame, &rx) < 0, "rx16 short");
+
+	frame.len = 3;
+	memcpy(frame.data, "\x8b\x2a\x00", 3);
+	check(xb_frame_id(&frame) == 0x2a, "tx status id");
+	memcpy(frame.data, "\x08\x07N", 3);
+	check(xb_frame_id(&frame) == 0x07, "at id");
+	memcpy(frame.data, "\x00\x05\x00", 3);
+	check(xb_frame_id(&frame) == 0x05, "tx64 id");
+	memcpy(frame.data, "\x01\x06\x00", 3);
+	check(xb_frame_id(&frame) == 0x06, "tx16 id");
+}
+
+static void
+byte_order(void) {
+	uint8_t b[8];
+
+	xb_put_be(b, 0x0013a20040a1b2c3ULL, 8);
+	check(!memcmp(b, "\x00\x13\xa2\x00\x40\xa1\xb2\xc3", 8), "put 8");
+	check(xb_get_be(b, 8) == 0x0013a20040a1b2c3ULL, "get 8");
+	xb_put_be(b, 0xfffe, 2);
+	check(b[0] == 0xff && b[1] == 0xfe && xb_get_be(b, 2) == 0xfffe, "2 bytes");
+	xb_put_le(b, 0x0013a20040a1b2c3ULL, 8);
+	check(!memcmp(b, "\xc3\xb2\xa1\x40\x00\xa2\x13\x00", 8), "put le 8");
+	check(xb_get_le(b, 8) == 0x0013a20040a1b2c3ULL, "get le 8");
+}
+
+int
+main(void) {
+	round_trip(0);
+	round_trip(1);
+	bad_input();
+	parsers();
+	byte_order();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// vim: cindent
@@ -0,0 +1,160 @@
+/*
+ * test_lz: round trips and bad input for the LZ codec
+ * Copyright (C) 2013  Joshua Roys
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xb_lz.h"
+
+#define BUF_MAX		8192
+
+static int failures;
+
+#define check(cond, what) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, what, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static uint8_t comp[BUF_MAX * 2], plain[BUF_MAX];
+
+static void
+round_trip(const char *what, const uint8_t *dict, size_t dlen, const uint8_t *in, size_t len) {
+	size_t clen;
+	int ret;
+
+	clen = xb_lz_compress(dict, dlen, in, len, comp, sizeof(comp));
+	check(clen > 0 || len == 0, what);
+
+	ret = xb_lz_decompress(dict, dlen, comp, clen, plain, sizeof(plain));
+	check(ret == (int)len, what);
+	check(ret < 0 || !memcmp(plain, in, len), what);
+
+	/* exactly enough room, then one byte short */
+	if (len) {
+		check(xb_lz_decompress(dict, dlen, comp, clen, plain, len) == (int)len, what);
+		check(xb_lz_decompress(dict, dlen, comp, clen, plain, len - 1) < 0, what);
+	}
+}
+
+/*
+ * every prefix of a stream must decode to a prefix of the input or be
+ * refused, never run past either buffer
+ */
+static void
+truncated(const uint8_t *in, size_t len) {
+	size_t clen, n;
+	int ret;
+
+	clen = xb_lz_compress(NULL, 0, in, len, comp, sizeof(comp));
+	check(clen > 0, "truncated");
+
+	for(n = 0; n < clen; n++) {
+		ret = xb_lz_decompress(NULL, 0, comp, n, plain, sizeof(plain));
+		check(ret < (int)len, "truncated");
+		check(ret < 0 || !memcmp(plain, in, (size_t)ret), "truncated");
+	}
+}
+
+static void
+corrupt(void) {
+	/* a match before there is any output */
+	static const uint8_t early[] = { 0x80, 0x00, 0x01 };
+	/* a distance of 0 */
+	static const uint8_t zero[] = { 0x00, 'a', 0x80, 0x00, 0x00 };
+	/* a distance past what was written */
+	static const uint8_t far[] = { 0x01, 'a', 'b', 0x80, 0x00, 0x03 };
+	/* more literals promised than given */
+	static const uint8_t shortlit[] = { 0x10, 'a', 'b' };
+	/* a match missing its distance */
+	static const uint8_t nodist[] = { 0x00, 'a', 0x81, 0x00 };
+	/* a match overlapping itself is fine: "ab" then 6 more */
+	static const uint8_t overlap[] = { 0x01, 'a', 'b', 0x83, 0x00, 0x02 };
+	uint8_t junk[512];
+	size_t i, j;
+	int ret;
+
+	check(xb_lz_decompress(NULL, 0, early, sizeof(early), plain, sizeof(plain)) < 0, "early");
+	check(xb_lz_decompress(NULL, 0, zero, sizeof(zero), plain, sizeof(plain)) < 0, "zero");
+	check(xb_lz_decompress(NULL, 0, far, sizeof(far), plain, sizeof(plain)) < 0, "far");
+	check(xb_lz_decompress(NULL, 0, shortlit, sizeof(shortlit), plain, sizeof(plain)) < 0, "shortlit");
+	check(xb_lz_decompress(NULL, 0, nodist, sizeof(nodist), plain, sizeof(plain)) < 0, "nodist");
+
+	ret = xb_lz_decompress(NULL, 0, overlap, sizeof(overlap), plain, sizeof(plain));
+	check(ret == 8 && !memcmp(plain, "abababab", 8), "overlap");
+
+	/* random garbage must not crash or overrun a small output */
+	srand(1);
+	for(i = 0; i < 2000; i++) {
+		for(j = 0; j < sizeof(junk); j++) {
+			junk[j] = (uint8_t)rand();
+		}
+		ret = xb_lz_decompress(NULL, 0, junk, (size_t)rand() % sizeof(junk), plain, 64);
+		check(ret <= 64, "junk");
+	}
+}
+
+int
+main(void) {
+	static const char text[] =
+		"temperature=21.5 humidity=40 battery=3.01 "
+		"temperature=21.6 humidity=41 battery=3.01 "
+		"temperature=21.6 humidity=41 battery=3.00";
+	static const char dict[] = "temperature= humidity= battery=";
+	uint8_t in[BUF_MAX];
+	size_t i, clen;
+
+	round_trip("empty", NULL, 0, (const uint8_t *)"", 0);
+	round_trip("one byte", NULL, 0, (const uint8_t *)"x", 1);
+	round_trip("text", NULL, 0, (const uint8_t *)text, sizeof(text) - 1);
+	round_trip("text with dict", (const uint8_t *)dict, sizeof(dict) - 1,
+			(const uint8_t *)text, sizeof(text) - 1);
+
+	/* long literal runs and long matches both split into several tokens */
+	srand(2);
+	for(i = 0; i < sizeof(in); i++) {
+		in[i] = (uint8_t)rand();
+	}
+	round_trip("random", NULL, 0, in, sizeof(in));
+	memset(in, 'z', sizeof(in));
+	round_trip("run", NULL, 0, in, sizeof(in));
+	for(i = 0; i < sizeof(in); i++) {
+		in[i] = (uint8_t)(i % 251);
+	}
+	round_trip("pattern", NULL, 0, in, sizeof(in));
+
+	/* the dictionary has to help, and only the same one decodes it */
+	clen = xb_lz_compress((const uint8_t *)dict, sizeof(dict) - 1,
+			(const uint8_t *)text, sizeof(text) - 1, comp, sizeof(comp));
+	check(clen < xb_lz_compress(NULL, 0, (const uint8_t *)text, sizeof(text) - 1,
+				comp + clen, sizeof(comp) - clen), "dict");
+	check(xb_lz_decompress(NULL, 0, comp, clen, plain, sizeof(plain)) != sizeof(text) - 1 ||
+			memcmp(plain, text, sizeof(text) - 1), "no dict");
+
+	/* output that does not fit is refused */
+	check(xb_lz_compress(NULL, 0, (const uint8_t *)text, sizeof(text) - 1, comp, 8) == 0, "small out");
+
+	truncated((const uint8_t *)text, sizeof(text) - 1);
+	corrupt();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// vim: cindent